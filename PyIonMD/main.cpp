@@ -1,16 +1,208 @@
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+#include <vector>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 
 #include <ionmd/params.hpp>
 #include <ionmd/simulation.hpp>
 #include <ionmd/trap.hpp>
+#include <ionmd/ensemble.hpp>
+#include <ionmd/replicas.hpp>
+#include <ionmd/field.hpp>
 
 namespace py = pybind11;
 
 using ionmd::SimParams;
 using ionmd::Simulation;
+using ionmd::Ion;
 using ionmd::SimStatus;
 using ionmd::Trap;
+using ionmd::Ensemble;
+using ionmd::IonSpec;
+using ionmd::ReplicaBatch;
+using ionmd::MinimizeOptions;
+using ionmd::MinimizeResult;
+using ionmd::LostIon;
+using ionmd::Reaction;
+
+typedef std::vector<std::tuple<double, double, std::vector<double>>> ion_tuples;
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> double_array;
+
+
+/// Convert (m, Z, [x, y, z]) tuples to ion specifications.
+std::vector<IonSpec> to_specs(const ion_tuples &ions)
+{
+    std::vector<IonSpec> specs;
+    for (const auto &ion: ions) {
+        specs.push_back({std::get<0>(ion), std::get<1>(ion), std::get<2>(ion), {}});
+    }
+    return specs;
+}
+
+
+/**
+ * Copy a 3 x N matrix (one column per ion) into an N x 3 NumPy array. Both
+ * have the same memory layout.
+ */
+py::array_t<double> to_numpy(const arma::mat &columns)
+{
+    py::array_t<double> result(std::vector<size_t>{columns.n_cols, columns.n_rows});
+    std::memcpy(result.mutable_data(), columns.memptr(), columns.n_elem * sizeof(double));
+    return result;
+}
+
+
+/**
+ * Copy a vector member (x, v or a) of all ions of a simulation into an
+ * (ions, 3) NumPy array. Views would dangle: ion storage moves or shrinks
+ * when ions are added, restored or placed on NUMA nodes and when events or
+ * escapes change the number of ions during a run. Ions are only read between
+ * runs: `run` releases the GIL, so another Python thread could otherwise copy
+ * them while they are updated.
+ * @param sim
+ * @param member
+ */
+py::array_t<double> ion_state(Simulation &sim, arma::vec Ion::*member)
+{
+    if (sim.status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't read ions while the simulation is running");
+    }
+
+    const auto &ions = sim.get_ions();
+    py::array_t<double> result(std::vector<size_t>{ions.size(), 3});
+    auto data = result.mutable_data();
+    for (size_t i = 0; i < ions.size(); i++) {
+        std::copy_n((ions[i].*member).memptr(), 3, data + 3*i);
+    }
+    return result;
+}
+
+
+/**
+ * Set a vector member (x or v) of all ions of a simulation from an (ions, 3)
+ * array between runs.
+ * @param sim
+ * @param member
+ * @param values
+ */
+void set_ion_state(Simulation &sim, arma::vec Ion::*member, const double_array &values)
+{
+    if (sim.status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't change ions while the simulation is running");
+    }
+
+    auto &ions = sim.get_ions();
+    if (values.ndim() != 2 || size_t(values.shape(0)) != ions.size() || values.shape(1) != 3) {
+        throw std::invalid_argument("Values must have shape (ions, 3)");
+    }
+
+    const auto data = values.data();
+    for (size_t i = 0; i < ions.size(); i++) {
+        std::copy_n(data + 3*i, 3, (ions[i].*member).memptr());
+    }
+}
+
+
+/**
+ * Add ions from NumPy arrays in one call.
+ * @param sim
+ * @param masses One mass per ion or a single mass
+ * @param charges One charge (in e) per ion or a single charge
+ * @param positions Initial positions with shape (ions, 3)
+ */
+void add_ions(Simulation &sim, const double_array &masses,
+              const double_array &charges, const double_array &positions)
+{
+    if (positions.ndim() != 2 || positions.shape(1) != 3) {
+        throw std::invalid_argument("Positions must have shape (ions, 3)");
+    }
+
+    // Copy the (usually scalar) masses and charges, but view the positions:
+    // a C-ordered (ions, 3) array is a 3 x ions matrix in column-major order.
+    const std::vector<double> m(masses.data(), masses.data() + masses.size());
+    const std::vector<double> Z(charges.data(), charges.data() + charges.size());
+    const arma::mat x0(const_cast<double *>(positions.data()), 3, positions.shape(0),
+                       false, true);
+    sim.add_ions(m, Z, x0);
+}
+
+
+/**
+ * Copy the most recent frames from the simulation's in-memory ring into NumPy
+ * arrays. Returns a tuple of time step indices and positions with shape
+ * (frames, ions, 3), oldest first.
+ * @param sim
+ * @param max_frames Maximum number of frames to return (0 for all available)
+ */
+py::tuple latest_frames(const Simulation &sim, size_t max_frames)
+{
+    auto ring = sim.get_ring();
+    if (!ring) {
+        throw std::runtime_error("No in-memory frames (set params.ring_size)");
+    }
+
+    // The ring only grows while a run is in progress, so at least this many
+    // frames will be available when copying.
+    auto num_frames = ring->size();
+    if (max_frames > 0) {
+        num_frames = std::min(num_frames, max_frames);
+    }
+    const size_t num_ions = ring->get_frame_size() / 3;
+
+    py::array_t<unsigned int> steps(num_frames);
+    py::array_t<double> positions(std::vector<size_t>{num_frames, num_ions, 3});
+    auto steps_ptr = steps.mutable_data();
+    auto positions_ptr = positions.mutable_data();
+
+    {
+        py::gil_scoped_release release;
+        ring->copy_latest(positions_ptr, steps_ptr, num_frames);
+    }
+
+    return py::make_tuple(steps, positions);
+}
+
+
+/**
+ * Compute normal modes and return their angular frequencies and mode vectors
+ * as arrays of shape (modes,) and (modes, ions, 3).
+ */
+py::tuple normal_modes(Simulation &sim, unsigned int num_modes)
+{
+    ionmd::NormalModes modes;
+    {
+        py::gil_scoped_release release;
+        modes = sim.normal_modes(num_modes);
+    }
+
+    const size_t count = modes.frequencies.n_elem;
+    py::array_t<double> frequencies(count);
+    py::array_t<double> vectors(std::vector<size_t>{count, modes.vectors.n_rows / 3, 3});
+    std::memcpy(frequencies.mutable_data(), modes.frequencies.memptr(), count * sizeof(double));
+    std::memcpy(vectors.mutable_data(), modes.vectors.memptr(), modes.vectors.n_elem * sizeof(double));
+    return py::make_tuple(frequencies, vectors);
+}
+
+
+/**
+ * Write an electrode potential grid from an array of shape (nz, ny, nx), so
+ * that x varies fastest in memory.
+ */
+void write_field_grid(const std::string &filename, const double_array &values,
+                      const std::vector<double> &origin, const std::vector<double> &spacing)
+{
+    if (values.ndim() != 3 || origin.size() != 3 || spacing.size() != 3) {
+        throw std::invalid_argument("Need a 3D grid with 3D origin and spacing");
+    }
+    const std::array<size_t, 3> size = {size_t(values.shape(2)), size_t(values.shape(1)),
+                                        size_t(values.shape(0))};
+    ionmd::write_field_grid(filename, size, {origin[0], origin[1], origin[2]},
+                            {spacing[0], spacing[1], spacing[2]},
+                            std::vector<double>(values.data(), values.data() + values.size()));
+}
 
 
 PYBIND11_PLUGIN(ionmd)
@@ -31,10 +223,50 @@ PYBIND11_PLUGIN(ionmd)
         .def_readwrite("micromotion_enabled", &SimParams::micromotion_enabled)
         .def_readwrite("stochastic_enabled", &SimParams::stochastic_enabled)
         .def_readwrite("doppler_enabled", &SimParams::doppler_enabled)
-        .def_readwrite("filename", &SimParams::filename)
+        .def_readwrite("check_bounds", &SimParams::check_bounds)
+        .def_readwrite("field_maps", &SimParams::field_maps)
+        .def_readwrite("field_dc", &SimParams::field_dc)
+        .def_readwrite("field_rf", &SimParams::field_rf)
+        .def_readwrite("path", &SimParams::path)
         .def_readwrite("buffer_size", &SimParams::buffer_size)
+        .def_readwrite("compress_trajectories", &SimParams::compress_trajectories)
+        .def_readwrite("trajectory_precision", &SimParams::trajectory_precision)
+        .def_readwrite("checkpoint_interval", &SimParams::checkpoint_interval)
+        .def_readwrite("seed", &SimParams::seed)
+        .def_readwrite("write_output", &SimParams::write_output)
+        .def_readwrite("ring_size", &SimParams::ring_size)
+        .def_readwrite("ring_decimation", &SimParams::ring_decimation)
+        .def_readwrite("observables_interval", &SimParams::observables_interval)
+        .def_readwrite("observables", &SimParams::observables)
+        .def_readwrite("structure_factor_k", &SimParams::structure_factor_k)
+        .def_readwrite("spectrum_interval", &SimParams::spectrum_interval)
+        .def_readwrite("spectrum_block", &SimParams::spectrum_block)
+        .def_readwrite("spectrum_overlap", &SimParams::spectrum_overlap)
+        .def_readwrite("spectrum_axes", &SimParams::spectrum_axes)
+        .def_readwrite("spectrum_modes", &SimParams::spectrum_modes)
+        .def_readwrite("image_interval", &SimParams::image_interval)
+        .def_readwrite("image_exposure", &SimParams::image_exposure)
+        .def_readwrite("image_size", &SimParams::image_size)
+        .def_readwrite("image_pixel_size", &SimParams::image_pixel_size)
+        .def_readwrite("image_center", &SimParams::image_center)
+        .def_readwrite("image_horizontal", &SimParams::image_horizontal)
+        .def_readwrite("image_vertical", &SimParams::image_vertical)
+        .def_readwrite("image_psf_sigma", &SimParams::image_psf_sigma)
+        .def_readwrite("image_scattering", &SimParams::image_scattering)
+        .def_readwrite("coulomb_tile_i", &SimParams::coulomb_tile_i)
+        .def_readwrite("coulomb_tile_j", &SimParams::coulomb_tile_j)
+        .def_readwrite("coulomb_mixed_precision", &SimParams::coulomb_mixed_precision)
+        .def_readwrite("reorder_interval", &SimParams::reorder_interval)
+        .def_readwrite("reorder_curve", &SimParams::reorder_curve)
+        .def_readwrite("perf_counters", &SimParams::perf_counters)
+        .def_readwrite("perf_events", &SimParams::perf_events)
+        .def_readwrite("thread_affinity", &SimParams::thread_affinity)
+        .def_readwrite("numa_first_touch", &SimParams::numa_first_touch)
         .def("__str__", &SimParams::to_string);
 
+    m.def("write_field_grid", &write_field_grid,
+          py::arg("filename"), py::arg("values"), py::arg("origin"), py::arg("spacing"));
+
     py::class_<Trap>(m, "Trap")
         .def(py::init())
         .def_readwrite("r0", &Trap::r0)
@@ -45,6 +277,23 @@ PYBIND11_PLUGIN(ionmd)
         .def_readwrite("U_dc", &Trap::U_dc)
         .def_readwrite("U_ec", &Trap::U_ec);
 
+    py::class_<MinimizeResult>(m, "MinimizeResult")
+        .def_readonly("iterations", &MinimizeResult::iterations)
+        .def_readonly("energy", &MinimizeResult::energy)
+        .def_readonly("max_force", &MinimizeResult::max_force)
+        .def_readonly("converged", &MinimizeResult::converged);
+
+    py::class_<LostIon>(m, "LostIon")
+        .def_readonly("id", &LostIon::id)
+        .def_readonly("step", &LostIon::step)
+        .def_readonly("t", &LostIon::t)
+        .def_readonly("m", &LostIon::m)
+        .def_readonly("Z", &LostIon::Z)
+        .def_property_readonly("x",
+             [](const LostIon &ion) { return arma::conv_to<std::vector<double>>::from(ion.x); })
+        .def_property_readonly("v",
+             [](const LostIon &ion) { return arma::conv_to<std::vector<double>>::from(ion.v); });
+
     py::class_<Simulation>(m, "Simulation")
         .def(py::init())
         .def_property("params", &Simulation::get_params, &Simulation::set_params)
@@ -53,7 +302,162 @@ PYBIND11_PLUGIN(ionmd)
         .def("set_params", &Simulation::set_params)
         .def("set_trap", &Simulation::set_trap)
         .def("add_ion", &Simulation::add_ion)
-        .def("start", &Simulation::start);
+        .def("add_ions", &add_ions,
+             "Add ions from arrays of masses, charges and (ions, 3) positions. "
+             "Masses and charges may also be single values for all ions.",
+             py::arg("masses"), py::arg("charges"), py::arg("positions"))
+        .def_property("positions",
+             [](Simulation &sim) { return ion_state(sim, &Ion::x); },
+             [](Simulation &sim, const double_array &x) { set_ion_state(sim, &Ion::x, x); },
+             "Positions of all ions as an (ions, 3) array. This is a copy: "
+             "assign a whole array to change positions. Raises while running.")
+        .def_property("velocities",
+             [](Simulation &sim) { return ion_state(sim, &Ion::v); },
+             [](Simulation &sim, const double_array &v) { set_ion_state(sim, &Ion::v, v); },
+             "Velocities of all ions as an (ions, 3) array. This is a copy: "
+             "assign a whole array to change velocities. Raises while running.")
+        .def_property_readonly("accelerations",
+             [](Simulation &sim) { return ion_state(sim, &Ion::a); },
+             "Accelerations of all ions as an (ions, 3) array (a copy). Raises "
+             "while running.")
+        .def("run",
+             [](Simulation &sim)
+             {
+                 py::gil_scoped_release release;
+                 sim.run();
+             })
+        .def("step",
+             [](Simulation &sim, unsigned int n)
+             {
+                 py::gil_scoped_release release;
+                 sim.step(n);
+             },
+             "Advance by n time steps, continuing the output of previous calls",
+             py::arg("n") = 1)
+        .def("finish", &Simulation::finish)
+        .def("start", &Simulation::start)
+        .def("checkpoint", &Simulation::checkpoint)
+        .def("restore", &Simulation::restore)
+        .def("mixed_precision_error", &Simulation::mixed_precision_error)
+        .def("minimize",
+             [](Simulation &sim, const std::string &method,
+                unsigned int max_iterations, double tolerance, unsigned int history)
+             {
+                 MinimizeOptions options;
+                 options.method = method;
+                 options.max_iterations = max_iterations;
+                 options.tolerance = tolerance;
+                 options.history = history;
+                 py::gil_scoped_release release;
+                 return sim.minimize(options);
+             },
+             "Move ions to a minimum of the trap and Coulomb potential energy "
+             "with FIRE (\"fire\") or L-BFGS (\"lbfgs\")",
+             py::arg("method") = MinimizeOptions().method,
+             py::arg("max_iterations") = MinimizeOptions().max_iterations,
+             py::arg("tolerance") = MinimizeOptions().tolerance,
+             py::arg("history") = MinimizeOptions().history)
+        .def("normal_modes", &normal_modes,
+             "Angular frequencies and (modes, ions, 3) mass-weighted vectors of "
+             "the normal modes about the current positions; only the lowest "
+             "num_modes modes (with Lanczos) unless 0",
+             py::arg("num_modes") = 0)
+        .def("profile", [](const Simulation &sim) { return sim.get_profile().totals(); })
+        .def("perf_counters", &Simulation::get_perf_counters)
+        .def("lost_ions", &Simulation::get_lost_ions,
+             "Ions removed from the simulation, with their state when removed")
+        .def("schedule_loading",
+             [](Simulation &sim, double t, double m, double Z,
+                const std::vector<double> &x0, const std::vector<double> &v0)
+             {
+                 return sim.schedule_loading(t, m, Z, x0, v0);
+             },
+             "Load an ion at time t of the next run; returns its index",
+             py::arg("t"), py::arg("m"), py::arg("Z"), py::arg("x0"),
+             py::arg("v0") = std::vector<double>{0, 0, 0})
+        .def("schedule_removal", &Simulation::schedule_removal,
+             "Remove the ion with the given index at time t",
+             py::arg("t"), py::arg("id"))
+        .def("schedule_reaction",
+             [](Simulation &sim, double t, size_t id, double m, double Z)
+             {
+                 sim.schedule_reaction(t, id, m, Z);
+             },
+             "Change the mass and charge of the ion with the given index at time t",
+             py::arg("t"), py::arg("id"), py::arg("m"), py::arg("Z"))
+        .def("add_reaction",
+             [](Simulation &sim, double m, double Z, double product_m,
+                double product_Z, double rate)
+             {
+                 Reaction reaction;
+                 reaction.m = m;
+                 reaction.Z = Z;
+                 reaction.product_m = product_m;
+                 reaction.product_Z = product_Z;
+                 reaction.rate = rate;
+                 sim.add_reaction(reaction);
+             },
+             "Turn ions of mass m and charge Z into the product species at the "
+             "given rate per ion (1/s)",
+             py::arg("m"), py::arg("Z"), py::arg("product_m"), py::arg("product_Z"),
+             py::arg("rate"))
+        .def("clear_events", &Simulation::clear_events)
+        .def("latest_frames", &latest_frames, py::arg("max_frames") = 0);
+
+    py::class_<Ensemble>(m, "Ensemble")
+        .def(py::init())
+        .def("__len__", &Ensemble::size)
+        .def("run_order", &Ensemble::run_order)
+        .def("add_member",
+             [](Ensemble &ensemble, const SimParams &params, const Trap &trap,
+                const ion_tuples &ions)
+             {
+                 ensemble.add_member(params, trap, to_specs(ions));
+             },
+             "Add a member given a list of (m, Z, [x, y, z]) ion tuples",
+             py::arg("params"), py::arg("trap"), py::arg("ions"))
+        .def("run",
+             [](Ensemble &ensemble, unsigned int num_threads)
+             {
+                 py::gil_scoped_release release;
+                 ensemble.run(num_threads);
+             },
+             py::arg("num_threads") = 0)
+        .def("status", &Ensemble::get_status);
+
+    py::class_<ReplicaBatch>(m, "ReplicaBatch")
+        .def("__init__",
+             [](ReplicaBatch &batch, const SimParams &params, const Trap &trap,
+                const ion_tuples &ions, size_t num_replicas)
+             {
+                 new (&batch) ReplicaBatch(params, trap, to_specs(ions), num_replicas);
+             },
+             py::arg("params"), py::arg("trap"), py::arg("ions"), py::arg("num_replicas"))
+        .def_property_readonly("num_ions", &ReplicaBatch::get_num_ions)
+        .def_property_readonly("num_replicas", &ReplicaBatch::get_num_replicas)
+        .def_property_readonly("time", &ReplicaBatch::get_time)
+        .def("set_trap", &ReplicaBatch::set_trap)
+        .def("set_state",
+             [](ReplicaBatch &batch, size_t replica, size_t ion,
+                const std::vector<double> &x, const std::vector<double> &v)
+             {
+                 batch.set_state(replica, ion, arma::vec(x), arma::vec(v));
+             })
+        .def("positions",
+             [](const ReplicaBatch &batch, size_t replica) {
+                 return to_numpy(batch.get_positions(replica));
+             })
+        .def("velocities",
+             [](const ReplicaBatch &batch, size_t replica) {
+                 return to_numpy(batch.get_velocities(replica));
+             })
+        .def("kinetic_energy", &ReplicaBatch::kinetic_energy)
+        .def("run",
+             [](ReplicaBatch &batch, unsigned int num_steps)
+             {
+                 py::gil_scoped_release release;
+                 batch.run(num_steps);
+             });
 
     return m.ptr();
 }
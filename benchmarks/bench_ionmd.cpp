@@ -0,0 +1,204 @@
+/**
+ * Microbenchmarks of the force kernels, the step loop and trajectory output.
+ *
+ * Build with -DBUILD_BENCHMARKS=ON and run `benchmarks/ionmd_benchmarks`.
+ * Per-ion costs are reported in the `per_ion` (or `per_step_ion`) column so
+ * runs with different numbers of ions can be compared directly. Benchmarks
+ * using OpenMP or the output thread are timed in wall clock time.
+ */
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <benchmark/benchmark.h>
+
+#include <ionmd/simulation.hpp>
+#include <ionmd/coulomb.hpp>
+#include <ionmd/data.hpp>
+#include <ionmd/laser.hpp>
+#include <ionmd/constants.hpp>
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+
+
+/// Positions of `n` ions on a cubic lattice with 5 um spacing.
+static std::vector<std::vector<double>> lattice(size_t n)
+{
+    const size_t side = size_t(std::ceil(std::cbrt(double(n))));
+    const double spacing = 5e-6;
+    std::vector<std::vector<double>> positions;
+    for (size_t i = 0; i < n; i++)
+    {
+        positions.push_back({
+            spacing * (double(i % side) - 0.5*side),
+            spacing * (double((i / side) % side) - 0.5*side),
+            spacing * (double(i / (side*side)) - 0.5*side)
+        });
+    }
+    return positions;
+}
+
+
+/// Ions on a lattice sharing `params` and `trap`, cooled by one laser.
+static std::vector<Ion> make_ions(size_t n, params_ptr params, trap_ptr trap)
+{
+    lasers_ptr lasers;
+    lasers.push_back(std::make_shared<Laser>(2e-22, 1.3e-19, arma::vec({0, 0, 1})));
+
+    std::vector<Ion> ions;
+    for (const auto &x0: lattice(n)) {
+        ions.push_back(Ion(params, trap, lasers, 40*constants::amu, 1, x0));
+    }
+    return ions;
+}
+
+
+/// Report the time per item (ion or ion step) of a benchmark.
+static void set_per_item(benchmark::State &state, const std::string &name, double items)
+{
+    state.counters[name] = benchmark::Counter(
+        items * state.iterations(),
+        benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+
+/// Coulomb force on every ion using Ion::coulomb.
+static void BM_IonCoulomb(benchmark::State &state)
+{
+    const size_t n = state.range(0);
+    auto params = std::make_shared<SimParams>();
+    auto trap = std::make_shared<Trap>();
+    auto ions = make_ions(n, params, trap);
+
+    for (auto _: state)
+    {
+        for (auto &ion: ions) {
+            benchmark::DoNotOptimize(ion.coulomb(ions));
+        }
+    }
+    set_per_item(state, "per_ion", n);
+}
+BENCHMARK(BM_IonCoulomb)->Arg(2)->Arg(100)->Arg(1000);
+
+
+/// Coulomb force on every ion using the tiled solver of `Simulation`.
+/// The second argument enables mixed precision.
+static void BM_CoulombSolver(benchmark::State &state)
+{
+    const size_t n = state.range(0);
+    auto params = std::make_shared<SimParams>();
+    auto trap = std::make_shared<Trap>();
+    const auto ions = make_ions(n, params, trap);
+
+    CoulombSolver solver(0, 0, state.range(1) != 0);
+    arma::mat forces;
+    for (auto _: state)
+    {
+        solver.set_ions(ions);
+        solver.compute(forces);
+        benchmark::DoNotOptimize(forces.memptr());
+    }
+    set_per_item(state, "per_ion", n);
+}
+BENCHMARK(BM_CoulombSolver)->ArgsProduct({{2, 100, 1000, 10000}, {0, 1}})
+    ->UseRealTime();
+
+
+/// Ion::update with only one kind of force enabled.
+template <bool secular, bool doppler>
+static void BM_Update(benchmark::State &state)
+{
+    const size_t n = state.range(0);
+    auto params = std::make_shared<SimParams>();
+    params->dt = 1e-9;
+    params->secular_enabled = secular;
+    params->doppler_enabled = doppler;
+    params->coulomb_enabled = false;
+    auto trap = std::make_shared<Trap>();
+    auto ions = make_ions(n, params, trap);
+    const arma::mat forces = arma::zeros<arma::mat>(3, n);
+
+    double t = 0;
+    for (auto _: state)
+    {
+        for (unsigned int i = 0; i < n; i++) {
+            benchmark::DoNotOptimize(ions[i].update(t, forces, i));
+        }
+        t += params->dt;
+    }
+    set_per_item(state, "per_step_ion", n);
+}
+BENCHMARK_TEMPLATE(BM_Update, false, false)->Arg(100)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Update, true, false)->Arg(100)->Arg(1000);
+BENCHMARK_TEMPLATE(BM_Update, false, true)->Arg(100)->Arg(1000);
+
+
+/// Complete time steps of `Simulation::run` without output.
+static void BM_SimulationSteps(benchmark::State &state)
+{
+    const size_t n = state.range(0);
+    const unsigned int num_steps = 10;
+
+    auto params = SimParams();
+    params.dt = 1e-9;
+    params.num_steps = num_steps;
+    params.doppler_enabled = true;
+    params.write_output = false;
+
+    Simulation sim;
+    sim.set_params(params);
+    for (const auto &x0: lattice(n)) {
+        sim.add_ion(40*constants::amu, 1, x0);
+    }
+
+    for (auto _: state) {
+        sim.run();
+    }
+    if (sim.status != SimStatus::FINISHED) {
+        state.SkipWithError("Simulation failed");
+    }
+    set_per_item(state, "per_step_ion", double(n) * num_steps);
+}
+BENCHMARK(BM_SimulationSteps)->Arg(2)->Arg(100)->Arg(1000)->Arg(10000)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+
+/// Trajectory output throughput, raw (0) or compressed (1).
+static void BM_TrajectoryOutput(benchmark::State &state)
+{
+    const size_t n = state.range(0);
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+
+    auto params = std::make_shared<SimParams>();
+    params->path = path.string();
+    params->buffer_size = 64;
+    params->compress_trajectories = state.range(1) != 0;
+    auto trap = std::make_shared<Trap>();
+    const auto ions = make_ions(n, params, trap);
+
+    arma::vec frame(3 * n);
+    for (size_t i = 0; i < n; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            frame[3*i + j] = ions[i].x[j];
+        }
+    }
+
+    {
+        DataWriter writer(params, trap, ions, true);
+        for (auto _: state)
+        {
+            // Small moves so that compressed frames aren't trivially empty
+            frame[state.iterations() % frame.n_elem] += 1e-8;
+            writer.write_frame(frame);
+        }
+        writer.flush();
+    }
+
+    state.SetBytesProcessed(state.iterations() * frame.n_elem * sizeof(double));
+    set_per_item(state, "per_ion", n);
+    fs::remove_all(path);
+}
+BENCHMARK(BM_TrajectoryOutput)->ArgsProduct({{100, 1000, 10000}, {0, 1}})
+    ->UseRealTime();
@@ -0,0 +1,414 @@
+/**
+ * Strong and weak OpenMP scaling of the simulation step loop.
+ *
+ * A standard crystal (singly charged Ca+ ions on a cubic lattice with 5 um
+ * spacing in the default trap, Doppler cooled) is run for a fixed number of
+ * steps at every combination of ion and thread count. Threads are pinned to
+ * the CPUs this process may run on, one thread per CPU in order, so results
+ * are reproducible within a job allocation.
+ *
+ * - Strong scaling: fixed ion counts, speedup and efficiency relative to the
+ *   smallest thread count.
+ * - Weak scaling: the number of ions grows with the square root of the thread
+ *   count so that the pairwise Coulomb work per thread stays constant;
+ *   efficiency is the time of the smallest thread count divided by the time
+ *   at each thread count.
+ *
+ * Usage:
+ *
+ *     ionmd_scaling [--ions 1000,4000] [--threads 1,2,4,8] [--steps 100]
+ *                   [--repeats 3] [--mode strong|weak|both] [--no-pin]
+ *                   [--csv scaling.csv] [--json scaling.json]
+ *
+ * Times are the minimum over repeats. Phase times require building with
+ * `ENABLE_PROFILER`.
+ */
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <json.hpp>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <ionmd/simulation.hpp>
+#include <ionmd/constants.hpp>
+
+using namespace ionmd;
+
+
+struct Options
+{
+    std::vector<unsigned int> ions = {1000, 4000};
+    std::vector<unsigned int> threads;
+    unsigned int steps = 100;
+    unsigned int repeats = 3;
+    bool strong = true;
+    bool weak = true;
+    bool pin = true;
+    std::string csv;
+    std::string json;
+};
+
+
+/// Result of one ion and thread count.
+struct Result
+{
+    std::string mode;
+    unsigned int ions;
+    unsigned int threads;
+    double run;
+    double coulomb;
+    double integration;
+    double speedup;
+    double efficiency;
+};
+
+
+/// CPUs this process is allowed to run on (e.g., by the batch system).
+static std::vector<int> available_cpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    return cpus;
+}
+
+
+/**
+ * Use `num_threads` OpenMP threads, pinning thread `i` to `cpus[i]` (modulo
+ * the number of CPUs). The pool keeps its threads between parallel regions of
+ * the same size, so the pinning holds for the following run.
+ */
+static void set_threads(unsigned int num_threads, const std::vector<int> &cpus, bool pin)
+{
+#ifdef _OPENMP
+    omp_set_dynamic(0);
+    omp_set_num_threads(num_threads);
+#endif
+    if (!pin) {
+        return;
+    }
+
+#ifdef __linux__
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+#else
+        const int thread = 0;
+#endif
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[thread % cpus.size()], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+}
+
+
+/// Undo the pinning of the calling thread.
+static void unpin(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu: cpus) {
+        CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+
+static std::vector<unsigned int> parse_list(const std::string &value)
+{
+    std::vector<unsigned int> list;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        const auto number = std::stoul(item);
+        if (number == 0) {
+            throw std::runtime_error("Counts must be positive");
+        }
+        list.push_back(number);
+    }
+    return list;
+}
+
+
+static Options parse_options(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--no-pin") {
+            options.pin = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value of " + arg);
+        }
+
+        const std::string value = argv[++i];
+        if (arg == "--ions") {
+            options.ions = parse_list(value);
+        }
+        else if (arg == "--threads") {
+            options.threads = parse_list(value);
+        }
+        else if (arg == "--steps") {
+            options.steps = std::stoul(value);
+        }
+        else if (arg == "--repeats") {
+            options.repeats = std::max(1ul, std::stoul(value));
+        }
+        else if (arg == "--mode")
+        {
+            if (value != "strong" && value != "weak" && value != "both") {
+                throw std::runtime_error("Unknown mode: " + value);
+            }
+            options.strong = value != "weak";
+            options.weak = value != "strong";
+        }
+        else if (arg == "--csv") {
+            options.csv = value;
+        }
+        else if (arg == "--json") {
+            options.json = value;
+        }
+        else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+
+    if (options.threads.empty())
+    {
+        // Powers of two up to the number of available CPUs
+#ifdef _OPENMP
+        const unsigned int max_threads = omp_get_num_procs();
+#else
+        const unsigned int max_threads = 1;
+#endif
+        for (unsigned int n = 1; n < max_threads; n *= 2) {
+            options.threads.push_back(n);
+        }
+        options.threads.push_back(max_threads);
+    }
+    std::sort(options.threads.begin(), options.threads.end());
+    return options;
+}
+
+
+/// Time a run of `num_ions` ions of the standard crystal with the current threads.
+static Result measure(unsigned int num_ions, const Options &options)
+{
+    auto params = SimParams();
+    params.dt = 1e-9;
+    params.num_steps = options.steps;
+    params.doppler_enabled = true;
+    params.write_output = false;
+
+    Simulation sim;
+    sim.set_params(params);
+    const unsigned int side = unsigned(std::ceil(std::cbrt(double(num_ions))));
+    const double spacing = 5e-6;
+    for (unsigned int i = 0; i < num_ions; i++)
+    {
+        sim.add_ion(40*constants::amu, 1, {
+            spacing * (double(i % side) - 0.5*side),
+            spacing * (double((i / side) % side) - 0.5*side),
+            spacing * (double(i / (side*side)) - 0.5*side)
+        });
+    }
+
+    Result result = {};
+    result.ions = num_ions;
+    result.run = std::numeric_limits<double>::infinity();
+    for (unsigned int r = 0; r < options.repeats; r++)
+    {
+        sim.run();
+        if (sim.status != SimStatus::FINISHED) {
+            throw std::runtime_error("Simulation failed");
+        }
+
+        const auto totals = sim.get_profile().totals();
+        if (totals.at("run") < result.run)
+        {
+            result.run = totals.at("run");
+            result.coulomb = totals.at("coulomb");
+            result.integration = totals.at("integration");
+        }
+    }
+    return result;
+}
+
+
+static void print(const Result &r, std::ostream &stream)
+{
+    stream << std::setw(8) << r.mode << std::setw(10) << r.ions
+           << std::setw(9) << r.threads
+           << std::fixed << std::setprecision(4)
+           << std::setw(11) << r.run << std::setw(11) << r.coulomb
+           << std::setw(13) << r.integration
+           << std::setprecision(2)
+           << std::setw(9) << r.speedup << std::setw(12) << r.efficiency
+           << std::defaultfloat << std::endl;
+}
+
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    try {
+        options = parse_options(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    const auto cpus = available_cpus();
+    if (options.pin && options.threads.back() > cpus.size())
+    {
+        std::cerr << "Warning: more threads than the " << cpus.size()
+                  << " available CPUs; threads will share CPUs" << std::endl;
+    }
+    if (!Profiler::enabled()) {
+        std::cerr << "Warning: built without ENABLE_PROFILER, phase times are zero" << std::endl;
+    }
+
+    std::cout << std::setw(8) << "mode" << std::setw(10) << "ions"
+              << std::setw(9) << "threads" << std::setw(11) << "run (s)"
+              << std::setw(11) << "coulomb" << std::setw(13) << "integration"
+              << std::setw(9) << "speedup" << std::setw(12) << "efficiency"
+              << std::endl;
+
+    std::vector<Result> results;
+    const auto base_threads = options.threads.front();
+
+    try {
+        if (options.strong)
+        {
+            for (const auto num_ions: options.ions)
+            {
+                double base = 0;
+                for (const auto num_threads: options.threads)
+                {
+                    set_threads(num_threads, cpus, options.pin);
+                    auto result = measure(num_ions, options);
+                    result.mode = "strong";
+                    result.threads = num_threads;
+                    if (num_threads == base_threads) {
+                        base = result.run;
+                    }
+                    result.speedup = base / result.run;
+                    result.efficiency = result.speedup * base_threads / num_threads;
+                    print(result, std::cout);
+                    results.push_back(result);
+                }
+            }
+        }
+
+        if (options.weak)
+        {
+            double base = 0;
+            for (const auto num_threads: options.threads)
+            {
+                const auto num_ions = unsigned(std::lround(
+                    options.ions.front() * std::sqrt(double(num_threads) / base_threads)));
+                set_threads(num_threads, cpus, options.pin);
+                auto result = measure(num_ions, options);
+                result.mode = "weak";
+                result.threads = num_threads;
+                if (num_threads == base_threads) {
+                    base = result.run;
+                }
+                result.efficiency = base / result.run;
+                result.speedup = result.efficiency * num_threads / base_threads;
+                print(result, std::cout);
+                results.push_back(result);
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if (options.pin) {
+        unpin(cpus);
+    }
+
+    if (!options.csv.empty())
+    {
+        std::ofstream file(options.csv);
+        file << "mode,ions,threads,steps,run_seconds,coulomb_seconds,"
+             << "integration_seconds,seconds_per_step_ion,speedup,efficiency\n";
+        for (const auto &r: results)
+        {
+            file << r.mode << "," << r.ions << "," << r.threads << ","
+                 << options.steps << "," << r.run << "," << r.coulomb << ","
+                 << r.integration << "," << r.run / (double(r.ions) * options.steps)
+                 << "," << r.speedup << "," << r.efficiency << "\n";
+        }
+    }
+
+    if (!options.json.empty())
+    {
+        nlohmann::json j = {
+            {"steps", options.steps},
+            {"repeats", options.repeats},
+            {"pinned", options.pin},
+            {"cpus", cpus},
+            {"results", nlohmann::json::array()}
+        };
+        for (const auto &r: results)
+        {
+            j["results"].push_back({
+                {"mode", r.mode},
+                {"ions", r.ions},
+                {"threads", r.threads},
+                {"run_seconds", r.run},
+                {"coulomb_seconds", r.coulomb},
+                {"integration_seconds", r.integration},
+                {"seconds_per_step_ion", r.run / (double(r.ions) * options.steps)},
+                {"speedup", r.speedup},
+                {"efficiency", r.efficiency}
+            });
+        }
+        std::ofstream(options.json) << j.dump(2) << std::endl;
+    }
+
+    return 0;
+}
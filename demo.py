@@ -7,7 +7,8 @@ from ionmd import Simulation, Status
 sim = Simulation()
 
 params = sim.params
-params.filename = "trajectories.bin"
+params.write_output = False
+params.ring_size = params.num_steps
 sim.params = params
 print(sim.params)
 
@@ -15,10 +16,9 @@ print("Adding ions...")
 
 n_ions = 2
 
-z = np.linspace(-5, 5, n_ions)
-
-for n in range(n_ions):
-    sim.add_ion(40, 1, [0, 0, z[n]])
+positions = np.zeros((n_ions, 3))
+positions[:, 2] = np.linspace(-5, 5, n_ions)
+sim.add_ions(40, 1, positions)
 
 print("Running simulation...")
 t_start = time.time()
@@ -31,15 +31,12 @@ while sim.status != Status.FINISHED:
 
 print("Done in {:.3f} s".format(time.time() - t_start))
 
-shape = (n_ions*3, params.num_steps)
-# shape = (params.num_steps, n_ions*3)
-data = np.fromfile(params.filename, dtype=np.double).reshape(shape).T
+steps, data = sim.latest_frames()
 
 if n_ions <= 10:
     fig, ax = plt.subplots(3, n_ions)
-    t = np.linspace(0, params.num_steps * params.dt, params.num_steps)
-    lim = -1
+    t = steps * params.dt
     for n in range(n_ions):
         for k in range(3):
-            ax[k, n].plot(t[:lim], data[:lim, k])
+            ax[k, n].plot(t, data[:, n, k])
     plt.show()
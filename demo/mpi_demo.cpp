@@ -0,0 +1,73 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cmath>
+
+#include <mpi.h>
+
+#include <ionmd/mpi_simulation.hpp>
+#include <ionmd/params.hpp>
+#include <ionmd/trap.hpp>
+#include <ionmd/laser.hpp>
+#include <ionmd/constants.hpp>
+
+using std::cout;
+using std::endl;
+
+using namespace ionmd;
+
+
+/// Usage: mpirun -np 4 ionmd_mpi_demo [num_ions] [output path]
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const unsigned int num_ions = argc > 1 ? std::stoul(argv[1]) : 64;
+
+    auto params = SimParams();
+    params.dt = 1e-9;
+    params.num_steps = 1000;
+    params.doppler_enabled = true;
+    params.path = argc > 2 ? argv[2] : "mpi-output";
+
+    auto trap = Trap();
+
+    lasers_ptr lasers;
+    lasers.push_back(std::make_shared<Laser>(2e-22, 1.3e-19, std::vector<double>{0, 0, 1}));
+
+    // Ions on a helix so that no two start at the same position
+    std::vector<IonSpec> ions;
+    const double m = constants::amu * 40;
+    for (unsigned int i = 0; i < num_ions; i++)
+    {
+        const double phi = 0.5 * i;
+        const double z = 5e-6 * (i - 0.5*num_ions);
+        ions.push_back({m, 1, {20e-6*cos(phi), 20e-6*sin(phi), z}, lasers});
+    }
+
+    int result = 0;
+    try {
+        MPISimulation sim(MPI_COMM_WORLD, params, trap, ions);
+        sim.run();
+
+        if (rank == 0)
+        {
+            cout << "Simulated " << num_ions << " ions: "
+                 << (sim.status == SimStatus::FINISHED ? "complete" : "failed")
+                 << endl;
+        }
+        result = sim.status == SimStatus::FINISHED ? 0 : 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << endl;
+        result = 1;
+    }
+
+    MPI_Finalize();
+    return result;
+}
@@ -0,0 +1,106 @@
+#ifndef CAMERA_HPP
+#define CAMERA_HPP
+
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "params.hpp"
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Accumulates synthetic camera images of the ions while the simulation runs,
+ * so that images don't have to be binned from stored trajectories.
+ *
+ * Every `SimParams::image_interval` time steps, ion positions are projected
+ * onto the image plane spanned by `SimParams::image_horizontal` and
+ * `SimParams::image_vertical` through `SimParams::image_center`, and each ion
+ * adds its Gaussian point spread function (`SimParams::image_psf_sigma`,
+ * integrated over each pixel) to a grid of `SimParams::image_size` pixels of
+ * `SimParams::image_pixel_size` (all lengths in the object plane).
+ *
+ * Each sample adds the sampled time (`image_interval * dt`), so pixel values
+ * are the time in s that ions spent in a pixel. With
+ * `SimParams::image_scattering` the time is weighted with the force of each
+ * ion's Doppler cooling lasers along their beams in N, which is proportional
+ * to the photon scattering rate; ions without lasers stay dark.
+ *
+ * Threads accumulate into their own images, which are summed when an image
+ * is written to `images.bin` in the output directory: once every
+ * `SimParams::image_exposure` time steps (and a shorter last exposure at the
+ * end of the run if needed), or once at the end of the run if that is 0.
+ * The file starts with the width, height and exposure as text lines,
+ * followed by the images as doubles in row-major order (rows along the
+ * vertical axis, starting at the most negative coordinates).
+ *
+ * The current image and the size of `images.bin` are stored in checkpoints
+ * (see `save`), so a resumed run continues the exposure of the run it
+ * resumes and drops images written after the checkpoint.
+ */
+class Camera
+{
+private:
+    params_ptr p;
+
+    unsigned int width;
+    unsigned int height;
+
+    /// Unit vectors of the image axes divided by the pixel size and the
+    /// pixel coordinates of the image center
+    double horizontal[3];
+    double vertical[3];
+    double center[2];
+
+    /// PSF width in pixels
+    double sigma;
+
+    /// Image of each thread (row-major)
+    std::vector<std::vector<double>> thread_images;
+
+    /// Number of samples in the current image
+    unsigned int samples = 0;
+
+    std::ofstream out;
+
+public:
+    /**
+     * @param params
+     * @param state Continue from a state written by `save` (null to start a
+     * new file)
+     * @throws std::invalid_argument for invalid image settings
+     * @throws std::runtime_error if the output file can't be created or
+     * doesn't match the state
+     */
+    Camera(params_ptr params, std::istream *state=nullptr);
+
+    /**
+     * Add the current ion positions to the image.
+     * @param ions
+     */
+    void record(const std::vector<Ion> &ions);
+
+    /// Sum of the thread images (row-major).
+    auto image() const -> std::vector<double>;
+
+    /// True if samples were added since the last image was written.
+    bool exposed() const { return samples > 0; }
+
+    /**
+     * Write the current image (so far) and the size of the output file.
+     * @throws std::runtime_error if flushing the output fails
+     */
+    void save(std::ostream &state);
+
+    /**
+     * Write the current image and start a new one.
+     * @throws std::runtime_error if writing fails
+     */
+    void write();
+};
+
+}  // namespace ionmd
+
+#endif
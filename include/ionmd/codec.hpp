@@ -0,0 +1,140 @@
+#ifndef CODEC_HPP
+#define CODEC_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace ionmd {
+
+/**
+ * Lossy, bounded-error trajectory compression.
+ *
+ * Positions are quantized to integer multiples of a fixed precision (so the
+ * reconstruction error of every coordinate is at most half the precision).
+ * Each frame is then predicted from the previous two frames by linear
+ * extrapolation and only the residuals are stored. Residuals are zigzag
+ * mapped to unsigned integers and written as variable length (LEB128)
+ * integers: ions in a crystal move smoothly, so most residuals fit in one or
+ * two bytes instead of eight.
+ *
+ * Coordinates of ions that left the trap are NaN. They are stored as a
+ * reserved quantized value outside the range of positions, which costs a
+ * byte per coordinate once the ion is gone.
+ *
+ * Every `keyframe_interval` frames a keyframe is stored which does not depend
+ * on any earlier frame. This bounds the damage of a corrupted frame and allows
+ * resuming a file from a frame boundary.
+ */
+namespace codec {
+
+/// Frame kinds as stored in the first byte of an encoded frame.
+enum FrameKind : uint8_t { KEYFRAME = 0, DELTA = 1, LINEAR = 2 };
+
+/// Magic bytes at the start of compressed trajectory files.
+constexpr char magic[4] = {'I', 'O', 'N', 'Z'};
+
+/// Version of the compressed file format. Version 1 files (without missing
+/// coordinates) are read as well.
+constexpr uint32_t version = 2;
+
+/// Quantized value of missing (NaN) coordinates.
+constexpr int64_t missing = 2000000000000000000;
+
+/// Map a signed integer to an unsigned one with small magnitudes first.
+inline uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+/// Inverse of `zigzag`.
+inline int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/// Append a variable length encoded unsigned integer to `out`.
+inline void put_varint(uint64_t value, std::vector<uint8_t> &out)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+/**
+ * Read a variable length encoded unsigned integer.
+ * @param pos Read position; advanced past the integer
+ * @param end End of the input
+ * @throws std::runtime_error on truncated input
+ */
+uint64_t get_varint(const uint8_t *&pos, const uint8_t *end);
+
+}  // namespace codec
+
+
+/**
+ * Encodes trajectory frames of a fixed number of coordinates.
+ */
+class TrajectoryEncoder
+{
+private:
+    const size_t num_values;
+    const double precision;
+    const unsigned int keyframe_interval;
+
+    /// Number of frames encoded since the last keyframe.
+    unsigned int since_keyframe;
+
+    /// Quantized values of the previous two frames.
+    std::vector<int64_t> prev, prev2;
+
+public:
+    /**
+     * @param num_values Number of coordinates per frame (3 per ion)
+     * @param precision Quantization step in the units of the data
+     * @param keyframe_interval Store a keyframe every this many frames
+     */
+    TrajectoryEncoder(size_t num_values, double precision,
+                      unsigned int keyframe_interval=1000);
+
+    /**
+     * Encode a frame and append the result to `out`.
+     * @throws std::range_error if a value is infinite or can't be quantized
+     */
+    void encode(const double *frame, std::vector<uint8_t> &out);
+
+    /// Force the next frame to be a keyframe.
+    void reset() { since_keyframe = keyframe_interval; }
+};
+
+
+/**
+ * Decodes frames written by `TrajectoryEncoder`. Frames must be decoded in the
+ * order they were encoded, starting from a keyframe.
+ */
+class TrajectoryDecoder
+{
+private:
+    const size_t num_values;
+    const double precision;
+    std::vector<int64_t> prev, prev2;
+    bool have_prev;
+
+public:
+    TrajectoryDecoder(size_t num_values, double precision);
+
+    /**
+     * Decode a single frame.
+     * @param data Encoded frame
+     * @param size Size of the encoded frame in bytes
+     * @param frame Output array of `num_values` coordinates
+     * @throws std::runtime_error on malformed input
+     */
+    void decode(const uint8_t *data, size_t size, double *frame);
+};
+
+}  // namespace ionmd
+
+#endif
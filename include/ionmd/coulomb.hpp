@@ -0,0 +1,105 @@
+#ifndef COULOMB_HPP
+#define COULOMB_HPP
+
+#include <vector>
+#include <utility>
+#include <armadillo>
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Direct (all pairs) Coulomb solver.
+ *
+ * Positions and charges are kept in separate contiguous arrays and the pair
+ * sum is processed in tiles: ions are split into i-blocks distributed over
+ * OpenMP threads, and every i-block walks the source ions in j-tiles. A j-tile
+ * is sized to stay in L1 while it is used by all ions of the i-block, and an
+ * i-block (positions and accumulated forces) is sized to stay in L2 while it
+ * visits all j-tiles. This way each source ion is read from memory once per
+ * i-block rather than once per ion.
+ *
+ * Forces of an i-block are accumulated in buffers allocated by the thread
+ * computing it (and so on its NUMA node) and written out once, so threads
+ * never share accumulators and no reduction across threads or sockets is
+ * needed.
+ *
+ * Tile sizes are derived from the cache sizes reported by the system unless
+ * set explicitly with `SimParams::coulomb_tile_i` and `coulomb_tile_j`.
+ *
+ * In mixed precision mode the coordinates of each tile are converted to
+ * single precision relative to an origin inside the i-block, so separations
+ * keep their precision even far from the trap center. The pair interactions
+ * are then evaluated in single precision (twice the SIMD lanes) and forces
+ * are accumulated in double precision.
+ */
+class CoulombSolver
+{
+private:
+    /// Positions and charges (in C) of all ions.
+    std::vector<double> x, y, z, q;
+
+    /// Requested tile sizes in ions (0 to derive from cache sizes).
+    size_t tile_i, tile_j;
+
+    /// Evaluate pair interactions in single precision.
+    bool mixed;
+
+public:
+    /**
+     * @param tile_i Number of ions per i-block (0 for automatic)
+     * @param tile_j Number of ions per j-tile (0 for automatic)
+     * @param mixed Use mixed precision
+     */
+    CoulombSolver(size_t tile_i=0, size_t tile_j=0, bool mixed=false);
+
+    /// Set the tile sizes in ions (0 for automatic).
+    void set_tile_sizes(size_t tile_i, size_t tile_j);
+
+    /// Enable or disable mixed precision.
+    void set_mixed_precision(bool mixed) { this->mixed = mixed; }
+
+    /**
+     * Return the i-block and j-tile sizes used for a number of ions.
+     * @param num_ions Number of ions computed (determines the minimum number
+     * of i-blocks needed to keep all threads busy)
+     */
+    auto tile_sizes(size_t num_ions) const -> std::pair<size_t, size_t>;
+
+    /// Copy positions and charges from a set of ions.
+    void set_ions(const std::vector<Ion> &ions);
+
+    /**
+     * Set positions and charges.
+     * @param positions Positions of all ions (3 values per ion)
+     * @param charges Charges in C
+     */
+    void set_ions(const arma::vec &positions, const std::vector<double> &charges);
+
+    /// Number of ions.
+    size_t size() const { return q.size(); }
+
+    /**
+     * Compute the Coulomb force on a contiguous range of ions due to all
+     * other ions.
+     * @param forces Set to the forces with one column per ion in the range
+     * @param energies If not null, set to the Coulomb energy of each ion in
+     * the range in the field of all other ions
+     * @param first Index of the first ion
+     * @param count Number of ions (all remaining if larger than that)
+     */
+    void compute(arma::mat &forces, arma::vec *energies=nullptr,
+                 size_t first=0, size_t count=size_t(-1)) const;
+
+    /**
+     * Compare mixed and double precision forces for the current positions.
+     * @param first Index of the first ion to compare
+     * @param count Number of ions to compare
+     * @returns the largest relative error of the force on an ion
+     */
+    double mixed_precision_error(size_t first=0, size_t count=size_t(-1)) const;
+};
+
+}  // namespace ionmd
+
+#endif
@@ -5,16 +5,59 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
 #include <armadillo>
 #include "params.hpp"
 #include "trap.hpp"
 #include "ion.hpp"
+#include "codec.hpp"
+#include "profiler.hpp"
+#include "perf.hpp"
 
 namespace ionmd {
 
 
+/**
+ * Create the output directory and write the parameters, trap and initial ions
+ * to it.
+ * @param params
+ * @param trap
+ * @param ions
+ * @param overwrite Allow writing to an existing directory.
+ * @throws std::runtime_error if the directory can't be used
+ */
+void write_metadata(params_ptr params, trap_ptr trap,
+                    const std::vector<Ion> &ions, bool overwrite=false);
+
+
+/**
+ * Header of raw (uncompressed) trajectory files: the number of ions and the
+ * number of time steps as text lines, followed by the frames as doubles.
+ */
+auto raw_header(size_t num_ions, unsigned int num_steps) -> std::string;
+
+
+/**
+ * Write the phase timing of a run to profile.json in the output directory,
+ * and hardware counts to perf.json if given.
+ * @param params
+ * @param profiler
+ * @param perf
+ */
+void write_profile(params_ptr params, const Profiler &profiler,
+                   const PerfCounters *perf=nullptr);
+
+
 /**
  * Class for managing simulation data output.
+ *
+ * Trajectory frames are handed off to a background writer thread so that
+ * (optional) compression and disk I/O overlap with computing the next steps.
  */
 class DataWriter
 {
@@ -25,44 +68,120 @@ private:
     /// Trajectory data file
     std::ofstream traj_file;
 
-    std::vector<std::ofstream> ion_files;
+    /// Encoder for compressed trajectories (null when writing raw doubles).
+    std::unique_ptr<TrajectoryEncoder> encoder;
 
+    /// Scratch space for encoded frames.
+    std::vector<uint8_t> encoded;
+
+    /// Maximum number of frames to queue before blocking the simulation.
     const size_t buffer_size;
-    unsigned int buffer_pos;
 
-public:
-    /// Buffer for storing ion data
-    arma::mat buffer;
+    /// Frames waiting to be written.
+    std::deque<arma::vec> queue;
+
+    /// Number of frames queued or currently being written.
+    size_t pending;
+
+    /// Set when the writer thread should exit after draining the queue.
+    bool stopping;
+
+    /// First error raised by the writer thread.
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread writer_thread;
 
+    /// Writer thread main loop.
+    void write_loop();
+
+    /// Write a single frame to the trajectory file.
+    void write_to_file(const arma::vec &frame);
+
+public:
     /**
      * Initialize data output.
      * @param params
      * @param trap
      * @param ions
      * @param overwrite Overwrite existing data.
+     * @param append_at Continue an existing trajectory file, truncated to
+     * this many bytes (0 to start a new file).
+     * @throws std::runtime_error if the output can't be created or the file
+     * to continue is missing or shorter than `append_at`
      */
     DataWriter(params_ptr params, trap_ptr trap,
-               const std::vector<Ion> &ions, bool overwrite=false);
+               const std::vector<Ion> &ions, bool overwrite=false,
+               uint64_t append_at=0);
 
+    /// Write out all queued frames and stop the writer thread.
     ~DataWriter();
 
-    inline void write(const unsigned int &ion, const arma::vec &data);
+    /**
+     * Queue a frame of ion positions for writing. This blocks when the writer
+     * thread has fallen more than `SimParams::buffer_size` frames behind.
+     * @param positions Positions of all ions (3 values per ion)
+     * @throws std::runtime_error if writing an earlier frame failed
+     */
+    void write_frame(const arma::vec &positions);
+
+    /**
+     * Wait until all queued frames have been written to disk.
+     * @throws std::runtime_error if writing any frame failed
+     */
+    void flush();
+
+    /**
+     * Flush queued frames and return the current size of the trajectory file
+     * in bytes.
+     */
+    auto tell() -> uint64_t;
+};
+
+
+/**
+ * Reads trajectory files written by `DataWriter`, either raw or compressed.
+ */
+class TrajectoryReader
+{
+private:
+    std::ifstream file;
+
+    /// Number of ions per frame.
+    size_t num_ions;
+
+    /// Decoder for compressed trajectories (null for raw files).
+    std::unique_ptr<TrajectoryDecoder> decoder;
+
+    /// Scratch space for encoded frames.
+    std::vector<uint8_t> encoded;
+
+public:
+    /**
+     * Open a trajectory file. The format is detected automatically.
+     * @param filename
+     */
+    explicit TrajectoryReader(const std::string &filename);
+
+    /// Number of ions per frame.
+    size_t get_num_ions() const { return num_ions; }
+
+    /// True if the file is compressed.
+    bool is_compressed() const { return decoder != nullptr; }
+
+    /**
+     * Read the next frame.
+     * @param frame Output positions (3 values per ion)
+     * @returns false when there are no more frames
+     */
+    bool read_frame(arma::vec &frame);
 
     /**
-     * Insert trajectory data.
+     * Read all remaining frames.
+     * @returns Matrix with one column of positions per frame
      */
-    inline void update_buffer(const unsigned int &ion, const arma::vec &data)
-    {
-        for (unsigned int j = 0; j < 3; j++) {
-            buffer(buffer_pos, 3*ion + j) = data[j];
-        }
-
-        // if (++buffer_pos == buffer_size)
-        // {
-        //     buffer.save(traj_file, arma::raw_binary);
-        //     buffer_pos = 0;
-        // }
-    }
+    arma::mat read_all();
 };
 
 }  // namespace ionmd
@@ -0,0 +1,83 @@
+#ifndef ENSEMBLE_HPP
+#define ENSEMBLE_HPP
+
+#include <memory>
+#include <vector>
+#include "params.hpp"
+#include "trap.hpp"
+#include "laser.hpp"
+#include "simulation.hpp"
+
+namespace ionmd {
+
+/**
+ * A single configuration of an ensemble.
+ */
+struct EnsembleMember
+{
+    SimParams params;
+    Trap trap;
+    std::vector<IonSpec> ions;
+};
+
+
+/**
+ * Runs many independent simulations (e.g., a parameter sweep) in a single
+ * process.
+ *
+ * Members are distributed over OpenMP threads with each member running on a
+ * single thread, so no cores are oversubscribed by nested parallelism.
+ * Members are started in order of decreasing estimated cost so that large
+ * crystals don't end up as stragglers while small ones fill the remaining
+ * cores. Each member writes output to its own `SimParams::path`.
+ */
+class Ensemble
+{
+private:
+    std::vector<EnsembleMember> members;
+
+    /// Simulations of the last run, in the order members were added.
+    std::vector<std::unique_ptr<Simulation>> simulations;
+
+public:
+    /**
+     * Add a member to the ensemble.
+     * @param params
+     * @param trap
+     * @param ions
+     * @throws std::invalid_argument if another member writes to the same path
+     */
+    void add_member(const SimParams &params, const Trap &trap,
+                    const std::vector<IonSpec> &ions);
+
+    /// Number of members.
+    size_t size() const { return members.size(); }
+
+    /// Member indices in the order members are started: by decreasing
+    /// estimated cost (ions squared with Coulomb interaction times steps).
+    auto run_order() const -> std::vector<size_t>;
+
+    /**
+     * Run all members. This is a blocking function.
+     * @param num_threads Number of members to run concurrently (0 to use the
+     * OpenMP default)
+     */
+    void run(unsigned int num_threads=0);
+
+    /**
+     * Return the status of a member in the last run.
+     * @param index Member index in the order members were added
+     */
+    auto get_status(size_t index) const -> SimStatus;
+
+    /**
+     * Return the simulation of a member in the last run (e.g., to read its
+     * in-memory frames).
+     * @param index Member index in the order members were added
+     */
+    auto get_simulation(size_t index) -> Simulation &;
+};
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef EVENTS_HPP
+#define EVENTS_HPP
+
+#include <cstddef>
+#include <armadillo>
+#include "laser.hpp"
+
+namespace ionmd {
+
+/// Kinds of scheduled events.
+enum class EventType { LOAD, REMOVE, REACT };
+
+
+/// Name of an event type as written to `events.csv`.
+inline auto event_name(EventType type) -> const char *
+{
+    switch (type)
+    {
+    case EventType::LOAD:
+        return "load";
+    case EventType::REMOVE:
+        return "remove";
+    default:
+        return "react";
+    }
+}
+
+
+/**
+ * Change to the ions of a simulation at a given time (see
+ * `Simulation::schedule_loading`, `Simulation::schedule_removal` and
+ * `Simulation::schedule_reaction`). Events happen at the beginning of the
+ * first time step starting at or after their time.
+ */
+struct Event
+{
+    EventType type;
+
+    /// Time of the event
+    double t;
+
+    /// Original index of the ion loaded, removed or changed
+    size_t id;
+
+    /// Mass and charge (in units of e) of the ion loaded or of the product
+    /// of a reaction
+    double m;
+    double Z;
+
+    /// Initial position and velocity of the ion loaded
+    arma::vec x;
+    arma::vec v;
+
+    /// Doppler cooling lasers affecting the ion loaded or the product
+    lasers_ptr lasers;
+};
+
+
+/**
+ * Stochastic reaction changing ions of one species (mass and charge) into
+ * another, e.g., photoionization of neutral atoms (Z = 0) or charge exchange
+ * with background gas. In every time step each ion of the reactant species
+ * reacts with the probability `1 - exp(-rate * dt)`.
+ */
+struct Reaction
+{
+    /// Mass and charge of the reactant
+    double m;
+    double Z;
+
+    /// Mass and charge of the product
+    double product_m;
+    double product_Z;
+
+    /// Reaction rate per ion in 1/s
+    double rate;
+
+    /// Doppler cooling lasers affecting the product (none by default, since
+    /// lasers are resonant with one species only)
+    lasers_ptr product_lasers;
+};
+
+}  // namespace ionmd
+
+#endif
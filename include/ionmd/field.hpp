@@ -0,0 +1,176 @@
+#ifndef FIELD_HPP
+#define FIELD_HPP
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <armadillo>
+#include "params.hpp"
+#include "trap.hpp"
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Potential of one trap electrode on a regular 3D grid: the potential in V
+ * with 1 V applied to the electrode and all others grounded, as computed by
+ * BEM or FEM solvers.
+ *
+ * Grid files are memory-mapped read-only and shared by all simulations of a
+ * process that use the same file (see `load_field_grid`); separate processes
+ * share them through the page cache. Files are written by
+ * `write_field_grid` and consist of (in native byte order)
+ *
+ * - the magic bytes `IONMDFLD`
+ * - the format version (uint32) and 4 reserved bytes
+ * - the number of grid points along x, y and z (3 uint64)
+ * - the position of the first grid point and the grid spacing in m (6
+ *   doubles)
+ * - the potential at all grid points (doubles, x varying fastest)
+ */
+class FieldGrid
+{
+private:
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    const double *data;
+
+public:
+    /// Number of grid points along x, y and z
+    std::array<size_t, 3> size;
+
+    /// Position of the first grid point and grid spacing along x, y and z
+    std::array<double, 3> origin;
+    std::array<double, 3> spacing;
+
+    /**
+     * Map a grid file.
+     * @param filename
+     * @throws std::runtime_error if the file can't be mapped or is invalid
+     */
+    FieldGrid(const std::string &filename);
+    ~FieldGrid();
+
+    FieldGrid(const FieldGrid &) = delete;
+    FieldGrid &operator=(const FieldGrid &) = delete;
+
+    /// Potential at all grid points, x varying fastest.
+    const double *values() const { return data; }
+
+    /// True if both grids have the same points.
+    bool same_points(const FieldGrid &other) const;
+};
+
+
+/**
+ * Map a grid file, or return the grid already mapped from it.
+ * @throws std::runtime_error if the file can't be mapped or is invalid
+ */
+auto load_field_grid(const std::string &filename) -> std::shared_ptr<const FieldGrid>;
+
+
+/**
+ * Write an electrode potential grid (e.g., converted from a BEM solution).
+ * @param filename
+ * @param size Number of grid points along x, y and z
+ * @param origin Position of the first grid point
+ * @param spacing Grid spacing along x, y and z
+ * @param values Potential at all grid points, x varying fastest
+ * @throws std::invalid_argument if the sizes don't match
+ * @throws std::runtime_error if the file can't be written
+ */
+void write_field_grid(const std::string &filename, const std::array<size_t, 3> &size,
+                      const std::array<double, 3> &origin,
+                      const std::array<double, 3> &spacing,
+                      const std::vector<double> &values);
+
+
+/**
+ * Trap fields from electrode potential grids (`SimParams::field_maps`), as an
+ * alternative or addition to the analytic quadrupole (see
+ * `SimParams::secular_enabled`).
+ *
+ * Electrode k has the voltage `field_dc[k] + field_rf[k] * cos(omega_rf t)`.
+ * Forces are the negative gradient of the total potential times the ion
+ * charge, interpolated with tricubic (Catmull-Rom) convolution, which
+ * reproduces quadratic potentials exactly. Ions within one grid spacing of
+ * the edge of the grid or outside it feel no force from the grid.
+ *
+ * Like `CoulombSolver`, positions are packed into arrays (`set_ions`) for
+ * the vectorized force loop. With static voltages, grids are summed once
+ * so each ion reads 64 grid points per step regardless of the number of
+ * electrodes.
+ */
+class FieldMap
+{
+private:
+    params_ptr p;
+    trap_ptr trap;
+
+    std::vector<std::shared_ptr<const FieldGrid>> grids;
+
+    /// Weighted sum of the grids if no electrode has an rf voltage
+    std::vector<double> combined;
+
+    /// Packed positions and charges
+    std::vector<double> x, y, z, q;
+
+    /// Finite difference step of the effective potential in grid spacings
+    static constexpr double difference_step = 0.05;
+
+    /**
+     * Interpolate a weighted sum of grids.
+     * @param r Position
+     * @param values Grid values
+     * @param voltages Weight of each grid
+     * @param gradient If not null, set to the gradient in V/m
+     * @returns the potential in V (0 near the edge of the grid or outside)
+     */
+    double interpolate(const double *r, const std::vector<const double *> &values,
+                       const std::vector<double> &voltages, double *gradient=nullptr) const;
+
+public:
+    /**
+     * @param params
+     * @param trap
+     * @throws std::invalid_argument for inconsistent grids or voltages
+     * @throws std::runtime_error if a grid can't be loaded
+     */
+    FieldMap(params_ptr params, trap_ptr trap);
+
+    /// Copy the positions and charges of the ions.
+    void set_ions(const std::vector<Ion> &ions);
+
+    /**
+     * Compute the forces on the ions of the last `set_ions`.
+     * @param t Time
+     * @param forces Set to (or incremented by) the force on each ion
+     * @param add Add to `forces` (of the right size) rather than set it
+     */
+    void compute(double t, arma::mat &forces, bool add=false) const;
+
+    /// Total potential in V at time `t` and position `r`.
+    double potential(double t, const double *r) const;
+
+    /**
+     * Time-averaged potential energy of an ion: the charge times the DC
+     * potential plus the pseudopotential `q^2 |E_rf|^2 / (4 m omega_rf^2)`
+     * of the rf field amplitude. This is the field map counterpart of
+     * `Ion::secular_energy` for equilibria and normal modes.
+     * @param r Position
+     * @param q Charge in C
+     * @param m Mass
+     */
+    double effective_energy(const double *r, double q, double m) const;
+
+    /// Force of `effective_energy` from central differences.
+    void effective_force(const double *r, double q, double m, double *F) const;
+
+    /// Hessian of `effective_energy` from central differences.
+    void effective_hessian(const double *r, double q, double m, double H[3][3]) const;
+};
+
+}  // namespace ionmd
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef ION_HPP
 #define ION_HPP
 
+#include <cmath>
 #include <vector>
 #include <memory>
 #include <armadillo>
@@ -14,6 +15,49 @@ using arma::vec;
 using arma::mat;
 
 
+/**
+ * Description of an ion used to set up simulations that create their own
+ * ions (ensembles, replica batches).
+ */
+struct IonSpec
+{
+    /// Ion mass
+    double m;
+
+    /// Ion charge in units of e
+    double Z;
+
+    /// Initial position
+    std::vector<double> x0;
+
+    /// Doppler cooling lasers affecting this ion
+    lasers_ptr lasers;
+};
+
+
+/**
+ * Forces acting on ions, combined as bit flags to select a specialization of
+ * `Ion::step`.
+ */
+enum Force : unsigned int
+{
+    SECULAR_FORCE = 1,
+    MICROMOTION_FORCE = 2,
+    COULOMB_FORCE = 4,
+    STOCHASTIC_FORCE = 8,
+    DOPPLER_FORCE = 16,
+    FIELD_FORCE = 32
+};
+
+
+/// Number of combinations of forces (specializations of `Ion::step`).
+constexpr unsigned int num_force_sets = 64;
+
+
+/// Flags of the forces enabled by a set of parameters.
+unsigned int enabled_forces(const SimParams &p);
+
+
 class Ion {
 private:
     /// Common simulation parameters
@@ -26,29 +70,23 @@ private:
     lasers_ptr lasers;
 
     /// Charge in Coulombs
-    const double charge;
+    double charge;
 
-    /// Compute the force from Doppler cooling lasers.
-    vec doppler_force();
+    /// Add the force from Doppler cooling lasers to `F`.
+    void add_doppler_force(double *F) const;
 
-    /// Compute the secular motion (ponderomotive) force of the trap.
-    vec secular_force();
+    /// Add the secular motion (ponderomotive) force of the trap to `F`.
+    void add_secular_force(double *F) const;
 
     /**
-     * Compute micromotion (rf) force due to the trap.
+     * Add the micromotion (rf) force due to the trap to `F`.
      * @param t
+     * @param F
      */
-    vec micromotion_force(double t);
-
-    /**
-     * Sum all forces due to other ions.
-     * @param forces
-     * @param index
-     */
-    vec coulomb_force(const mat &forces, const unsigned int &index);
+    void add_micromotion_force(double t, double *F) const;
 
-    /// Compute stochastic forces (background gas collisions, etc.).
-    vec stochastic_force();
+    /// Add stochastic forces (background gas collisions, etc.) to `F`.
+    void add_stochastic_force(double *F) const;
 
 public:
     // FIXME: consider making v, a, m private
@@ -57,8 +95,9 @@ public:
     vec v;  /// Ion velocity
     vec a;  /// Ion acceleration
 
-    const double m;  /// Ion mass
-    const double Z;  /// Ion charge in units of [e] FIXME: make integer
+    // Not const so that ions can be reordered in place
+    double m;  /// Ion mass
+    double Z;  /// Ion charge in units of [e] FIXME: make integer
 
     /**
      * @param params
@@ -88,8 +127,44 @@ public:
     Ion(params_ptr params, trap_ptr trap, lasers_ptr lasers,
         double m, double Z, vec x0);
 
+    /// Doppler cooling lasers affecting this ion.
+    const lasers_ptr &get_lasers() const { return lasers; }
+
+    /// Trap this ion is in.
+    const trap_ptr &get_trap() const { return trap; }
+
+    /**
+     * Change the species of the ion (e.g., in a reaction), keeping its
+     * position and velocity.
+     * @param m New mass
+     * @param Z New charge in units of e
+     * @param lasers Doppler cooling lasers affecting the new species
+     */
+    void set_species(double m, double Z, const lasers_ptr &lasers)
+    {
+        this->m = m;
+        this->Z = Z;
+        this->charge = Z * constants::q_e;
+        this->lasers = lasers;
+    }
+
+    /**
+     * Apply a single time step of integration with a fixed set of forces.
+     * Disabled forces are compiled out, so loops over ions should select the
+     * specialization once (see `enabled_forces`) rather than per ion.
+     * @tparam forces Flags of the enabled forces (see `Force`)
+     * @param t Current time
+     * @param coulomb_forces Pre-computed Coulomb forces due to all other ions
+     * plus forces from field maps
+     * @param index Column of this ion in `coulomb_forces`
+     */
+    template <unsigned int forces>
+    void step(const double &t, const mat &coulomb_forces,
+              const unsigned int &index);
+
     /**
-     * Apply a single time step of integration.
+     * Apply a single time step of integration with the forces enabled in the
+     * simulation parameters.
      * @param t Current time
      * @param forces Pre-computed Coulomb forces due to all other ions
      * @param index
@@ -101,10 +176,110 @@ public:
     /**
      * Pre-compute the Coluomb forces due to all other ions in the trap.
      * @param ions Vector of all ions in the trap.
+     * @param energy If not null, set to the Coulomb potential energy of this
+     * ion in the field of all other ions.
+     */
+    const vec coulomb(const std::vector<Ion> &ions, double *energy=nullptr);
+
+    /// Potential energy of the ion in the secular (pseudo)potential.
+    double secular_energy() const;
+
+    /**
+     * Spring constants of the secular (pseudo)potential along x, y and z in
+     * N/m, so that the secular force is `-k[j] * x[j]`.
+     * @param k Set to the three spring constants
      */
-    const vec coulomb(const std::vector<Ion> &ions);
+    void secular_stiffness(double *k) const;
 };
 
+
+inline void Ion::add_doppler_force(double *F) const
+{
+    for (const auto &laser: lasers)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            F[j] += laser->F0 * laser->wave_vector[j] - laser->beta * v[j];
+        }
+    }
+}
+
+
+inline void Ion::secular_stiffness(double *k) const
+{
+    const double A = charge*pow(trap->V_rf, 2)/(m*pow(trap->omega_rf, 2)*pow(trap->r0, 4));
+    const double B = trap->kappa*trap->U_ec/(2*pow(trap->z0, 2));
+    k[0] = 2 * charge * (A - B);
+    k[1] = 2 * charge * (A - B);
+    k[2] = 4 * charge * B;
+}
+
+
+inline void Ion::add_secular_force(double *F) const
+{
+    double k[3];
+    secular_stiffness(k);
+    for (unsigned int j = 0; j < 3; j++) {
+        F[j] -= k[j] * x[j];
+    }
+}
+
+
+inline void Ion::add_micromotion_force(double t, double *F) const
+{
+    // FIXME
+}
+
+
+inline void Ion::add_stochastic_force(double *F) const
+{
+    // FIXME
+    // double v;
+    // vec direction = {uniform(rng), uniform(rng), uniform(rng)};
+    // vec hat = normalise(direction);
+    // v = 0; // sqrt(2*kB*p->gamma_col*p->dt/this->m);
+    // F = this->m*v*hat/p->dt;
+}
+
+
+template <unsigned int forces>
+void Ion::step(const double &t, const mat &coulomb_forces,
+               const unsigned int &index)
+{
+    const double dt = p->dt;
+    for (unsigned int j = 0; j < 3; j++) {
+        x[j] += v[j]*dt + 0.5*a[j]*(dt*dt);
+    }
+
+    // Conditions are constant for each specialization
+    double F[3] = {0, 0, 0};
+    if (forces & SECULAR_FORCE) {
+        add_secular_force(F);
+    }
+    if (forces & MICROMOTION_FORCE) {
+        add_micromotion_force(t, F);
+    }
+    if (forces & (COULOMB_FORCE | FIELD_FORCE))
+    {
+        const double *Fc = coulomb_forces.colptr(index);
+        for (unsigned int j = 0; j < 3; j++) {
+            F[j] += Fc[j];
+        }
+    }
+    if (forces & STOCHASTIC_FORCE) {
+        add_stochastic_force(F);
+    }
+    if (forces & DOPPLER_FORCE) {
+        add_doppler_force(F);
+    }
+
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        const double accel = F[j] / m;
+        v[j] += 0.5*(a[j] + accel)*dt;
+        a[j] = accel;
+    }
+}
+
 }  // namespace ionmd
 
 #endif
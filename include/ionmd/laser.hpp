@@ -24,7 +24,7 @@ class Laser
 {
 public:
     /// Angular frequency detuning from transition (not used in damping model)
-    double detuning;
+    double detuning = 0;
 
     /// The laser's k-vector
     vec wave_vector;
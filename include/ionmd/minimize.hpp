@@ -0,0 +1,90 @@
+#ifndef MINIMIZE_HPP
+#define MINIMIZE_HPP
+
+#include <string>
+#include <vector>
+#include "ion.hpp"
+#include "params.hpp"
+
+namespace ionmd {
+
+/**
+ * Energy minimization methods.
+ *
+ * - FIRE (fast inertial relaxation engine): damped dynamics that mixes the
+ *   velocity towards the force and restarts when moving uphill. Robust far
+ *   from the minimum.
+ * - L-BFGS: quasi-Newton steps with a backtracking line search. Usually needs
+ *   far fewer force evaluations close to the minimum.
+ */
+enum class Minimizer { FIRE, LBFGS };
+
+
+/**
+ * Look up a minimizer by name ("fire" or "lbfgs").
+ * @throws std::invalid_argument for unknown names
+ */
+auto parse_minimizer(const std::string &name) -> Minimizer;
+
+
+/// Options of `minimize_energy`.
+struct MinimizeOptions
+{
+    /// Method ("fire" or "lbfgs")
+    std::string method = "lbfgs";
+
+    /// Maximum number of iterations (force evaluations for FIRE)
+    unsigned int max_iterations = 10000;
+
+    /// Stop when the largest net force on an ion is below this fraction of
+    /// the typical force on an ion (mean of the trap and Coulomb force
+    /// magnitudes, which balance at equilibrium)
+    double tolerance = 1e-6;
+
+    /// Number of correction pairs kept by L-BFGS
+    unsigned int history = 10;
+};
+
+
+/// Outcome of `minimize_energy`.
+struct MinimizeResult
+{
+    /// Number of iterations used
+    unsigned int iterations;
+
+    /// Final trap and Coulomb potential energy in J
+    double energy;
+
+    /// Largest net force on an ion in N
+    double max_force;
+
+    /// True if the tolerance was reached
+    bool converged;
+};
+
+
+/**
+ * Move ions to a (local) minimum of the potential energy in the secular
+ * (pseudo)potential of the trap and of their Coulomb interaction, e.g., to
+ * find equilibrium crystal structures without integrating the cooled
+ * dynamics.
+ *
+ * Forces from the trap and from the Coulomb solver are evaluated with the
+ * settings of `params` (secular and Coulomb forces only if enabled, Coulomb
+ * tile sizes), always in double precision. Field maps add their effective
+ * potential (see `FieldMap::effective_energy`), with forces from central
+ * differences. Velocities and accelerations are set to zero.
+ *
+ * @param ions Ions to move
+ * @param params Simulation parameters
+ * @param options
+ * @throws std::invalid_argument for an unknown method or inconsistent field
+ * maps
+ * @throws std::runtime_error if a field map can't be loaded
+ */
+auto minimize_energy(std::vector<Ion> &ions, const SimParams &params,
+                     const MinimizeOptions &options=MinimizeOptions()) -> MinimizeResult;
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MODES_HPP
+#define MODES_HPP
+
+#include <vector>
+#include <armadillo>
+#include "ion.hpp"
+#include "params.hpp"
+
+namespace ionmd {
+
+/**
+ * Normal modes of small oscillations of a crystal about its equilibrium.
+ */
+struct NormalModes
+{
+    /// Angular frequencies in rad/s in ascending order. Unstable directions
+    /// (negative curvature) are given as negative frequencies.
+    arma::vec frequencies;
+
+    /// Normalized mass-weighted mode vectors, one column per mode with 3 rows
+    /// per ion (x, y, z). The displacement of ion i is proportional to the
+    /// ion's rows divided by the square root of its mass.
+    arma::mat vectors;
+};
+
+
+/**
+ * Hessian of the potential energy in the secular (pseudo)potential of the
+ * trap, in the effective potential of field maps (see
+ * `FieldMap::effective_energy`) and of the Coulomb interaction (if enabled
+ * in `params`).
+ *
+ * Off-diagonal ion blocks are assembled in parallel over tiles of ion pairs,
+ * each pair once; diagonal blocks follow from the translation invariance of
+ * the Coulomb energy. Field maps add to the diagonal blocks by central
+ * differences of the interpolated potential.
+ *
+ * @param ions Ions, usually at an equilibrium (see `minimize_energy`)
+ * @param params Simulation parameters
+ * @returns the symmetric 3N x 3N Hessian in N/m, with 3 rows per ion
+ * @throws std::invalid_argument for inconsistent field maps
+ * @throws std::runtime_error if a field map can't be loaded
+ */
+auto hessian(const std::vector<Ion> &ions, const SimParams &params) -> arma::mat;
+
+
+/**
+ * Compute normal modes about the current ion positions, which should be an
+ * equilibrium (see `minimize_energy`).
+ *
+ * With `num_modes` 0, all modes are computed from the dense mass-weighted
+ * Hessian with LAPACK. Otherwise the lowest `num_modes` modes are found with
+ * the Lanczos method (with full reorthogonalization) using Hessian-vector
+ * products computed directly from the ion positions, so memory grows with N
+ * times the Krylov space dimension rather than with N^2.
+ *
+ * @param ions Ions
+ * @param params Simulation parameters
+ * @param num_modes Number of lowest modes to compute or 0 for all
+ * @param tolerance Relative accuracy of the squared frequencies of the
+ * Lanczos method
+ * @throws std::invalid_argument if `num_modes` exceeds 3N or for
+ * inconsistent field maps
+ * @throws std::runtime_error if the eigenvalue decomposition fails or a
+ * field map can't be loaded
+ */
+auto normal_modes(const std::vector<Ion> &ions, const SimParams &params,
+                  unsigned int num_modes=0, double tolerance=1e-10) -> NormalModes;
+
+}  // namespace ionmd
+
+#endif
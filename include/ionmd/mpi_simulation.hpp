@@ -0,0 +1,101 @@
+#ifndef MPI_SIMULATION_HPP
+#define MPI_SIMULATION_HPP
+
+#include <vector>
+#include <mpi.h>
+#include <armadillo>
+#include "params.hpp"
+#include "trap.hpp"
+#include "ion.hpp"
+#include "simulation.hpp"
+#include "coulomb.hpp"
+
+namespace ionmd {
+
+/**
+ * Simulation distributed over MPI ranks (built with -DBUILD_MPI=ON).
+ *
+ * Ions are split into contiguous blocks, one per rank. Every rank integrates
+ * its own ions using the same update as `Simulation` and computes their
+ * Coulomb forces directly from the positions of all ions, which are
+ * exchanged with an allgather after every step. Within a rank the force and
+ * update loops are parallelized with OpenMP as usual.
+ *
+ * Trajectories are written to `<path>/trajectories.bin` in the same raw
+ * format as `DataWriter` using collective MPI-IO, each rank writing the
+ * slice of every frame that belongs to its ions.
+ */
+class MPISimulation
+{
+private:
+    MPI_Comm comm;
+    int rank;
+    int num_ranks;
+
+    params_ptr p;
+    trap_ptr trap;
+
+    /// Total number of ions.
+    size_t num_ions;
+
+    /// Index of the first ion owned by this rank.
+    size_t first;
+
+    /// Ions owned by this rank.
+    std::vector<Ion> ions;
+
+    /// Masses and charges (in C) of all ions.
+    std::vector<double> masses, charges;
+
+    /// Number of position values (3 per ion) and offsets of every rank.
+    std::vector<int> counts, offsets;
+
+    /// Positions of all ions (3 values per ion).
+    arma::vec positions;
+
+    /// Exchange positions of local ions with all other ranks.
+    void gather_positions();
+
+    /// Direct Coulomb solver over the positions of all ions.
+    CoulombSolver coulomb;
+
+    /// Write metadata and the trajectory header from rank 0.
+    /// @returns the size of the header in bytes
+    MPI_Offset write_header();
+
+public:
+    /// Simulation status
+    SimStatus status = SimStatus::IDLE;
+
+    /**
+     * Distribute a set of ions over the ranks of a communicator. This must be
+     * called by all ranks with the same arguments.
+     * @param comm
+     * @param params
+     * @param trap
+     * @param ions All ions of the simulation
+     * @throws std::invalid_argument with fewer ions than ranks or with field
+     * maps (not supported)
+     */
+    MPISimulation(MPI_Comm comm, const SimParams &params, const Trap &trap,
+                  const std::vector<IonSpec> &ions);
+
+    /// Index of the first ion owned by this rank.
+    size_t get_first() const { return first; }
+
+    /// Number of ions owned by this rank.
+    size_t get_num_local() const { return ions.size(); }
+
+    /// Positions of all ions after the last step (3 values per ion).
+    auto get_positions() const -> const arma::vec & { return positions; }
+
+    /**
+     * Run the simulation. This is a blocking, collective function.
+     * @throws std::runtime_error if output can't be written
+     */
+    void run();
+};
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace ionmd {
+
+/**
+ * Binding of OpenMP threads to CPUs.
+ *
+ * Loops over ions use a static schedule, so thread `k` always works on the
+ * same contiguous block of ions. With threads bound to CPUs and ion data
+ * first touched in the same partition (see `first_touch`), every thread then
+ * reads and writes memory of its own NUMA node.
+ */
+enum class Affinity
+{
+    NONE,   ///< Leave placement to the OpenMP runtime (e.g., OMP_PROC_BIND)
+    CLOSE,  ///< Consecutive threads on consecutive CPUs, filling one node first
+    SPREAD  ///< Consecutive threads alternate between NUMA nodes
+};
+
+
+/**
+ * Look up an affinity by name ("none", "close" or "spread").
+ * @throws std::invalid_argument for unknown names
+ */
+auto parse_affinity(const std::string &name) -> Affinity;
+
+
+/**
+ * CPUs of every NUMA node that this process may run on, from sysfs. Returns
+ * a single node with all allowed CPUs when the topology is not available.
+ * The allowed CPUs are those of the process (its main thread) when first
+ * asked, so threads bound later don't narrow them.
+ */
+auto numa_nodes() -> std::vector<std::vector<int>>;
+
+
+/// CPUs the calling thread may run on.
+auto thread_cpus() -> std::vector<int>;
+
+
+/**
+ * Bind the threads of the calling thread's OpenMP pool (including the calling
+ * thread) to CPUs until `restore_threads`. Nothing is bound inside a parallel
+ * region (e.g., in an ensemble member), where the single-thread team would
+ * pin every member to the same CPU.
+ * @returns the CPUs every thread of the pool could run on before (empty if
+ * nothing was bound)
+ */
+auto bind_threads(Affinity affinity) -> std::vector<std::vector<int>>;
+
+
+/**
+ * Give the threads of the calling thread's pool back the CPUs returned by
+ * `bind_threads`.
+ */
+void restore_threads(const std::vector<std::vector<int>> &cpus);
+
+
+/**
+ * Touch uninitialized memory of `count` elements of `size` bytes in parallel
+ * with the same static partition as the loops over ions, so that the kernel
+ * places each page on the NUMA node of the thread that will use it. Only
+ * call this on memory that does not hold objects yet (e.g., after
+ * `std::vector::reserve`).
+ */
+void first_touch(void *data, size_t count, size_t size);
+
+}  // namespace ionmd
+
+#endif
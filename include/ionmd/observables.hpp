@@ -0,0 +1,127 @@
+#ifndef OBSERVABLES_HPP
+#define OBSERVABLES_HPP
+
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <armadillo>
+#include "params.hpp"
+#include "trap.hpp"
+#include "ion.hpp"
+#include "field.hpp"
+
+namespace ionmd {
+
+/**
+ * Computes physical observables while the simulation runs and writes them as a
+ * time series to `observables.csv` in the output directory.
+ *
+ * Available observables (set with `SimParams::observables`):
+ *
+ * - `kinetic_energy`: total kinetic energy in J
+ * - `trap_energy`: total potential energy in the secular trap potential and
+ *   in the potential of field maps (at the time of the record) in J
+ * - `coulomb_energy`: total Coulomb potential energy in J
+ * - `total_energy`: sum of the three energies above
+ * - `temperature`: kinetic temperature of all ions in K. This equals the
+ *   secular temperature as long as micromotion is disabled.
+ * - `species_temperature`: kinetic temperature of each species (ions with
+ *   equal mass and charge), one column per species
+ * - `msd`: mean square displacement from the first recorded positions (or
+ *   from where ions were loaded) in m^2
+ * - `structure_factor`: static structure factor S(k) at the wave vector
+ *   `SimParams::structure_factor_k`
+ *
+ * Observables are evaluated at the beginning of a time step so that the
+ * Coulomb energy can be taken from the force computation of that step.
+ * Ions that left the trap (see `SimParams::check_bounds`) no longer
+ * contribute. Averages over no ions (e.g., the temperature of a species
+ * that fully reacted) are written as empty fields.
+ *
+ * The reference positions and the size of `observables.csv` are stored in
+ * checkpoints (see `save`), so a resumed run continues the file of the run
+ * it resumes.
+ */
+class Observables
+{
+private:
+    params_ptr p;
+
+    std::ofstream out;
+
+    bool kinetic = false;
+    bool trap_energy = false;
+    bool coulomb = false;
+    bool total = false;
+    bool temperature = false;
+    bool species_temperature = false;
+    bool msd = false;
+    bool structure_factor = false;
+
+    /// Number of ions including ions that left the trap or are still to be
+    /// loaded.
+    size_t num_slots;
+
+    /// Mass and charge of every species.
+    std::vector<std::pair<double, double>> species_params;
+
+    /// Positions at the first recorded step (for `msd`).
+    arma::mat reference;
+
+    /// Add a species unless it is known.
+    void add_species(double m, double Z);
+
+    /// Index of a species in `species_params` (its size if unknown).
+    auto species_index(double m, double Z) const -> unsigned int;
+
+    /// Write a column with the average of `count` values (empty if 0).
+    void write_average(double sum, unsigned int count);
+
+public:
+    /**
+     * @param params
+     * @param ions All ions in their original order, including ions that
+     * left the trap or are still to be loaded
+     * @param products Mass and charge of species that ions may turn into
+     * during the run
+     * @param state Continue from a state written by `save` (null to start a
+     * new file)
+     * @throws std::invalid_argument for unknown observable names
+     * @throws std::runtime_error if the output file can't be created or
+     * doesn't match the state
+     */
+    Observables(params_ptr params, const std::vector<Ion> &ions,
+                const std::vector<std::pair<double, double>> &products={},
+                std::istream *state=nullptr);
+
+    /**
+     * Write the reference positions, species and the size of the output
+     * file.
+     * @throws std::runtime_error if flushing the output fails
+     */
+    void save(std::ostream &state);
+
+    /// Names of the columns written for each record.
+    auto columns() const -> std::vector<std::string>;
+
+    /**
+     * Compute observables and append them to the output file.
+     * @param step Time step index
+     * @param t Simulation time
+     * @param ions
+     * @param ids Original index of each ion (ions may have been reordered
+     * since the observables were created)
+     * @param coulomb_energies Coulomb energy of each ion as computed by
+     * `Ion::coulomb` (ignored unless Coulomb energies are requested)
+     * @param field Field maps of the simulation (null without)
+     */
+    void record(unsigned int step, double t, const std::vector<Ion> &ions,
+                const std::vector<size_t> &ids, const arma::vec &coulomb_energies,
+                const FieldMap *field=nullptr);
+};
+
+}  // namespace ionmd
+
+#endif
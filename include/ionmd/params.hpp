@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <vector>
 #include <json.hpp>
 #include "util.hpp"
 
@@ -38,13 +39,135 @@ struct SimParams {
     /// Enable Doppler cooling simulation
     bool doppler_enabled = false;
 
+    /// Remove ions leaving the trap (radially beyond r0 or axially beyond z0)
+    /// and list them in `lost_ions.csv`
+    bool check_bounds = true;
+
+    /// Electrode potential grid files (see `FieldGrid`) adding to the
+    /// secular force, one per electrode
+    std::vector<std::string> field_maps = {};
+
+    /// DC and rf amplitude voltages of the electrodes of `field_maps` (empty
+    /// for all 0)
+    std::vector<double> field_dc = {};
+    std::vector<double> field_rf = {};
+
     /// Directory to write data to
     std::string path = "output";
 
     /// How many points in time to store before writing to disk.
-    // FIXME: enforce being a divisor of num_steps
     size_t buffer_size = 5000;
 
+    /// Write trajectories with lossy fixed-point compression
+    bool compress_trajectories = false;
+
+    /// Precision of compressed trajectory positions in m
+    double trajectory_precision = 1e-9;
+
+    /// Write a checkpoint every this many time steps (0 to disable)
+    unsigned int checkpoint_interval = 0;
+
+    /// Seed for the random number generator
+    unsigned int seed = 0;
+
+    /// Write output files (disable for runs only read from memory)
+    bool write_output = true;
+
+    /// Number of most recent frames to keep in memory (0 to disable)
+    size_t ring_size = 0;
+
+    /// Keep every this many time steps in the in-memory ring
+    unsigned int ring_decimation = 1;
+
+    /// Compute observables every this many time steps (0 to disable)
+    unsigned int observables_interval = 0;
+
+    /// Observables to compute (see observables.hpp for available names)
+    std::vector<std::string> observables = {
+        "temperature", "kinetic_energy", "trap_energy", "coulomb_energy",
+        "total_energy"
+    };
+
+    /// Wave vector in 1/m at which to evaluate the structure factor
+    std::vector<double> structure_factor_k = {0, 0, 0};
+
+    /// Sample positions for power spectra every this many time steps (0 to
+    /// disable, see spectra.hpp)
+    unsigned int spectrum_interval = 0;
+
+    /// Samples per Fourier transformed block of the Welch average
+    unsigned int spectrum_block = 1024;
+
+    /// Overlap of consecutive blocks as a fraction of the block size
+    double spectrum_overlap = 0.5;
+
+    /// Axes along which to compute spectra of ion displacements
+    std::vector<std::string> spectrum_axes = {"x", "y", "z"};
+
+    /// Number of lowest normal modes for which to compute spectra
+    unsigned int spectrum_modes = 0;
+
+    /// Add ion positions to synthetic camera images every this many time
+    /// steps (0 to disable, see camera.hpp)
+    unsigned int image_interval = 0;
+
+    /// Write an image every this many time steps (0 for one image of the
+    /// whole run)
+    unsigned int image_exposure = 0;
+
+    /// Image width and height in pixels
+    std::vector<unsigned int> image_size = {256, 64};
+
+    /// Pixel size in the object plane in m
+    double image_pixel_size = 1e-6;
+
+    /// Point imaged to the center of the image
+    std::vector<double> image_center = {0, 0, 0};
+
+    /// Directions of the image rows and columns
+    std::vector<double> image_horizontal = {0, 0, 1};
+    std::vector<double> image_vertical = {1, 0, 0};
+
+    /// Standard deviation of the Gaussian point spread function in the object
+    /// plane in m
+    double image_psf_sigma = 1e-6;
+
+    /// Weight ions with their laser scattering rate
+    bool image_scattering = false;
+
+    /// Ions per i-block of the Coulomb solver (0 to size from the L2 cache)
+    unsigned int coulomb_tile_i = 0;
+
+    /// Ions per j-tile of the Coulomb solver (0 to size from the L1 cache)
+    unsigned int coulomb_tile_j = 0;
+
+    /// Evaluate Coulomb pair interactions in single precision
+    bool coulomb_mixed_precision = false;
+
+    /// Reorder ions along a space-filling curve every this many time steps
+    /// (0 to disable)
+    unsigned int reorder_interval = 0;
+
+    /// Space-filling curve used for reordering ("hilbert" or "morton")
+    std::string reorder_curve = "hilbert";
+
+    /// Count hardware events per phase (also enabled by setting the
+    /// IONMD_PERF_EVENTS environment variable, see perf.hpp)
+    bool perf_counters = false;
+
+    /// Hardware events to count
+    std::vector<std::string> perf_events = {
+        "cycles", "instructions", "cache-misses", "l1d-read-misses"
+    };
+
+    /// Binding of OpenMP threads to CPUs during a run: "none" (leave to the
+    /// OpenMP runtime), "close" (fill one NUMA node after the other) or
+    /// "spread" (alternate between NUMA nodes)
+    std::string thread_affinity = "none";
+
+    /// Place ion data in the memory of the NUMA node of the thread updating it
+    bool numa_first_touch = true;
+
     auto to_string() const -> std::string
     {
         std::stringstream stream;
@@ -56,8 +179,45 @@ struct SimParams {
                << "  coulomb: " << coulomb_enabled << "\n"
                << "  stochastic: " << stochastic_enabled << "\n"
                << "  doppler: " << doppler_enabled << "\n"
+               << "  check_bounds: " << check_bounds << "\n"
+               << "  field_maps: " << join(field_maps) << "\n"
+               << "  field_dc: " << join(field_dc) << "\n"
+               << "  field_rf: " << join(field_rf) << "\n"
                << "  path: " << path << "\n"
-               << "  buffer_size: " << buffer_size << "\n";
+               << "  buffer_size: " << buffer_size << "\n"
+               << "  compress_trajectories: " << compress_trajectories << "\n"
+               << "  trajectory_precision: " << trajectory_precision << "\n"
+               << "  checkpoint_interval: " << checkpoint_interval << "\n"
+               << "  seed: " << seed << "\n"
+               << "  write_output: " << write_output << "\n"
+               << "  ring_size: " << ring_size << "\n"
+               << "  ring_decimation: " << ring_decimation << "\n"
+               << "  observables_interval: " << observables_interval << "\n"
+               << "  observables: " << join(observables) << "\n"
+               << "  structure_factor_k: " << join(structure_factor_k) << "\n"
+               << "  spectrum_interval: " << spectrum_interval << "\n"
+               << "  spectrum_block: " << spectrum_block << "\n"
+               << "  spectrum_overlap: " << spectrum_overlap << "\n"
+               << "  spectrum_axes: " << join(spectrum_axes) << "\n"
+               << "  spectrum_modes: " << spectrum_modes << "\n"
+               << "  image_interval: " << image_interval << "\n"
+               << "  image_exposure: " << image_exposure << "\n"
+               << "  image_size: " << join(image_size) << "\n"
+               << "  image_pixel_size: " << image_pixel_size << "\n"
+               << "  image_center: " << join(image_center) << "\n"
+               << "  image_horizontal: " << join(image_horizontal) << "\n"
+               << "  image_vertical: " << join(image_vertical) << "\n"
+               << "  image_psf_sigma: " << image_psf_sigma << "\n"
+               << "  image_scattering: " << image_scattering << "\n"
+               << "  coulomb_tile_i: " << coulomb_tile_i << "\n"
+               << "  coulomb_tile_j: " << coulomb_tile_j << "\n"
+               << "  coulomb_mixed_precision: " << coulomb_mixed_precision << "\n"
+               << "  reorder_interval: " << reorder_interval << "\n"
+               << "  reorder_curve: " << reorder_curve << "\n"
+               << "  perf_counters: " << perf_counters << "\n"
+               << "  perf_events: " << join(perf_events) << "\n"
+               << "  thread_affinity: " << thread_affinity << "\n"
+               << "  numa_first_touch: " << numa_first_touch << "\n";
         return stream.str();
     }
 
@@ -73,7 +233,44 @@ struct SimParams {
             {"coulomb_enabled", coulomb_enabled},
             {"stochastic_enabled", stochastic_enabled},
             {"doppler_enabled", doppler_enabled},
-            {"buffer_size", buffer_size}
+            {"check_bounds", check_bounds},
+            {"field_maps", field_maps},
+            {"field_dc", field_dc},
+            {"field_rf", field_rf},
+            {"buffer_size", buffer_size},
+            {"compress_trajectories", compress_trajectories},
+            {"trajectory_precision", trajectory_precision},
+            {"checkpoint_interval", checkpoint_interval},
+            {"seed", seed},
+            {"write_output", write_output},
+            {"ring_size", ring_size},
+            {"ring_decimation", ring_decimation},
+            {"observables_interval", observables_interval},
+            {"observables", observables},
+            {"structure_factor_k", structure_factor_k},
+            {"spectrum_interval", spectrum_interval},
+            {"spectrum_block", spectrum_block},
+            {"spectrum_overlap", spectrum_overlap},
+            {"spectrum_axes", spectrum_axes},
+            {"spectrum_modes", spectrum_modes},
+            {"image_interval", image_interval},
+            {"image_exposure", image_exposure},
+            {"image_size", image_size},
+            {"image_pixel_size", image_pixel_size},
+            {"image_center", image_center},
+            {"image_horizontal", image_horizontal},
+            {"image_vertical", image_vertical},
+            {"image_psf_sigma", image_psf_sigma},
+            {"image_scattering", image_scattering},
+            {"coulomb_tile_i", coulomb_tile_i},
+            {"coulomb_tile_j", coulomb_tile_j},
+            {"coulomb_mixed_precision", coulomb_mixed_precision},
+            {"reorder_interval", reorder_interval},
+            {"reorder_curve", reorder_curve},
+            {"perf_counters", perf_counters},
+            {"perf_events", perf_events},
+            {"thread_affinity", thread_affinity},
+            {"numa_first_touch", numa_first_touch}
         };
 
         return j.dump(2);
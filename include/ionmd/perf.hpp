@@ -0,0 +1,101 @@
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "profiler.hpp"
+
+namespace ionmd {
+
+/**
+ * Hardware performance counters per phase of the step loop, using Linux
+ * perf_event_open.
+ *
+ * One counter group is opened for every OpenMP thread so that work in
+ * parallel loops is included. Counters are read at the start and end of every
+ * phase timed by the profiler (see `Profiler::attach`), so this requires
+ * building with `ENABLE_PROFILER`. Only user space events of this process are
+ * counted, which works with the default `perf_event_paranoid` setting of 2.
+ *
+ * Events are given by name:
+ *
+ * - `cycles`, `instructions`, `cache-references`, `cache-misses`,
+ *   `branch-misses`: generic hardware events
+ * - `l1d-read-misses`, `llc-read-misses`: cache events
+ * - `task-clock` (ns), `page-faults`: software events, also available in
+ *   virtual machines without hardware counters
+ * - `r<hex>`: raw model specific events as listed by `perf list`, e.g., the
+ *   packed double precision vector instruction counts of the CPU
+ *
+ * When the CPU has fewer counters than events, the kernel multiplexes the
+ * group and counts are scaled by the fraction of time the group was counting.
+ */
+class PerfCounters
+{
+private:
+    static constexpr size_t num_phases = static_cast<size_t>(Phase::COUNT);
+
+    std::vector<std::string> events;
+
+    /// Counter file descriptors of each thread, the group leader first.
+    std::vector<std::vector<int>> fds;
+
+    /// Counter values summed over threads at the start of the current phase.
+    std::vector<double> start;
+
+    /// Accumulated counts per phase and event.
+    std::array<std::vector<double>, num_phases> counts;
+
+    /// Sum the current (scaled) counter values of all threads.
+    void read(std::vector<double> &values) const;
+
+    void close();
+
+public:
+    /// Events used when none are given explicitly.
+    static auto default_events() -> std::vector<std::string>;
+
+    /**
+     * Events requested with the `IONMD_PERF_EVENTS` environment variable as
+     * a comma separated list ("1" or "default" for the default events). Empty
+     * if the variable is not set.
+     */
+    static auto environment_events() -> std::vector<std::string>;
+
+    /**
+     * Open counters for all OpenMP threads.
+     * @param events Event names
+     * @throws std::runtime_error if an event is unknown or counters are not
+     * available on this system
+     */
+    PerfCounters(const std::vector<std::string> &events);
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+    ~PerfCounters();
+
+    /// Reset all accumulated counts.
+    void reset();
+
+    /// Start counting a phase.
+    void begin();
+
+    /// Add the counts since `begin` to a phase.
+    void end(Phase phase);
+
+    /// Accumulated counts by phase and event name.
+    auto totals() const -> std::map<std::string, std::map<std::string, double>>;
+
+    /// Human readable table of counts per phase, with instructions per cycle.
+    auto report() const -> std::string;
+
+    /// Counts per phase as JSON.
+    auto to_json() const -> std::string;
+};
+
+}  // namespace ionmd
+
+#endif
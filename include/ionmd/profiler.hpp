@@ -0,0 +1,157 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace ionmd {
+
+class PerfCounters;
+
+
+/**
+ * Phases of a simulation time step.
+ *
+ * Trap, micromotion, stochastic and Doppler forces are evaluated by
+ * `Ion::update` together with the integration and are part of `INTEGRATION`.
+ */
+enum class Phase
+{
+    EVENTS,       ///< Loading, removing and changing ions
+    REORDER,      ///< Spatial reordering of ions
+    COULOMB,      ///< Coulomb forces
+    FIELD,        ///< Forces from electrode field maps
+    OBSERVABLES,  ///< Observables
+    INTEGRATION,  ///< Remaining forces and velocity Verlet update
+    OUTPUT,       ///< Queuing frames for output and the in-memory ring
+    CHECKPOINT,   ///< Writing checkpoints
+    COUNT
+};
+
+
+/**
+ * Accumulated wall time per phase of the step loop.
+ *
+ * Totals may be read from other threads while a simulation is running.
+ * Timing is only compiled in when `IONMD_PROFILE` is defined (CMake option
+ * `ENABLE_PROFILER`); otherwise `IONMD_PROFILE_PHASE` expands to nothing and
+ * all totals stay zero.
+ */
+class Profiler
+{
+private:
+    static constexpr size_t num_phases = static_cast<size_t>(Phase::COUNT);
+
+    std::array<std::atomic<int64_t>, num_phases> nanoseconds;
+    std::array<std::atomic<uint64_t>, num_phases> calls;
+    std::atomic<int64_t> run_nanoseconds;
+    std::atomic<uint64_t> steps;
+
+    /// Hardware counters read around every phase (optional).
+    PerfCounters *perf = nullptr;
+
+    void perf_begin();
+    void perf_end(Phase phase);
+
+public:
+    typedef std::chrono::steady_clock clock;
+
+    Profiler();
+    Profiler(const Profiler &other);
+    Profiler &operator=(const Profiler &other);
+
+    /// Name of a phase as used in reports.
+    static auto phase_name(Phase phase) -> std::string;
+
+    /// True if timing is compiled in.
+    static constexpr bool enabled()
+    {
+#ifdef IONMD_PROFILE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// Reset all totals.
+    void reset();
+
+    /// Also count hardware events of every phase (null to detach).
+    void attach(PerfCounters *perf) { this->perf = perf; }
+
+    /// Start a phase and return its start time.
+    clock::time_point begin()
+    {
+        if (perf != nullptr) {
+            perf_begin();
+        }
+        return clock::now();
+    }
+
+    /// Add the time since `start` to a phase.
+    void add(Phase phase, clock::time_point start)
+    {
+        const auto elapsed = clock::now() - start;
+        const auto i = static_cast<size_t>(phase);
+        nanoseconds[i].fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+            std::memory_order_relaxed);
+        calls[i].fetch_add(1, std::memory_order_relaxed);
+
+        if (perf != nullptr) {
+            perf_end(phase);
+        }
+    }
+
+    /// Set the total wall time and number of steps of the run.
+    void set_run(double seconds, uint64_t steps);
+
+    /// Total time of a phase in s.
+    double seconds(Phase phase) const;
+
+    /// Total time of all phases by name in s, including "run" for the whole
+    /// run (so the difference to the phases is untracked overhead).
+    auto totals() const -> std::map<std::string, double>;
+
+    /// Human readable table of the totals.
+    auto report() const -> std::string;
+
+    /// Totals, call counts and time per step as JSON.
+    auto to_json() const -> std::string;
+};
+
+
+/**
+ * Adds the lifetime of the object to a phase of a profiler.
+ */
+class PhaseTimer
+{
+private:
+    Profiler &profiler;
+    const Phase phase;
+    const Profiler::clock::time_point start;
+
+public:
+    PhaseTimer(Profiler &profiler, Phase phase)
+        : profiler(profiler), phase(phase), start(profiler.begin())
+    {}
+
+    ~PhaseTimer() { profiler.add(phase, start); }
+};
+
+}  // namespace ionmd
+
+
+/// Time the rest of the enclosing scope as `phase` (one per scope).
+#ifdef IONMD_PROFILE
+#define IONMD_PROFILE_PHASE(profiler, phase) \
+    ionmd::PhaseTimer ionmd_phase_timer((profiler), (phase))
+#else
+#define IONMD_PROFILE_PHASE(profiler, phase)
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef REORDER_HPP
+#define REORDER_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Space-filling curves used to order ions so that ions close in space are
+ * also close in memory.
+ */
+enum class Curve { MORTON, HILBERT };
+
+
+/**
+ * Look up a curve by name ("morton" or "hilbert").
+ * @throws std::invalid_argument for unknown names
+ */
+auto parse_curve(const std::string &name) -> Curve;
+
+
+/// Number of bits per coordinate of curve keys.
+constexpr unsigned int curve_bits = 21;
+
+
+/// Position along the Morton (Z-order) curve of a point on the integer grid.
+uint64_t morton_key(uint32_t x, uint32_t y, uint32_t z);
+
+
+/// Position along the Hilbert curve of a point on the integer grid.
+uint64_t hilbert_key(uint32_t x, uint32_t y, uint32_t z);
+
+
+/**
+ * Order ions along a space-filling curve through their bounding box.
+ * @param ions
+ * @param curve
+ * @returns ion indices in the order they are visited by the curve
+ */
+auto spatial_order(const std::vector<Ion> &ions, Curve curve) -> std::vector<size_t>;
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef REPLICAS_HPP
+#define REPLICAS_HPP
+
+#include <vector>
+#include <armadillo>
+#include "params.hpp"
+#include "trap.hpp"
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Lockstep engine for many independent replicas of the same small crystal.
+ *
+ * For small crystals the per-ion overhead of `Simulation` dominates the
+ * physics. Here replicas are grouped into blocks of `lanes` replicas and the
+ * state is stored as [block][ion][dimension][lane], so the innermost index
+ * runs over independent replicas. Every force kernel is then a loop over lanes
+ * with no dependencies between iterations, which the compiler maps onto SIMD
+ * instructions (one replica per vector lane). Blocks are independent and are
+ * integrated in parallel with OpenMP, each block staying in one thread's cache
+ * for the whole run.
+ *
+ * All replicas share the ion species and lasers; trap parameters and initial
+ * conditions may differ per replica. The secular, Coulomb and Doppler forces
+ * are supported and are enabled using the flags in `SimParams`. Integration
+ * uses the velocity Verlet method with all forces evaluated at the updated
+ * positions.
+ */
+class ReplicaBatch
+{
+public:
+    /// Number of replicas integrated together in SIMD lanes.
+    static constexpr unsigned int lanes = 8;
+
+private:
+    const SimParams params;
+
+    const size_t num_ions;
+    const size_t num_replicas;
+    const size_t num_blocks;
+
+    /// Ion state, see `index`.
+    std::vector<double> x, v, a;
+
+    /// Ion mass and charge (shared by all replicas).
+    std::vector<double> mass, charge;
+
+    /// Constant part and damping coefficient of the Doppler force per ion.
+    std::vector<double> doppler_force, doppler_beta;
+
+    /// Secular spring constants per [block][ion][lane].
+    std::vector<double> k_radial, k_axial;
+
+    /// Elapsed simulation time.
+    double t = 0;
+
+    /// Offset of the first lane of the given block, ion and dimension.
+    inline size_t index(size_t block, size_t ion, unsigned int dim=0) const
+    {
+        return ((block*num_ions + ion)*3 + dim)*lanes;
+    }
+
+    /// Compute the forces on all ions of a block.
+    void compute_forces(size_t block, double *F) const;
+
+    /// Advance a block by one time step.
+    void step(size_t block, double *F);
+
+public:
+    /**
+     * @param params Simulation parameters (time step and enabled forces)
+     * @param trap Trap parameters used for all replicas initially
+     * @param ions Ion species and initial positions used for all replicas
+     * @param num_replicas Number of replicas
+     * @throws std::invalid_argument without ions or replicas, or with field
+     * maps (not supported)
+     */
+    ReplicaBatch(const SimParams &params, const Trap &trap,
+                 const std::vector<IonSpec> &ions, size_t num_replicas);
+
+    size_t get_num_ions() const { return num_ions; }
+    size_t get_num_replicas() const { return num_replicas; }
+    double get_time() const { return t; }
+
+    /**
+     * Set the trap parameters of a single replica.
+     * @param replica
+     * @param trap
+     */
+    void set_trap(size_t replica, const Trap &trap);
+
+    /**
+     * Set the position and velocity of an ion in a single replica.
+     * @param replica
+     * @param ion
+     * @param x Position
+     * @param v Velocity
+     */
+    void set_state(size_t replica, size_t ion, const arma::vec &x,
+                   const arma::vec &v);
+
+    /// Positions of all ions of a replica (one column per ion).
+    auto get_positions(size_t replica) const -> arma::mat;
+
+    /// Velocities of all ions of a replica (one column per ion).
+    auto get_velocities(size_t replica) const -> arma::mat;
+
+    /// Total kinetic energy of a replica.
+    double kinetic_energy(size_t replica) const;
+
+    /**
+     * Advance all replicas. This is a blocking function and may be called
+     * repeatedly to continue integrating.
+     * @param num_steps Number of time steps
+     */
+    void run(unsigned int num_steps);
+};
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef RING_HPP
+#define RING_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <armadillo>
+
+namespace ionmd {
+
+/**
+ * Fixed size ring buffer holding the most recent trajectory frames in memory.
+ *
+ * The simulation thread pushes frames while other threads (e.g., the Python
+ * interpreter) take snapshots of the latest frames. Storage is allocated once
+ * so pushing a frame is a single copy under a short lock.
+ */
+class FrameRing
+{
+private:
+    /// Number of values per frame (3 per ion).
+    const size_t frame_size;
+
+    /// Maximum number of frames kept.
+    const size_t capacity;
+
+    /// Frame storage, one column per slot.
+    arma::mat frames;
+
+    /// Time step index of the frame in each slot.
+    std::vector<unsigned int> steps;
+
+    /// Total number of frames pushed so far.
+    uint64_t count;
+
+    mutable std::mutex mutex;
+
+public:
+    /**
+     * @param frame_size Number of values per frame
+     * @param capacity Number of frames to keep
+     */
+    FrameRing(size_t frame_size, size_t capacity);
+
+    /// Number of values per frame.
+    size_t get_frame_size() const { return frame_size; }
+
+    /// Maximum number of frames kept.
+    size_t get_capacity() const { return capacity; }
+
+    /// Number of frames currently available.
+    size_t size() const;
+
+    /**
+     * Store a frame, overwriting the oldest one when full.
+     * @param step Time step index of the frame
+     * @param frame Frame data of `frame_size` values
+     */
+    void push(unsigned int step, const arma::vec &frame);
+
+    /**
+     * Copy the latest frames, oldest first.
+     * @param positions Output of at least `max_frames * frame_size` values
+     * @param step_indices Output of at least `max_frames` time step indices
+     * @param max_frames Maximum number of frames to copy
+     * @returns The number of frames copied
+     */
+    size_t copy_latest(double *positions, unsigned int *step_indices,
+                       size_t max_frames) const;
+};
+
+typedef std::shared_ptr<FrameRing> ring_ptr;
+
+}  // namespace ionmd
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SERIALIZE_HPP
+#define SERIALIZE_HPP
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <armadillo>
+
+namespace ionmd {
+
+/**
+ * Minimal binary serialization helpers for checkpoints. Values are stored in
+ * native byte order: checkpoints are meant for restarting on the same kind of
+ * machine, not for archiving.
+ */
+namespace serialize {
+
+template <typename T>
+void put(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+
+inline void put(std::ostream &out, const std::string &value)
+{
+    put<uint64_t>(out, value.size());
+    out.write(value.data(), value.size());
+}
+
+
+inline void put(std::ostream &out, const arma::vec &value)
+{
+    put<uint64_t>(out, value.n_elem);
+    out.write(reinterpret_cast<const char *>(value.memptr()),
+              value.n_elem * sizeof(double));
+}
+
+
+inline void put(std::ostream &out, const arma::mat &value)
+{
+    put<uint64_t>(out, value.n_rows);
+    put<uint64_t>(out, value.n_cols);
+    out.write(reinterpret_cast<const char *>(value.memptr()),
+              value.n_elem * sizeof(double));
+}
+
+
+template <typename T>
+void put(std::ostream &out, const std::vector<T> &values)
+{
+    put<uint64_t>(out, values.size());
+    for (const auto &value: values) {
+        put(out, value);
+    }
+}
+
+
+template <typename T>
+void get(std::istream &in, T &value)
+{
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(T))) {
+        throw std::runtime_error("Truncated checkpoint file");
+    }
+}
+
+
+inline void get(std::istream &in, std::string &value)
+{
+    uint64_t size;
+    get(in, size);
+    value.resize(size);
+    if (!in.read(&value[0], size)) {
+        throw std::runtime_error("Truncated checkpoint file");
+    }
+}
+
+
+inline void get(std::istream &in, arma::vec &value)
+{
+    uint64_t size;
+    get(in, size);
+    value.set_size(size);
+    if (!in.read(reinterpret_cast<char *>(value.memptr()), size * sizeof(double))) {
+        throw std::runtime_error("Truncated checkpoint file");
+    }
+}
+
+
+inline void get(std::istream &in, arma::mat &value)
+{
+    uint64_t rows, cols;
+    get(in, rows);
+    get(in, cols);
+    value.set_size(rows, cols);
+    if (!in.read(reinterpret_cast<char *>(value.memptr()), rows * cols * sizeof(double))) {
+        throw std::runtime_error("Truncated checkpoint file");
+    }
+}
+
+
+template <typename T>
+void get(std::istream &in, std::vector<T> &values)
+{
+    uint64_t size;
+    get(in, size);
+    values.resize(size);
+    for (auto &value: values) {
+        get(in, value);
+    }
+}
+
+}  // namespace serialize
+
+}  // namespace ionmd
+
+#endif
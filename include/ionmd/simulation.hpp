@@ -1,10 +1,21 @@
 #ifndef IONMD_HPP
 #define IONMD_HPP
 
+#include <string>
+#include <random>
+#include <map>
+#include <cstdint>
 #include <armadillo>
 #include "ion.hpp"
 #include "trap.hpp"
 #include "params.hpp"
+#include "ring.hpp"
+#include "coulomb.hpp"
+#include "profiler.hpp"
+#include "perf.hpp"
+#include "minimize.hpp"
+#include "modes.hpp"
+#include "events.hpp"
 
 
 namespace ionmd {
@@ -18,6 +29,33 @@ using arma::mat;
 enum class SimStatus { IDLE, RUNNING, FINISHED, ERRORED };
 
 
+/**
+ * Record of an ion removed from the simulation, either because it left the
+ * trap (see `SimParams::check_bounds`) or by a removal event.
+ */
+struct LostIon
+{
+    /// Original index of the ion (its slot in trajectory frames)
+    size_t id;
+
+    /// Index of the time step after which the ion was outside the trap
+    unsigned int step;
+
+    /// Time at the end of that step
+    double t;
+
+    /// Ion mass
+    double m;
+
+    /// Ion charge in units of e
+    double Z;
+
+    /// Position and velocity when removed
+    arma::vec x;
+    arma::vec v;
+};
+
+
 /**
  * Class that controls the overall simulation.
  */
@@ -32,21 +70,157 @@ private:
     /// All ions to simulate.
     std::vector<Ion> ions;
 
+    /// Original index of each ion in `ions`, which may be reordered during
+    /// a run (see `SimParams::reorder_interval`). Output is always in the
+    /// original order.
+    std::vector<size_t> ion_ids;
+
+    /// Number of original indices: the ions of the run including lost ones
+    /// and those still to be loaded. Trajectory frames have a slot for each.
+    size_t ion_slots = 0;
+
+    /// Ions removed since the start of the run.
+    std::vector<LostIon> lost_ions;
+
+    /// Scheduled events by time (events at equal times in the order they
+    /// were scheduled).
+    std::multimap<double, Event> events;
+
+    /// Stochastic reactions.
+    std::vector<Reaction> reactions;
+
+    /// Index of the next time step to compute.
+    unsigned int next_step = 0;
+
+    /// Current simulation time.
+    double t = 0;
+
+    /// Random number generator for stochastic processes.
+    std::mt19937_64 rng;
+
+    /// Size of the trajectory file at the last checkpoint.
+    uint64_t traj_offset = 0;
+
+    /// True when `ions` was allocated with first touch placement (see
+    /// `place_ions`). Reset whenever ions are added or replaced.
+    bool ions_placed = false;
+
+    /// True when the next run continues from a restored checkpoint.
+    bool resuming = false;
+
+    /// Saved state of the observables, spectra and camera of the last run
+    /// (see `save_accumulators`), which a continued run picks up.
+    std::string accumulators;
+
+    /// Most recent frames of the current run (see `get_ring`).
+    ring_ptr ring;
+
+    /// Direct Coulomb solver.
+    CoulombSolver coulomb;
+
+    /// Phase timing of the current or last run.
+    Profiler profiler;
+
+    /// Hardware counters of the current or last run (if enabled).
+    std::shared_ptr<PerfCounters> perf;
+
+    /// Buffers and output of the current run.
+    struct RunState;
+
+    /// State of the current run, kept between calls of `step` (null when no
+    /// run is in progress).
+    std::unique_ptr<RunState> run_state;
+
+    /**
+     * Prepare a run: check the setup, bind threads and create buffers and
+     * output.
+     * @param fresh Start from time step 0, otherwise continue from the
+     * current state
+     * @throws std::runtime_error if the simulation can't be started
+     */
+    void begin_run(bool fresh);
+
+    /// Compute `n` time steps of the current run.
+    void advance(unsigned int n);
+
+    /// Finish the current run: flush output, restore the ion order and report
+    /// timing.
+    void end_run();
+
+    /// Size of the trajectory file up to the current time step.
+    auto trajectory_offset() -> uint64_t;
+
+    /// Serialize the state of the accumulating outputs of a run for
+    /// checkpoints.
+    auto save_accumulators(RunState &s) -> std::string;
+
+    /**
+     * Permute ions.
+     * @param order Current indices of ions in their new order
+     */
+    void permute_ions(const std::vector<size_t> &order);
+
+    /// Copy ions into memory first touched by the threads updating them.
+    /// This is the only place where ions move during a run.
+    void place_ions();
+
+    /// Open hardware counters if requested and attach them to the profiler.
+    void start_perf_counters();
+
+    /// Current indices of ions in their original order.
+    auto original_order() const -> std::vector<size_t>;
+
+    /// Number of scheduled ion loading events.
+    auto pending_loads() const -> size_t;
+
+    /**
+     * Record an ion as lost (without removing it from `ions`).
+     * @param i Current index of the ion
+     * @param t Time of the loss
+     * @param positions Positions by original index; the ion's slot is set
+     * to NaN
+     */
+    void record_lost(size_t i, double t, arma::vec &positions);
+
+    /**
+     * Remove ions outside the trap (radius `r0`, half length `z0`) with
+     * stable in-place compaction and record them as lost.
+     * @param positions Positions of the last time step by original index;
+     * slots of removed ions are set to NaN
+     */
+    void remove_escaped_ions(arma::vec &positions);
+
+    /**
+     * Apply the scheduled events due at the current time and the stochastic
+     * reactions of one time step.
+     * @param positions Positions by original index; slots of removed ions
+     * are set to NaN
+     */
+    void apply_events(arma::vec &positions);
+
+    /// Append an applied event to `events.csv`.
+    void log_event(EventType type, size_t id, const Ion &ion);
+
+    /// Path of the checkpoint file written periodically during a run.
+    auto checkpoint_filename() const -> std::string;
+
     /**
      * Precomputes all Coulomb interactions between ions that way they can be
      * applied all at once when advancing a time step.
      *
-     * TODO: use Boost.compute
+     * @param forces Set to the force on each ion (reusing its memory)
+     * @param energies If not null, filled with the Coulomb energy of each ion
      */
-    const mat precompute_coulomb();
+    void precompute_coulomb(mat &forces, arma::vec *energies=nullptr);
 
 public:
     /// Simulation status
-    SimStatus status;
+    SimStatus status = SimStatus::IDLE;
 
     Simulation();
     Simulation(SimParams p, Trap trap);
     Simulation(SimParams p, Trap trap, std::vector<Ion> ions);
+    ~Simulation();
 
     /**
      * Return a copy of the parameters. This is useful for creating a modified
@@ -78,9 +252,11 @@ public:
      * @param m Ion mass in amu
      * @param Z Ion charge in units of e
      * @param x0 Initial position
+     * @param lasers Doppler cooling lasers affecting the ion
      */
     Ion make_ion(const double &m, const double &Z,
-                 const std::vector<double> &x0);
+                 const std::vector<double> &x0,
+                 const lasers_ptr &lasers=lasers_ptr());
 
     /**
      * Create an ion with the given initial position and zero velocity and add
@@ -91,15 +267,182 @@ public:
      */
     void add_ion(const double &m, const double &z, const std::vector<double> &x0);
 
+    /**
+     * Create many ions with zero velocity in one call.
+     * @param m Ion masses, one per ion or a single mass for all ions
+     * @param Z Ion charges in units of e, one per ion or a single charge for
+     * all ions
+     * @param x0 Initial positions with one column per ion
+     * @throws std::invalid_argument if the sizes don't match
+     * @throws std::runtime_error if the simulation is running
+     */
+    void add_ions(const std::vector<double> &m, const std::vector<double> &Z,
+                  const mat &x0);
+
+    /**
+     * Direct access to the ions, e.g., to set initial velocities. Ions are in
+     * the order they were added unless a run reordering ions is in progress.
+     * References stay valid until ions are added or replaced (`add_ion`,
+     * `add_ions`, `set_ions`, `restore`) or events and losses during a run
+     * change the ions (see `schedule_loading`); the first run
+     * after `add_ion` or `set_ions` may also move them once to NUMA-local
+     * memory.
+     */
+    auto get_ions() -> std::vector<Ion> &;
+
+    /// Ions removed during the current or last run.
+    auto get_lost_ions() const -> const std::vector<LostIon> &;
+
+    /**
+     * Schedule loading an ion during the next run. The ion gets the next
+     * original index (after all ions added or scheduled before) and its own
+     * slot in trajectory frames, which is NaN until it is loaded.
+     * @param t Time of loading
+     * @param m Ion mass
+     * @param Z Ion charge in units of e
+     * @param x0 Initial position
+     * @param v0 Initial velocity
+     * @param lasers Doppler cooling lasers affecting the ion
+     * @returns Original index of the ion
+     * @throws std::runtime_error if a run is in progress (frames can't grow)
+     * @throws std::invalid_argument for invalid vectors
+     */
+    auto schedule_loading(double t, double m, double Z,
+                          const std::vector<double> &x0,
+                          const std::vector<double> &v0={0, 0, 0},
+                          const lasers_ptr &lasers=lasers_ptr()) -> size_t;
+
+    /**
+     * Schedule removing an ion. Nothing happens if the ion is gone by then.
+     * @param t Time of removal
+     * @param id Original index of the ion
+     * @throws std::runtime_error while running
+     * @throws std::invalid_argument for unknown ions
+     */
+    void schedule_removal(double t, size_t id);
+
+    /**
+     * Schedule changing the species of an ion. Nothing happens if the ion is
+     * gone by then.
+     * @param t Time of the reaction
+     * @param id Original index of the ion
+     * @param m Mass of the product
+     * @param Z Charge of the product in units of e
+     * @param lasers Doppler cooling lasers affecting the product
+     * @throws std::runtime_error while running
+     * @throws std::invalid_argument for unknown ions
+     */
+    void schedule_reaction(double t, size_t id, double m, double Z,
+                           const lasers_ptr &lasers=lasers_ptr());
+
+    /**
+     * Add a stochastic reaction, which applies to all following time steps.
+     * @throws std::runtime_error while running
+     * @throws std::invalid_argument for negative rates
+     */
+    void add_reaction(const Reaction &reaction);
+
+    /// Remove all scheduled events and stochastic reactions.
+    void clear_events();
+
     /**
      * Set ions. This method will only set parameters when the simulation is not
-     * in progress.
+     * in progress. Scheduled events refer to the replaced ions and are
+     * cleared.
      */
     void set_ions(std::vector<Ion> ions);
 
+    /**
+     * Write the full simulation state (parameters, trap, ions, scheduled
+     * events, time step, RNG state and the state of observables, spectra and
+     * images) to a binary checkpoint file. The file is written atomically so
+     * an interrupted checkpoint never replaces a good one.
+     * @param filename
+     */
+    void checkpoint(const std::string &filename);
+
+    /**
+     * Restore the simulation state from a checkpoint file. The next call to
+     * `run` continues from the checkpointed time step, appending to the
+     * trajectory, observables and images written before the checkpoint. Parameters and trap may be
+     * changed after restoring to branch a new run from the saved state.
+     * @param filename
+     * @throws std::runtime_error if the simulation is running or the file is
+     * not a valid checkpoint. The next run fails if the output written before
+     * the checkpoint is missing.
+     */
+    void restore(const std::string &filename);
+
+    /**
+     * Return the in-memory ring of the most recent frames of the current or
+     * last run. This is safe to call while the simulation is running. Returns
+     * null when `SimParams::ring_size` is 0.
+     */
+    auto get_ring() const -> std::shared_ptr<const FrameRing>;
+
+    /**
+     * Return the phase timing of the current or last run. Totals are updated
+     * while running and are all zero unless built with `ENABLE_PROFILER`.
+     * After a run with output they are also written to profile.json.
+     */
+    auto get_profile() const -> const Profiler &;
+
+    /**
+     * Return hardware event counts of the last run by phase and event, or
+     * nothing if counters were not enabled or not available (see
+     * `SimParams::perf_counters`).
+     */
+    auto get_perf_counters() const -> std::map<std::string, std::map<std::string, double>>;
+
+    /**
+     * Compare the Coulomb forces of the mixed precision solver with double
+     * precision for the current ion positions. This is reported at the start
+     * of a run with `SimParams::coulomb_mixed_precision` and a verbosity > 0.
+     * @returns the largest relative error of the force on an ion
+     */
+    double mixed_precision_error();
+
+    /**
+     * Move the ions to a minimum of the trap, field map and Coulomb potential
+     * energy (see `minimize_energy`), e.g., to start a run from a cold crystal.
+     * Time and output are not affected.
+     * @param options
+     * @throws std::runtime_error if the simulation is running
+     * @throws std::invalid_argument for an unknown method
+     */
+    auto minimize(const MinimizeOptions &options=MinimizeOptions()) -> MinimizeResult;
+
+    /**
+     * Compute normal modes about the current ion positions (see
+     * `ionmd::normal_modes`). Mode vectors list ions in the order they were
+     * added.
+     * @param num_modes Number of lowest modes to compute or 0 for all
+     * @throws std::runtime_error if the simulation is running
+     */
+    auto normal_modes(unsigned int num_modes=0) -> NormalModes;
+
     /** Run the simulation. This is a blocking function. */
     void run();
 
+    /**
+     * Advance the simulation by `n` time steps from its current state. The
+     * first call opens output like `run` (starting at time step 0 if nothing
+     * was simulated yet, otherwise continuing); later calls append to it
+     * until `finish` is called. Parameters and the trap may be changed
+     * between calls. Ions are in their original order after every call.
+     * This is a blocking function.
+     * @param n Number of time steps
+     * @throws std::runtime_error if the simulation can't be started, writing
+     * output fails, or the simulation is already running
+     */
+    void step(unsigned int n=1);
+
+    /**
+     * Finish stepping with `step`: flush output and write the timing
+     * profile. Called automatically by `run`, `restore` and on destruction.
+     */
+    void finish();
+
     /** Starts the simulation in the background. */
     void start();
 };
@@ -0,0 +1,145 @@
+#ifndef SPECTRA_HPP
+#define SPECTRA_HPP
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <armadillo>
+#include "params.hpp"
+#include "ion.hpp"
+
+namespace ionmd {
+
+/**
+ * Accumulates power spectra of ion motion while the simulation runs, so that
+ * spectra don't have to be computed from stored trajectories. The spectra are
+ * written to `spectra.csv` in the output directory at the end of a run.
+ *
+ * Positions are sampled every `SimParams::spectrum_interval` time steps and
+ * averaged with Welch's method: blocks of `SimParams::spectrum_block`
+ * samples, overlapping by the fraction `SimParams::spectrum_overlap`, have
+ * their mean removed, are multiplied with a Hann window and Fourier
+ * transformed. Block power spectra are averaged as they complete, so only the
+ * last block of samples is kept in memory.
+ *
+ * Spectra (one-sided power spectral densities) are computed for
+ *
+ * - each axis in `SimParams::spectrum_axes` ("x", "y", "z"): the mean over
+ *   ions of the spectra of their displacements along the axis in m^2/Hz
+ * - the `SimParams::spectrum_modes` lowest normal modes of the crystal: the
+ *   spectra of the mass-weighted mode coordinates in kg m^2/Hz. Modes are
+ *   computed at the energy minimum found from the ion positions at the start
+ *   of the run (see `minimize_energy` and `normal_modes`).
+ *
+ * Ions that leave the trap during the run are held at their last position.
+ *
+ * The accumulated state is stored in checkpoints (see `save`), so a resumed
+ * run continues the spectra of the run it resumes.
+ */
+class Spectra
+{
+private:
+    params_ptr p;
+
+    /// Samples per block and samples between the starts of blocks
+    unsigned int block_size;
+    unsigned int hop;
+
+    /// Coordinates of the ions in the position vectors passed to `record`
+    std::vector<size_t> coordinates;
+
+    /// Last finite value of each coordinate
+    arma::vec held;
+
+    /// Coordinate (index into `held`) of each axis signal
+    std::vector<size_t> signal_sources;
+
+    /// Output column of each signal (axis signals followed by modes)
+    std::vector<size_t> signal_columns;
+
+    /// Normal mode vectors times the square root of the ion masses, which
+    /// project positions onto mode coordinates (one column per mode)
+    arma::mat mode_weights;
+
+    /// Angular frequencies of the normal modes
+    arma::vec mode_frequencies;
+
+    /// Output column names and number of signals averaged in each column
+    std::vector<std::string> names;
+    std::vector<unsigned int> signals_per_column;
+
+    /// Last `block_size` samples of every signal (one column per sample,
+    /// used as a ring)
+    arma::mat history;
+
+    /// Hann window and its sum of squares
+    arma::vec window;
+    double window_norm;
+
+    /// Sum of the power spectra of all blocks (one column per output column)
+    arma::mat power;
+
+    /// Number of samples and of complete blocks so far
+    size_t num_samples = 0;
+    size_t num_blocks = 0;
+
+    /// Add the power spectrum of the last block to `power`.
+    void add_block();
+
+    /// Check the block settings and compute the hop and window.
+    void setup_blocks();
+
+public:
+    /**
+     * @param params
+     * @param ions Ions in their original order
+     * @param slots Index of each ion in the position vectors passed to
+     * `record`
+     * @throws std::invalid_argument for unknown axes or invalid block
+     * settings
+     */
+    Spectra(params_ptr params, const std::vector<Ion> &ions,
+            const std::vector<size_t> &slots);
+
+    /**
+     * Continue accumulating spectra from a state written by `save`.
+     * @param params The parameters of the run that was saved
+     * @param state
+     * @throws std::runtime_error if the state doesn't match the parameters
+     */
+    Spectra(params_ptr params, std::istream &state);
+
+    /// Write the accumulated state.
+    void save(std::ostream &state) const;
+
+    /// Names of the spectra written (after the frequency column).
+    auto columns() const -> const std::vector<std::string> & { return names; }
+
+    /**
+     * Add a sample of all ion positions.
+     * @param positions Positions of all ions by slot (3 per ion, NaN for
+     * ions that left the trap)
+     */
+    void record(const arma::vec &positions);
+
+    /// Frequencies in Hz of the rows of `spectra`.
+    auto frequencies() const -> arma::vec;
+
+    /// Welch averaged spectra, one column per name in `columns`. Zero before
+    /// the first block is complete.
+    auto spectra() const -> arma::mat;
+
+    /// Number of blocks averaged.
+    size_t blocks() const { return num_blocks; }
+
+    /**
+     * Write the spectra to `spectra.csv` in the output directory.
+     * @throws std::runtime_error if the file can't be written
+     */
+    void write() const;
+};
+
+}  // namespace ionmd
+
+#endif
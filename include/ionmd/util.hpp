@@ -5,6 +5,8 @@
 #include <ctime>
 #include <string>
 #include <cmath>
+#include <sstream>
+#include <vector>
 #include <armadillo>
 
 using std::sqrt;
@@ -19,6 +21,22 @@ inline auto timestamp_str() -> std::string {
     return std::string(buff);
 };
 
+
+/**
+ * Join the elements of a vector into a string.
+ * @param values
+ * @param sep Separator between elements
+ */
+template <typename T>
+auto join(const std::vector<T> &values, const std::string &sep=", ") -> std::string
+{
+    std::stringstream stream;
+    for (size_t i = 0; i < values.size(); i++) {
+        stream << (i > 0 ? sep : "") << values[i];
+    }
+    return stream.str();
+}
+
 }  // namespace ionmd
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef VECTOR_OPS_HPP
+#define VECTOR_OPS_HPP
+
+#include <vector>
+#include <armadillo>
+
+namespace ionmd {
+
+// Operations on coordinate vectors (3 values per ion) of the minimizers and
+// normal modes, parallel over the elements
+
+/// Dot product of two coordinate vectors.
+inline double dot(const arma::vec &a, const arma::vec &b)
+{
+    double sum = 0;
+    #pragma omp parallel for reduction(+:sum)
+    for (arma::uword i = 0; i < a.n_elem; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+
+/// `y += alpha * x` for coordinate vectors.
+inline void axpy(double alpha, const arma::vec &x, arma::vec &y)
+{
+    #pragma omp parallel for
+    for (arma::uword i = 0; i < x.n_elem; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+
+/// Remove the components of `w` along the orthonormal `basis`.
+inline void orthogonalize(arma::vec &w, const std::vector<arma::vec> &basis)
+{
+    for (const auto &q: basis) {
+        axpy(-dot(q, w), q, w);
+    }
+}
+
+}  // namespace ionmd
+
+#endif
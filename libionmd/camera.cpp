@@ -0,0 +1,261 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <ionmd/camera.hpp>
+#include <ionmd/serialize.hpp>
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+
+
+/// PSF tails beyond this many standard deviations are cut off.
+static constexpr double psf_cutoff = 4;
+
+
+/// Unit vector along a 3 component parameter.
+static void unit_vector(const std::vector<double> &v, const std::string &name,
+                        double *result)
+{
+    if (v.size() != 3) {
+        throw std::invalid_argument(name + " must have 3 components");
+    }
+    const double norm = std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    if (norm == 0) {
+        throw std::invalid_argument(name + " must not be zero");
+    }
+    for (unsigned int j = 0; j < 3; j++) {
+        result[j] = v[j] / norm;
+    }
+}
+
+
+/**
+ * Fraction of a unit Gaussian centered at `x` (in pixels) that falls into
+ * each pixel from `first` to `last`.
+ */
+static void pixel_fractions(double x, double sigma, int first, int last,
+                            std::vector<double> &fractions)
+{
+    fractions.resize(last - first + 1);
+    const double scale = 1 / (std::sqrt(2.0) * sigma);
+    double lower = std::erf((first - x) * scale);
+    for (int i = first; i <= last; i++)
+    {
+        const double upper = std::erf((i + 1 - x) * scale);
+        fractions[i - first] = 0.5 * (upper - lower);
+        lower = upper;
+    }
+}
+
+
+/// Relative photon scattering rate of an ion: the force of its lasers along
+/// their beams in the Doppler damping model.
+static double scattering_rate(const Ion &ion)
+{
+    double rate = 0;
+    for (const auto &laser: ion.get_lasers())
+    {
+        const double k = arma::norm(laser->wave_vector);
+        double k_dot_v = 0;
+        for (unsigned int j = 0; j < 3; j++) {
+            k_dot_v += laser->wave_vector[j] * ion.v[j];
+        }
+        rate += std::max(0.0, laser->F0 * k - laser->beta * k_dot_v / k);
+    }
+    return rate;
+}
+
+
+Camera::Camera(params_ptr params, std::istream *state)
+    : p(params)
+{
+    if (p->image_size.size() != 2 || p->image_size[0] == 0 || p->image_size[1] == 0) {
+        throw std::invalid_argument("image_size must be 2 positive numbers of pixels");
+    }
+    if (!(p->image_pixel_size > 0)) {
+        throw std::invalid_argument("image_pixel_size must be positive");
+    }
+    if (!(p->image_psf_sigma >= 0)) {
+        throw std::invalid_argument("image_psf_sigma must not be negative");
+    }
+    if (p->image_center.size() != 3) {
+        throw std::invalid_argument("image_center must have 3 components");
+    }
+
+    width = p->image_size[0];
+    height = p->image_size[1];
+    sigma = p->image_psf_sigma / p->image_pixel_size;
+    unit_vector(p->image_horizontal, "image_horizontal", horizontal);
+    unit_vector(p->image_vertical, "image_vertical", vertical);
+
+    // Pixel coordinates are measured from the corner of the image
+    center[0] = 0.5 * width;
+    center[1] = 0.5 * height;
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        horizontal[j] /= p->image_pixel_size;
+        vertical[j] /= p->image_pixel_size;
+        center[0] -= horizontal[j] * p->image_center[j];
+        center[1] -= vertical[j] * p->image_center[j];
+    }
+
+#ifdef _OPENMP
+    const int num_threads = omp_get_max_threads();
+#else
+    const int num_threads = 1;
+#endif
+    thread_images.resize(num_threads);
+
+    // Each thread touches its own image first
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef _OPENMP
+        thread_images[omp_get_thread_num()].assign(width * height, 0.0);
+#else
+        thread_images[0].assign(width * height, 0.0);
+#endif
+    }
+
+    fs::path filename = p->path;
+    filename /= "images.bin";
+    if (state == nullptr)
+    {
+        out.open(filename.c_str(), std::ios::out | std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Unable to open " + filename.string());
+        }
+        out << width << "\n" << height << "\n" << p->image_exposure << "\n";
+        return;
+    }
+
+    // The saved image goes to the first thread's image; images written after
+    // the checkpoint are discarded
+    uint64_t offset;
+    std::vector<double> saved;
+    serialize::get(*state, offset);
+    serialize::get(*state, samples);
+    serialize::get(*state, saved);
+    if (saved.size() != thread_images[0].size()) {
+        throw std::runtime_error("Camera image in checkpoint doesn't match image_size");
+    }
+    thread_images[0] = saved;
+    if (!fs::exists(filename) || fs::file_size(filename) < offset) {
+        throw std::runtime_error(filename.string() + " is shorter than at the checkpoint");
+    }
+    fs::resize_file(filename, offset);
+    out.open(filename.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    if (!out) {
+        throw std::runtime_error("Unable to open " + filename.string());
+    }
+}
+
+
+void Camera::record(const std::vector<Ion> &ions)
+{
+    const double exposure = p->image_interval * p->dt;
+    const int num_ions = ions.size();
+
+    #pragma omp parallel num_threads(thread_images.size())
+    {
+#ifdef _OPENMP
+        auto &image = thread_images[omp_get_thread_num()];
+#else
+        auto &image = thread_images[0];
+#endif
+        std::vector<double> columns, rows;
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < num_ions; i++)
+        {
+            const auto &ion = ions[i];
+            const double weight = p->image_scattering ? exposure * scattering_rate(ion) : exposure;
+            if (weight == 0) {
+                continue;
+            }
+            const double u = center[0] + horizontal[0]*ion.x[0] + horizontal[1]*ion.x[1] + horizontal[2]*ion.x[2];
+            const double v = center[1] + vertical[0]*ion.x[0] + vertical[1]*ion.x[1] + vertical[2]*ion.x[2];
+
+            // Skip ions whose PSF misses the image (before converting to
+            // pixel indices)
+            const double reach = psf_cutoff * sigma;
+            if (!(u + reach >= 0 && u - reach < width && v + reach >= 0 && v - reach < height)) {
+                continue;
+            }
+
+            if (sigma == 0)
+            {
+                image[int(v) * width + int(u)] += weight;
+                continue;
+            }
+
+            const int first_column = std::max(0.0, std::floor(u - reach));
+            const int last_column = std::min(width - 1.0, std::floor(u + reach));
+            const int first_row = std::max(0.0, std::floor(v - reach));
+            const int last_row = std::min(height - 1.0, std::floor(v + reach));
+
+            // The PSF is separable
+            pixel_fractions(u, sigma, first_column, last_column, columns);
+            pixel_fractions(v, sigma, first_row, last_row, rows);
+            for (int row = first_row; row <= last_row; row++)
+            {
+                double *pixels = &image[row * width];
+                const double row_weight = weight * rows[row - first_row];
+                for (int column = first_column; column <= last_column; column++) {
+                    pixels[column] += row_weight * columns[column - first_column];
+                }
+            }
+        }
+    }
+    samples++;
+}
+
+
+auto Camera::image() const -> std::vector<double>
+{
+    std::vector<double> sum(width * height, 0.0);
+    const int num_pixels = sum.size();
+
+    #pragma omp parallel for schedule(static)
+    for (int pixel = 0; pixel < num_pixels; pixel++)
+    {
+        for (const auto &image: thread_images) {
+            sum[pixel] += image[pixel];
+        }
+    }
+    return sum;
+}
+
+
+void Camera::save(std::ostream &state)
+{
+    out.flush();
+    out.seekp(0, std::ios::end);
+    if (!out) {
+        throw std::runtime_error("Error writing images");
+    }
+    serialize::put<uint64_t>(state, out.tellp());
+    serialize::put(state, samples);
+    serialize::put(state, image());
+}
+
+
+void Camera::write()
+{
+    const auto sum = image();
+    out.write(reinterpret_cast<const char *>(sum.data()), sum.size() * sizeof(double));
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Error writing images");
+    }
+
+    for (auto &image: thread_images) {
+        std::fill(image.begin(), image.end(), 0.0);
+    }
+    samples = 0;
+}
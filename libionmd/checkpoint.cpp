@@ -0,0 +1,455 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <map>
+#include <boost/filesystem.hpp>
+
+#include <ionmd/simulation.hpp>
+#include <ionmd/serialize.hpp>
+
+namespace ionmd {
+
+namespace fs = boost::filesystem;
+
+/// Magic bytes at the start of checkpoint files.
+static const char checkpoint_magic[8] = {'I', 'O', 'N', 'M', 'D', 'C', 'K', 'P'};
+
+/// Checkpoint format version. Increment when the layout changes.
+static constexpr uint32_t checkpoint_version = 10;
+
+
+namespace {
+
+using serialize::put;
+using serialize::get;
+
+
+/// Read or write every field of `SimParams`.
+template <typename Stream, typename Op>
+void visit_params(Stream &stream, SimParams &p, Op op)
+{
+    op(stream, p.dt);
+    op(stream, p.num_steps);
+    op(stream, p.verbosity);
+    op(stream, p.secular_enabled);
+    op(stream, p.micromotion_enabled);
+    op(stream, p.coulomb_enabled);
+    op(stream, p.stochastic_enabled);
+    op(stream, p.doppler_enabled);
+    op(stream, p.check_bounds);
+    op(stream, p.field_maps);
+    op(stream, p.field_dc);
+    op(stream, p.field_rf);
+    op(stream, p.path);
+    op(stream, p.buffer_size);
+    op(stream, p.compress_trajectories);
+    op(stream, p.trajectory_precision);
+    op(stream, p.checkpoint_interval);
+    op(stream, p.seed);
+    op(stream, p.write_output);
+    op(stream, p.ring_size);
+    op(stream, p.ring_decimation);
+    op(stream, p.observables_interval);
+    op(stream, p.observables);
+    op(stream, p.structure_factor_k);
+    op(stream, p.spectrum_interval);
+    op(stream, p.spectrum_block);
+    op(stream, p.spectrum_overlap);
+    op(stream, p.spectrum_axes);
+    op(stream, p.spectrum_modes);
+    op(stream, p.image_interval);
+    op(stream, p.image_exposure);
+    op(stream, p.image_size);
+    op(stream, p.image_pixel_size);
+    op(stream, p.image_center);
+    op(stream, p.image_horizontal);
+    op(stream, p.image_vertical);
+    op(stream, p.image_psf_sigma);
+    op(stream, p.image_scattering);
+    op(stream, p.coulomb_tile_i);
+    op(stream, p.coulomb_tile_j);
+    op(stream, p.coulomb_mixed_precision);
+    op(stream, p.reorder_interval);
+    op(stream, p.reorder_curve);
+    op(stream, p.perf_counters);
+    op(stream, p.perf_events);
+    op(stream, p.thread_affinity);
+    op(stream, p.numa_first_touch);
+}
+
+
+/// Read or write every field of `Trap`.
+template <typename Stream, typename Op>
+void visit_trap(Stream &stream, Trap &trap, Op op)
+{
+    op(stream, trap.r0);
+    op(stream, trap.z0);
+    op(stream, trap.kappa);
+    op(stream, trap.omega_rf);
+    op(stream, trap.V_rf);
+    op(stream, trap.U_dc);
+    op(stream, trap.U_ec);
+}
+
+
+struct Writer {
+    template <typename T>
+    void operator()(std::ostream &out, const T &value) const { put(out, value); }
+};
+
+
+struct Reader {
+    template <typename T>
+    void operator()(std::istream &in, T &value) const { get(in, value); }
+};
+
+}  // namespace
+
+
+auto Simulation::checkpoint_filename() const -> std::string
+{
+    fs::path filename = p->path;
+    filename /= "checkpoint.bin";
+    return filename.string();
+}
+
+
+void Simulation::checkpoint(const std::string &filename)
+{
+    const std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename, std::ios::out | std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Unable to write checkpoint " + tmp_filename);
+    }
+
+    out.write(checkpoint_magic, sizeof(checkpoint_magic));
+    put(out, checkpoint_version);
+
+    visit_params(out, *p, Writer());
+    visit_trap(out, *trap, Writer());
+
+    // While stepping, the trajectory written so far belongs to the checkpoint
+    if (status != SimStatus::RUNNING) {
+        traj_offset = trajectory_offset();
+    }
+    put(out, next_step);
+    put(out, t);
+    put(out, traj_offset);
+
+    std::stringstream rng_state;
+    rng_state << rng;
+    put(out, rng_state.str());
+
+    // Lasers are shared between ions, so store each one once and refer to it
+    // by index.
+    std::vector<laser_ptr> lasers;
+    std::map<const Laser *, uint64_t> laser_index;
+    const auto index_lasers = [&](const lasers_ptr &ion_lasers)
+    {
+        for (const auto &laser: ion_lasers)
+        {
+            if (laser_index.count(laser.get()) == 0) {
+                laser_index[laser.get()] = lasers.size();
+                lasers.push_back(laser);
+            }
+        }
+    };
+    const auto put_lasers = [&](const lasers_ptr &ion_lasers)
+    {
+        put<uint64_t>(out, ion_lasers.size());
+        for (const auto &laser: ion_lasers) {
+            put(out, laser_index[laser.get()]);
+        }
+    };
+    for (const auto &ion: ions) {
+        index_lasers(ion.get_lasers());
+    }
+    for (const auto &entry: events) {
+        index_lasers(entry.second.lasers);
+    }
+    for (const auto &reaction: reactions) {
+        index_lasers(reaction.product_lasers);
+    }
+
+    put<uint64_t>(out, lasers.size());
+    for (const auto &laser: lasers)
+    {
+        put(out, laser->detuning);
+        put(out, laser->beta);
+        put(out, laser->F0);
+        put(out, laser->wave_vector);
+    }
+
+    put<uint64_t>(out, ions.size());
+    for (const auto &ion: ions)
+    {
+        put(out, ion.m);
+        put(out, ion.Z);
+        put(out, ion.x);
+        put(out, ion.v);
+        put(out, ion.a);
+        put_lasers(ion.get_lasers());
+    }
+    put(out, ion_ids);
+    put<uint64_t>(out, ion_slots);
+
+    put<uint64_t>(out, lost_ions.size());
+    for (const auto &ion: lost_ions)
+    {
+        put<uint64_t>(out, ion.id);
+        put(out, ion.step);
+        put(out, ion.t);
+        put(out, ion.m);
+        put(out, ion.Z);
+        put(out, ion.x);
+        put(out, ion.v);
+    }
+
+    put<uint64_t>(out, events.size());
+    for (const auto &entry: events)
+    {
+        const auto &event = entry.second;
+        put(out, static_cast<uint32_t>(event.type));
+        put(out, event.t);
+        put<uint64_t>(out, event.id);
+        put(out, event.m);
+        put(out, event.Z);
+        put(out, event.x);
+        put(out, event.v);
+        put_lasers(event.lasers);
+    }
+
+    put<uint64_t>(out, reactions.size());
+    for (const auto &reaction: reactions)
+    {
+        put(out, reaction.m);
+        put(out, reaction.Z);
+        put(out, reaction.product_m);
+        put(out, reaction.product_Z);
+        put(out, reaction.rate);
+        put_lasers(reaction.product_lasers);
+    }
+
+    put(out, run_state ? save_accumulators(*run_state) : accumulators);
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Error writing checkpoint " + tmp_filename);
+    }
+    fs::rename(tmp_filename, filename);
+}
+
+
+void Simulation::restore(const std::string &filename)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't restore a checkpoint while running");
+    }
+    finish();
+
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Unable to open checkpoint " + filename);
+    }
+
+    char magic[sizeof(checkpoint_magic)];
+    uint32_t version;
+    in.read(magic, sizeof(magic));
+    get(in, version);
+    if (std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0
+        || version != checkpoint_version)
+    {
+        throw std::runtime_error(filename + " is not a supported checkpoint");
+    }
+
+    // Read everything before touching the simulation state so a bad file
+    // leaves the simulation unchanged.
+    SimParams new_params;
+    Trap new_trap;
+    visit_params(in, new_params, Reader());
+    visit_trap(in, new_trap, Reader());
+
+    unsigned int new_step;
+    double new_t;
+    uint64_t new_traj_offset;
+    std::string rng_state;
+    get(in, new_step);
+    get(in, new_t);
+    get(in, new_traj_offset);
+    get(in, rng_state);
+
+    uint64_t num_lasers;
+    get(in, num_lasers);
+    std::vector<laser_ptr> lasers;
+    for (uint64_t i = 0; i < num_lasers; i++)
+    {
+        double detuning, beta, F0;
+        arma::vec wave_vector;
+        get(in, detuning);
+        get(in, beta);
+        get(in, F0);
+        get(in, wave_vector);
+
+        auto laser = std::make_shared<Laser>(beta, F0, wave_vector);
+        laser->detuning = detuning;
+        laser->wave_vector = wave_vector;  // keep the magnitude exactly
+        lasers.push_back(laser);
+    }
+
+    const auto get_lasers = [&](lasers_ptr &ion_lasers)
+    {
+        uint64_t num_ion_lasers;
+        get(in, num_ion_lasers);
+        for (uint64_t j = 0; j < num_ion_lasers; j++)
+        {
+            uint64_t index;
+            get(in, index);
+            if (index >= lasers.size()) {
+                throw std::runtime_error("Invalid laser index in checkpoint");
+            }
+            ion_lasers.push_back(lasers[index]);
+        }
+    };
+
+    uint64_t num_ions;
+    get(in, num_ions);
+    std::vector<Ion> new_ions;
+    for (uint64_t i = 0; i < num_ions; i++)
+    {
+        double m, Z;
+        arma::vec x, v, a;
+        get(in, m);
+        get(in, Z);
+        get(in, x);
+        get(in, v);
+        get(in, a);
+        lasers_ptr ion_lasers;
+        get_lasers(ion_lasers);
+
+        Ion ion(p, trap, ion_lasers, m, Z, x);
+        ion.v = v;
+        ion.a = a;
+        new_ions.push_back(ion);
+    }
+
+    // Ids are slots in trajectory frames, which include lost ions
+    std::vector<size_t> new_ids;
+    uint64_t new_slots, num_lost;
+    get(in, new_ids);
+    get(in, new_slots);
+    get(in, num_lost);
+    std::vector<LostIon> new_lost(num_lost);
+    for (auto &ion: new_lost)
+    {
+        uint64_t id;
+        get(in, id);
+        ion.id = id;
+        get(in, ion.step);
+        get(in, ion.t);
+        get(in, ion.m);
+        get(in, ion.Z);
+        get(in, ion.x);
+        get(in, ion.v);
+    }
+
+    uint64_t num_events;
+    get(in, num_events);
+    std::multimap<double, Event> new_events;
+    std::vector<size_t> load_ids;
+    bool valid_events = true;
+    for (uint64_t k = 0; k < num_events; k++)
+    {
+        Event event;
+        uint32_t type;
+        uint64_t id;
+        get(in, type);
+        get(in, event.t);
+        get(in, id);
+        get(in, event.m);
+        get(in, event.Z);
+        get(in, event.x);
+        get(in, event.v);
+        get_lasers(event.lasers);
+
+        event.type = static_cast<EventType>(type);
+        event.id = id;
+        valid_events = valid_events && type <= static_cast<uint32_t>(EventType::REACT)
+            && id < new_slots;
+        if (event.type == EventType::LOAD)
+        {
+            valid_events = valid_events && event.x.n_elem == 3 && event.v.n_elem == 3;
+            load_ids.push_back(id);
+        }
+        new_events.emplace(event.t, event);
+    }
+
+    uint64_t num_reactions;
+    get(in, num_reactions);
+    std::vector<Reaction> new_reactions(num_reactions);
+    for (auto &reaction: new_reactions)
+    {
+        get(in, reaction.m);
+        get(in, reaction.Z);
+        get(in, reaction.product_m);
+        get(in, reaction.product_Z);
+        get(in, reaction.rate);
+        get_lasers(reaction.product_lasers);
+    }
+
+    std::string new_accumulators;
+    get(in, new_accumulators);
+
+    // Every slot belongs to exactly one present, lost or pending ion
+    std::vector<bool> seen(new_slots, false);
+    bool valid = valid_events && new_ids.size() == num_ions
+        && num_ions + num_lost + load_ids.size() == new_slots;
+    for (const auto id: new_ids)
+    {
+        valid = valid && id < new_slots && !seen[id];
+        if (valid) {
+            seen[id] = true;
+        }
+    }
+    for (const auto &ion: new_lost)
+    {
+        valid = valid && ion.id < new_slots && !seen[ion.id]
+            && ion.x.n_elem == 3 && ion.v.n_elem == 3;
+        if (valid) {
+            seen[ion.id] = true;
+        }
+    }
+    for (const auto id: load_ids)
+    {
+        valid = valid && !seen[id];
+        if (valid) {
+            seen[id] = true;
+        }
+    }
+    if (!valid) {
+        throw std::runtime_error("Invalid ion order in checkpoint");
+    }
+
+    // Ions refer to the simulation's params and trap, which are updated in
+    // place.
+    set_params(new_params);
+    set_trap(new_trap);
+
+    std::stringstream rng_stream(rng_state);
+    rng_stream >> rng;
+    ions = std::move(new_ions);
+    ions_placed = false;
+    ion_ids = std::move(new_ids);
+    ion_slots = new_slots;
+    lost_ions = std::move(new_lost);
+    events = std::move(new_events);
+    reactions = std::move(new_reactions);
+    accumulators = std::move(new_accumulators);
+    next_step = new_step;
+    t = new_t;
+    traj_offset = new_traj_offset;
+    resuming = true;
+    status = SimStatus::IDLE;
+}
+
+}  // namespace ionmd
@@ -0,0 +1,133 @@
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <ionmd/codec.hpp>
+
+using namespace ionmd;
+
+/// Largest quantized magnitude allowed so that predictions (including of
+/// `codec::missing` values) can't overflow.
+static constexpr double max_quantized = 1e18;
+
+
+uint64_t codec::get_varint(const uint8_t *&pos, const uint8_t *end)
+{
+    uint64_t value = 0;
+
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        if (pos == end) {
+            throw std::runtime_error("Truncated trajectory frame");
+        }
+        const uint8_t byte = *pos++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+
+    throw std::runtime_error("Malformed integer in trajectory frame");
+}
+
+
+TrajectoryEncoder::TrajectoryEncoder(size_t num_values, double precision,
+                                     unsigned int keyframe_interval)
+    : num_values(num_values), precision(precision),
+      keyframe_interval(keyframe_interval > 0 ? keyframe_interval : 1),
+      since_keyframe(this->keyframe_interval),
+      prev(num_values), prev2(num_values)
+{
+    if (!(precision > 0)) {
+        throw std::invalid_argument("Trajectory precision must be positive");
+    }
+}
+
+
+void TrajectoryEncoder::encode(const double *frame, std::vector<uint8_t> &out)
+{
+    codec::FrameKind kind;
+    if (since_keyframe >= keyframe_interval) {
+        kind = codec::KEYFRAME;
+        since_keyframe = 0;
+    }
+    else if (since_keyframe == 1) {
+        kind = codec::DELTA;
+    }
+    else {
+        kind = codec::LINEAR;
+    }
+    since_keyframe++;
+
+    out.push_back(kind);
+
+    for (size_t i = 0; i < num_values; i++)
+    {
+        const double scaled = frame[i] / precision;
+        int64_t q = codec::missing;
+        if (!std::isnan(scaled))
+        {
+            if (!std::isfinite(scaled) || std::abs(scaled) > max_quantized) {
+                throw std::range_error("Trajectory value can't be quantized");
+            }
+            q = std::llround(scaled);
+        }
+
+        int64_t predicted = 0;
+        if (kind == codec::DELTA) {
+            predicted = prev[i];
+        }
+        else if (kind == codec::LINEAR) {
+            predicted = 2*prev[i] - prev2[i];
+        }
+
+        codec::put_varint(codec::zigzag(q - predicted), out);
+        prev2[i] = prev[i];
+        prev[i] = q;
+    }
+}
+
+
+TrajectoryDecoder::TrajectoryDecoder(size_t num_values, double precision)
+    : num_values(num_values), precision(precision),
+      prev(num_values), prev2(num_values), have_prev(false)
+{
+}
+
+
+void TrajectoryDecoder::decode(const uint8_t *data, size_t size, double *frame)
+{
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+
+    if (pos == end) {
+        throw std::runtime_error("Empty trajectory frame");
+    }
+    const uint8_t kind = *pos++;
+    if (kind > codec::LINEAR) {
+        throw std::runtime_error("Unknown trajectory frame kind");
+    }
+    if (kind != codec::KEYFRAME && !have_prev) {
+        throw std::runtime_error("Trajectory does not start with a keyframe");
+    }
+
+    for (size_t i = 0; i < num_values; i++)
+    {
+        int64_t predicted = 0;
+        if (kind == codec::DELTA) {
+            predicted = prev[i];
+        }
+        else if (kind == codec::LINEAR) {
+            predicted = 2*prev[i] - prev2[i];
+        }
+
+        const int64_t q = predicted + codec::unzigzag(codec::get_varint(pos, end));
+        frame[i] = q == codec::missing ? std::numeric_limits<double>::quiet_NaN() : q * precision;
+        prev2[i] = prev[i];
+        prev[i] = q;
+    }
+
+    if (pos != end) {
+        throw std::runtime_error("Trailing data in trajectory frame");
+    }
+    have_prev = true;
+}
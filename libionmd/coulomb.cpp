@@ -0,0 +1,354 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <ionmd/coulomb.hpp>
+#include <ionmd/constants.hpp>
+#include <ionmd/numa.hpp>
+
+using namespace ionmd;
+
+
+namespace {
+
+/// Size in bytes of a cache level reported by sysconf, or a fallback.
+size_t cache_size(int name, size_t fallback)
+{
+    const long size = sysconf(name);
+    return size > 0 ? size_t(size) : fallback;
+}
+
+
+/**
+ * Accumulate the field of the source ions [j0, j1) at the ions [i0, i1).
+ * Forces are accumulated without the factor OOFPEN*q_i.
+ */
+template <bool with_energy>
+void tile(const double *x, const double *y, const double *z, const double *q,
+          size_t i0, size_t i1, size_t j0, size_t j1,
+          double *Fx, double *Fy, double *Fz, double *phi)
+{
+    for (size_t i = i0; i < i1; i++)
+    {
+        const double xi = x[i], yi = y[i], zi = z[i];
+        double fx = 0, fy = 0, fz = 0, pi = 0;
+
+        #pragma omp simd reduction(+:fx,fy,fz,pi)
+        for (size_t j = j0; j < j1; j++)
+        {
+            const double dx = xi - x[j];
+            const double dy = yi - y[j];
+            const double dz = zi - z[j];
+            // The ion itself (dx = dy = dz = 0) is masked out rather than
+            // skipped so the loop has no branches and stays vectorized.
+            const double self = j == i ? 1 : 0;
+            const double r2 = dx*dx + dy*dy + dz*dz + self;
+            const double inv_r = 1 / std::sqrt(r2);
+            const double qr = (1 - self) * q[j] * inv_r;
+            const double f = qr * inv_r * inv_r;
+
+            fx += f * dx;
+            fy += f * dy;
+            fz += f * dz;
+            if (with_energy) {
+                pi += qr;
+            }
+        }
+
+        Fx[i - i0] += fx;
+        Fy[i - i0] += fy;
+        Fz[i - i0] += fz;
+        if (with_energy) {
+            phi[i - i0] += pi;
+        }
+    }
+}
+
+
+/**
+ * Single precision version of `tile` for coordinates relative to a common
+ * origin. Twice as many pairs fit in a vector register; partial sums over a
+ * tile are accumulated in double.
+ */
+template <bool with_energy>
+void tile_mixed(const float *xi_, const float *yi_, const float *zi_,
+                const float *x, const float *y, const float *z, const float *q,
+                size_t i0, size_t i1, size_t j0, size_t j1,
+                double *Fx, double *Fy, double *Fz, double *phi)
+{
+    for (size_t i = i0; i < i1; i++)
+    {
+        const float xi = xi_[i - i0], yi = yi_[i - i0], zi = zi_[i - i0];
+        float fx = 0, fy = 0, fz = 0, pi = 0;
+
+        #pragma omp simd reduction(+:fx,fy,fz,pi)
+        for (size_t j = j0; j < j1; j++)
+        {
+            const float dx = xi - x[j - j0];
+            const float dy = yi - y[j - j0];
+            const float dz = zi - z[j - j0];
+            const float self = j == i ? 1 : 0;
+            const float r2 = dx*dx + dy*dy + dz*dz + self;
+            const float inv_r = 1 / std::sqrt(r2);
+            const float qr = (1 - self) * q[j - j0] * inv_r;
+            const float f = qr * inv_r * inv_r;
+
+            fx += f * dx;
+            fy += f * dy;
+            fz += f * dz;
+            if (with_energy) {
+                pi += qr;
+            }
+        }
+
+        Fx[i - i0] += fx;
+        Fy[i - i0] += fy;
+        Fz[i - i0] += fz;
+        if (with_energy) {
+            phi[i - i0] += pi;
+        }
+    }
+}
+
+}  // namespace
+
+
+CoulombSolver::CoulombSolver(size_t tile_i, size_t tile_j, bool mixed)
+    : tile_i(tile_i), tile_j(tile_j), mixed(mixed)
+{}
+
+
+void CoulombSolver::set_tile_sizes(size_t tile_i, size_t tile_j)
+{
+    this->tile_i = tile_i;
+    this->tile_j = tile_j;
+}
+
+
+auto CoulombSolver::tile_sizes(size_t num_ions) const -> std::pair<size_t, size_t>
+{
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+    static const size_t l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32*1024);
+    static const size_t l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 256*1024);
+#else
+    static const size_t l1 = 32*1024;
+    static const size_t l2 = 256*1024;
+#endif
+
+    // Use half of each cache, leaving room for the other operands. A j-tile
+    // holds positions and charges, an i-block additionally its accumulators.
+    size_t bj = tile_j > 0 ? tile_j : l1 / 2 / (4 * sizeof(double));
+    size_t bi = tile_i;
+    if (bi == 0)
+    {
+        bi = l2 / 2 / (8 * sizeof(double));
+
+        // Enough blocks for dynamic scheduling to balance the threads
+#ifdef _OPENMP
+        const size_t threads = omp_get_max_threads();
+#else
+        const size_t threads = 1;
+#endif
+        const size_t balanced = (num_ions + 4*threads - 1) / (4*threads);
+        bi = std::max<size_t>(std::min(bi, balanced), 16);
+    }
+
+    return {std::max<size_t>(bi, 1), std::max<size_t>(bj, 1)};
+}
+
+
+/**
+ * Resize a source array, spreading newly allocated memory over the NUMA nodes
+ * of the threads so that no single node serves all j-tiles. Capacity grows
+ * geometrically, so ions loaded one at a time cost amortized O(1).
+ */
+static void resize_spread(std::vector<double> &v, size_t n)
+{
+    if (n > v.capacity())
+    {
+        const size_t capacity = std::max(n, v.capacity() + v.capacity() / 2);
+        std::vector<double>().swap(v);
+        v.reserve(capacity);
+        first_touch(v.data(), capacity, sizeof(double));
+    }
+    v.resize(n);
+}
+
+
+void CoulombSolver::set_ions(const std::vector<Ion> &ions)
+{
+    const size_t n = ions.size();
+    resize_spread(x, n);
+    resize_spread(y, n);
+    resize_spread(z, n);
+    resize_spread(q, n);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = ions[i].x[0];
+        y[i] = ions[i].x[1];
+        z[i] = ions[i].x[2];
+        q[i] = ions[i].Z * constants::q_e;
+    }
+}
+
+
+void CoulombSolver::set_ions(const arma::vec &positions,
+                             const std::vector<double> &charges)
+{
+    const size_t n = charges.size();
+    if (positions.n_elem != 3*n) {
+        throw std::invalid_argument("Need 3 position values per charge");
+    }
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    q = charges;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = positions[3*i];
+        y[i] = positions[3*i + 1];
+        z[i] = positions[3*i + 2];
+    }
+}
+
+
+void CoulombSolver::compute(arma::mat &forces, arma::vec *energies,
+                            size_t first, size_t count) const
+{
+    const size_t n = size();
+    first = std::min(first, n);
+    count = std::min(count, n - first);
+
+    forces.set_size(3, count);
+    if (energies != nullptr) {
+        energies->set_size(count);
+    }
+
+    const auto tiles = tile_sizes(count);
+    const size_t bi = tiles.first;
+    const size_t bj = tiles.second;
+    const size_t num_blocks = (count + bi - 1) / bi;
+
+    #pragma omp parallel
+    {
+        std::vector<double> Fx(bi), Fy(bi), Fz(bi), phi(bi);
+
+        // Relative coordinates of the i-block and a j-tile for mixed precision
+        std::vector<float> xi, yi, zi, xj, yj, zj, qj;
+        if (mixed)
+        {
+            for (auto *v: {&xi, &yi, &zi}) {
+                v->resize(bi);
+            }
+            for (auto *v: {&xj, &yj, &zj, &qj}) {
+                v->resize(bj);
+            }
+        }
+
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            const size_t i0 = first + b*bi;
+            const size_t i1 = std::min(i0 + bi, first + count);
+            std::fill(Fx.begin(), Fx.end(), 0.0);
+            std::fill(Fy.begin(), Fy.end(), 0.0);
+            std::fill(Fz.begin(), Fz.end(), 0.0);
+            std::fill(phi.begin(), phi.end(), 0.0);
+
+            // Origin for relative coordinates, close to all ions of the block
+            const double x0 = x[i0], y0 = y[i0], z0 = z[i0];
+            if (mixed)
+            {
+                for (size_t i = i0; i < i1; i++)
+                {
+                    xi[i - i0] = float(x[i] - x0);
+                    yi[i - i0] = float(y[i] - y0);
+                    zi[i - i0] = float(z[i] - z0);
+                }
+            }
+
+            for (size_t j0 = 0; j0 < n; j0 += bj)
+            {
+                const size_t j1 = std::min(j0 + bj, n);
+                if (mixed)
+                {
+                    for (size_t j = j0; j < j1; j++)
+                    {
+                        xj[j - j0] = float(x[j] - x0);
+                        yj[j - j0] = float(y[j] - y0);
+                        zj[j - j0] = float(z[j] - z0);
+                        qj[j - j0] = float(q[j]);
+                    }
+
+                    if (energies != nullptr) {
+                        tile_mixed<true>(xi.data(), yi.data(), zi.data(),
+                                         xj.data(), yj.data(), zj.data(), qj.data(),
+                                         i0, i1, j0, j1,
+                                         Fx.data(), Fy.data(), Fz.data(), phi.data());
+                    }
+                    else {
+                        tile_mixed<false>(xi.data(), yi.data(), zi.data(),
+                                          xj.data(), yj.data(), zj.data(), qj.data(),
+                                          i0, i1, j0, j1,
+                                          Fx.data(), Fy.data(), Fz.data(), phi.data());
+                    }
+                }
+                else if (energies != nullptr) {
+                    tile<true>(x.data(), y.data(), z.data(), q.data(), i0, i1, j0, j1,
+                               Fx.data(), Fy.data(), Fz.data(), phi.data());
+                }
+                else {
+                    tile<false>(x.data(), y.data(), z.data(), q.data(), i0, i1, j0, j1,
+                                Fx.data(), Fy.data(), Fz.data(), phi.data());
+                }
+            }
+
+            for (size_t i = i0; i < i1; i++)
+            {
+                const double k = constants::OOFPEN * q[i];
+                forces(0, i - first) = k * Fx[i - i0];
+                forces(1, i - first) = k * Fy[i - i0];
+                forces(2, i - first) = k * Fz[i - i0];
+                if (energies != nullptr) {
+                    (*energies)[i - first] = k * phi[i - i0];
+                }
+            }
+        }
+    }
+}
+
+
+double CoulombSolver::mixed_precision_error(size_t first, size_t count) const
+{
+    CoulombSolver reference(*this);
+    CoulombSolver mixed(*this);
+    reference.mixed = false;
+    mixed.mixed = true;
+
+    arma::mat expected, actual;
+    reference.compute(expected, nullptr, first, count);
+    mixed.compute(actual, nullptr, first, count);
+
+    double error = 0;
+    for (arma::uword i = 0; i < expected.n_cols; i++)
+    {
+        double diff = 0, norm = 0;
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            diff += pow(actual(j, i) - expected(j, i), 2);
+            norm += pow(expected(j, i), 2);
+        }
+        if (norm > 0) {
+            error = std::max(error, std::sqrt(diff / norm));
+        }
+    }
+    return error;
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <cstring>
 #include <boost/filesystem.hpp>
 #include <ionmd/data.hpp>
 
@@ -8,10 +9,11 @@ using namespace ionmd;
 namespace fs = boost::filesystem;
 
 
-DataWriter::DataWriter(params_ptr params, trap_ptr trap,
-                       const std::vector<Ion> &ions, bool overwrite)
-    : path(params->path), buffer_size(params->buffer_size), buffer_pos(0)
+void ionmd::write_metadata(params_ptr params, trap_ptr trap,
+                          const std::vector<Ion> &ions, bool overwrite)
 {
+    const std::string path = params->path;
+
     // Create output directory
     if (fs::exists(path))
     {
@@ -28,7 +30,6 @@ DataWriter::DataWriter(params_ptr params, trap_ptr trap,
     else {
         fs::create_directory(path);
     }
-    this->path = path;
 
     // Output sim params
     fs::path p_path = path;
@@ -53,24 +54,280 @@ DataWriter::DataWriter(params_ptr params, trap_ptr trap,
         ions_out << ion.m << "," << ion.Z << "\n";
     }
     ions_out.close();
+}
+
+
+auto ionmd::raw_header(size_t num_ions, unsigned int num_steps) -> std::string
+{
+    std::stringstream header;
+    header << num_ions << "\n" << num_steps << "\n";
+    return header.str();
+}
+
+
+void ionmd::write_profile(params_ptr params, const Profiler &profiler,
+                          const PerfCounters *perf)
+{
+    fs::path filename = params->path;
+    filename /= "profile.json";
+    std::ofstream out(filename.c_str());
+    out << profiler.to_json() << std::endl;
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Unable to write " + filename.string());
+    }
+
+    if (perf != nullptr)
+    {
+        filename = params->path;
+        filename /= "perf.json";
+        std::ofstream perf_out(filename.c_str());
+        perf_out << perf->to_json() << std::endl;
+        perf_out.close();
+        if (!perf_out) {
+            throw std::runtime_error("Unable to write " + filename.string());
+        }
+    }
+}
+
+
+DataWriter::DataWriter(params_ptr params, trap_ptr trap,
+                       const std::vector<Ion> &ions, bool overwrite,
+                       uint64_t append_at)
+    : path(params->path), buffer_size(params->buffer_size > 0 ? params->buffer_size : 1),
+      pending(0), stopping(false)
+{
+    write_metadata(params, trap, ions, overwrite);
 
     // Create stream for writing trajectory data
+    const size_t num_values = 3 * ions.size();
     fs::path traj_filename = path;
-    // traj_filename /= "trajectories.bin";
-    // traj_file.open(traj_filename.c_str(), std::ios::out | std::ios::binary);
 
-    // Allocate ion data buffer
-    buffer.zeros(params->num_steps, 3 * params->buffer_size);
+    traj_filename /= params->compress_trajectories ? "trajectories.ionz" : "trajectories.bin";
+
+    if (append_at > 0)
+    {
+        if (!fs::exists(traj_filename) || fs::file_size(traj_filename) < append_at) {
+            throw std::runtime_error(traj_filename.string() + " is shorter than at the checkpoint");
+        }
+
+        // Discard anything written after the checkpoint we're resuming from
+        fs::resize_file(traj_filename, append_at);
+        traj_file.open(traj_filename.c_str(),
+                       std::ios::out | std::ios::binary | std::ios::app);
+    }
+    else
+    {
+        traj_file.open(traj_filename.c_str(), std::ios::out | std::ios::binary);
+
+        if (params->compress_trajectories)
+        {
+            const uint64_t stored_values = num_values;
+            const double precision = params->trajectory_precision;
+            traj_file.write(codec::magic, sizeof(codec::magic));
+            traj_file.write(reinterpret_cast<const char *>(&codec::version), sizeof(codec::version));
+            traj_file.write(reinterpret_cast<const char *>(&stored_values), sizeof(stored_values));
+            traj_file.write(reinterpret_cast<const char *>(&precision), sizeof(precision));
+        }
+        else {
+            traj_file << raw_header(ions.size(), params->num_steps);
+        }
+    }
+
+    if (params->compress_trajectories) {
+        encoder = std::make_unique<TrajectoryEncoder>(num_values, params->trajectory_precision);
+    }
+
+    if (!traj_file) {
+        throw std::runtime_error("Unable to open " + traj_filename.string());
+    }
+
+    writer_thread = std::thread([this]() { this->write_loop(); });
 }
 
 
 DataWriter::~DataWriter()
 {
-    // traj_file.close();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    writer_thread.join();
+    traj_file.close();
+}
+
+
+void DataWriter::write_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;  // stopping and drained
+        }
+
+        auto frame = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+
+        std::exception_ptr failure;
+        try {
+            if (!error) {
+                write_to_file(frame);
+            }
+        }
+        catch (...) {
+            failure = std::current_exception();
+        }
+
+        lock.lock();
+        if (failure && !error) {
+            error = failure;
+        }
+        pending--;
+        cv.notify_all();
+    }
 }
 
 
-inline void DataWriter::write(const unsigned int &ion, const arma::vec &data)
+void DataWriter::write_to_file(const arma::vec &frame)
 {
-    ion_files[ion] << data;
+    if (encoder)
+    {
+        encoded.clear();
+        encoder->encode(frame.memptr(), encoded);
+        const uint32_t size = encoded.size();
+        traj_file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        traj_file.write(reinterpret_cast<const char *>(encoded.data()), size);
+    }
+    else {
+        frame.save(traj_file, arma::raw_binary);
+    }
+
+    if (!traj_file) {
+        throw std::runtime_error("Error writing trajectory data to " + path);
+    }
+}
+
+
+void DataWriter::write_frame(const arma::vec &positions)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return error || queue.size() < buffer_size; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    queue.push_back(positions);
+    pending++;
+    cv.notify_all();
+}
+
+
+auto DataWriter::tell() -> uint64_t
+{
+    flush();
+    return static_cast<uint64_t>(traj_file.tellp());
+}
+
+
+void DataWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return pending == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    traj_file.flush();
+}
+
+
+TrajectoryReader::TrajectoryReader(const std::string &filename)
+    : file(filename, std::ios::in | std::ios::binary), num_ions(0)
+{
+    if (!file) {
+        throw std::runtime_error("Unable to open " + filename);
+    }
+
+    char magic[sizeof(codec::magic)] = {};
+    file.read(magic, sizeof(magic));
+
+    if (file && std::memcmp(magic, codec::magic, sizeof(magic)) == 0)
+    {
+        uint32_t version;
+        uint64_t num_values;
+        double precision;
+        file.read(reinterpret_cast<char *>(&version), sizeof(version));
+        file.read(reinterpret_cast<char *>(&num_values), sizeof(num_values));
+        file.read(reinterpret_cast<char *>(&precision), sizeof(precision));
+
+        if (!file || (version != 1 && version != codec::version)) {
+            throw std::runtime_error("Unsupported trajectory file " + filename);
+        }
+        num_ions = num_values / 3;
+        decoder = std::make_unique<TrajectoryDecoder>(num_values, precision);
+    }
+    else
+    {
+        // Raw trajectories start with a text header of the number of ions
+        // and the number of time steps.
+        file.clear();
+        file.seekg(0);
+        unsigned int num_steps;
+        file >> num_ions >> num_steps;
+        file.ignore(1);  // newline ending the header
+        if (!file) {
+            throw std::runtime_error("Unrecognized trajectory file " + filename);
+        }
+    }
+}
+
+
+bool TrajectoryReader::read_frame(arma::vec &frame)
+{
+    const size_t num_values = 3 * num_ions;
+    frame.set_size(num_values);
+
+    if (decoder)
+    {
+        uint32_t size;
+        if (!file.read(reinterpret_cast<char *>(&size), sizeof(size))) {
+            return false;
+        }
+        encoded.resize(size);
+        if (!file.read(reinterpret_cast<char *>(encoded.data()), size)) {
+            throw std::runtime_error("Truncated trajectory file");
+        }
+        decoder->decode(encoded.data(), size, frame.memptr());
+        return true;
+    }
+
+    const auto bytes = static_cast<std::streamsize>(num_values * sizeof(double));
+    file.read(reinterpret_cast<char *>(frame.memptr()), bytes);
+    if (file.gcount() == 0) {
+        return false;
+    }
+    if (file.gcount() != bytes) {
+        throw std::runtime_error("Truncated trajectory file");
+    }
+    return true;
+}
+
+
+arma::mat TrajectoryReader::read_all()
+{
+    std::vector<arma::vec> frames;
+    arma::vec frame;
+    while (read_frame(frame)) {
+        frames.push_back(frame);
+    }
+
+    arma::mat result(3 * num_ions, frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        result.col(i) = frames[i];
+    }
+    return result;
 }
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <ionmd/ensemble.hpp>
+
+using namespace ionmd;
+
+
+/// Rough relative cost of running a member.
+static double estimate_cost(const EnsembleMember &member)
+{
+    const double n = member.ions.size();
+    const double per_step = member.params.coulomb_enabled ? n*n : n;
+    return per_step * member.params.num_steps;
+}
+
+
+void Ensemble::add_member(const SimParams &params, const Trap &trap,
+                          const std::vector<IonSpec> &ions)
+{
+    if (params.write_output)
+    {
+        for (const auto &member: members)
+        {
+            if (member.params.write_output && member.params.path == params.path) {
+                throw std::invalid_argument("Ensemble members can't share the path " + params.path);
+            }
+        }
+    }
+
+    members.push_back({params, trap, ions});
+}
+
+
+auto Ensemble::run_order() const -> std::vector<size_t>
+{
+    // Longest processing time first
+    std::vector<size_t> order(members.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return estimate_cost(members[a]) > estimate_cost(members[b]);
+    });
+    return order;
+}
+
+
+void Ensemble::run(unsigned int num_threads)
+{
+    simulations.clear();
+    for (const auto &member: members)
+    {
+        auto sim = std::make_unique<Simulation>(member.params, member.trap);
+        std::vector<Ion> ions;
+        for (const auto &ion: member.ions) {
+            ions.push_back(sim->make_ion(ion.m, ion.Z, ion.x0, ion.lasers));
+        }
+        sim->set_ions(ions);
+        simulations.push_back(std::move(sim));
+    }
+
+    const auto order = run_order();
+
+#ifdef _OPENMP
+    // Keep parallel loops inside each simulation on the member's own thread
+    const int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(1);
+    const int threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+    (void)num_threads;
+#endif
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (size_t n = 0; n < order.size(); n++) {
+        simulations[order[n]]->run();
+    }
+
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_levels);
+#endif
+}
+
+
+auto Ensemble::get_status(size_t index) const -> SimStatus
+{
+    if (index >= simulations.size()) {
+        return SimStatus::IDLE;
+    }
+    return simulations[index]->status;
+}
+
+
+auto Ensemble::get_simulation(size_t index) -> Simulation &
+{
+    if (index >= simulations.size()) {
+        throw std::out_of_range("No simulation for ensemble member");
+    }
+    return *simulations[index];
+}
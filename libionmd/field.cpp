@@ -0,0 +1,451 @@
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ionmd/field.hpp>
+#include <ionmd/constants.hpp>
+
+using namespace ionmd;
+
+
+/// Magic bytes at the start of grid files.
+static const char field_magic[8] = {'I', 'O', 'N', 'M', 'D', 'F', 'L', 'D'};
+
+/// Grid file format version.
+static constexpr uint32_t field_version = 1;
+
+/// Size of the file header, a multiple of 8 so that values are aligned.
+static constexpr size_t header_size = 8 + 8 + 3*8 + 6*8;
+
+
+FieldGrid::FieldGrid(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open " + filename);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < header_size)
+    {
+        close(fd);
+        throw std::runtime_error(filename + " is not a field grid");
+    }
+
+    mapping_size = info.st_size;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        throw std::runtime_error("Unable to map " + filename);
+    }
+
+    const char *bytes = static_cast<const char *>(mapping);
+    uint32_t version;
+    uint64_t points[3];
+    std::memcpy(&version, bytes + 8, sizeof(version));
+    std::memcpy(points, bytes + 16, sizeof(points));
+    std::memcpy(origin.data(), bytes + 40, sizeof(origin));
+    std::memcpy(spacing.data(), bytes + 64, sizeof(spacing));
+
+    bool valid = std::memcmp(bytes, field_magic, sizeof(field_magic)) == 0
+        && version == field_version;
+    uint64_t count = 1;
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        size[j] = points[j];
+        count *= points[j];
+        valid = valid && points[j] >= 4 && spacing[j] > 0;
+    }
+    if (!valid || mapping_size != header_size + count * sizeof(double))
+    {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        throw std::runtime_error(filename + " is not a valid field grid");
+    }
+    data = reinterpret_cast<const double *>(bytes + header_size);
+}
+
+
+FieldGrid::~FieldGrid()
+{
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+
+bool FieldGrid::same_points(const FieldGrid &other) const
+{
+    return size == other.size && origin == other.origin && spacing == other.spacing;
+}
+
+
+auto ionmd::load_field_grid(const std::string &filename) -> std::shared_ptr<const FieldGrid>
+{
+    // Grids stay mapped while any simulation uses them
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const FieldGrid>> mapped;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto grid = mapped[filename].lock();
+    if (!grid)
+    {
+        grid = std::make_shared<const FieldGrid>(filename);
+        mapped[filename] = grid;
+    }
+    return grid;
+}
+
+
+void ionmd::write_field_grid(const std::string &filename, const std::array<size_t, 3> &size,
+                             const std::array<double, 3> &origin,
+                             const std::array<double, 3> &spacing,
+                             const std::vector<double> &values)
+{
+    if (values.size() != size[0] * size[1] * size[2]) {
+        throw std::invalid_argument("Need one value per grid point");
+    }
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Unable to open " + filename);
+    }
+    const uint32_t reserved = 0;
+    const uint64_t points[3] = {size[0], size[1], size[2]};
+    out.write(field_magic, sizeof(field_magic));
+    out.write(reinterpret_cast<const char *>(&field_version), sizeof(field_version));
+    out.write(reinterpret_cast<const char *>(&reserved), sizeof(reserved));
+    out.write(reinterpret_cast<const char *>(points), sizeof(points));
+    out.write(reinterpret_cast<const char *>(origin.data()), sizeof(double) * 3);
+    out.write(reinterpret_cast<const char *>(spacing.data()), sizeof(double) * 3);
+    out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(double));
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Error writing " + filename);
+    }
+}
+
+
+/**
+ * Catmull-Rom weights of the 4 grid points around a coordinate and their
+ * derivatives.
+ * @param u Coordinate in units of the grid spacing from the first point
+ * @param n Number of grid points
+ * @param first Set to the index of the first of the 4 points
+ * @param w Weights
+ * @param dw Derivatives of the weights with respect to `u`
+ * @returns True if all 4 points are on the grid (otherwise `first` is
+ * clamped to the grid)
+ */
+static inline bool stencil(double u, size_t n, size_t &first, double *w, double *dw)
+{
+    const double lower = std::floor(u);
+    const double clamped = std::min(std::max(lower, 1.0), n - 3.0);
+    const double f = std::min(std::max(u - clamped, 0.0), 1.0);
+    first = static_cast<size_t>(clamped) - 1;
+
+    const double f2 = f * f;
+    const double f3 = f2 * f;
+    w[0] = 0.5 * (-f3 + 2*f2 - f);
+    w[1] = 0.5 * (3*f3 - 5*f2 + 2);
+    w[2] = 0.5 * (-3*f3 + 4*f2 + f);
+    w[3] = 0.5 * (f3 - f2);
+    dw[0] = 0.5 * (-3*f2 + 4*f - 1);
+    dw[1] = 0.5 * (9*f2 - 10*f);
+    dw[2] = 0.5 * (-9*f2 + 8*f + 1);
+    dw[3] = 0.5 * (3*f2 - 2*f);
+    return lower == clamped;
+}
+
+
+FieldMap::FieldMap(params_ptr params, trap_ptr trap)
+    : p(params), trap(trap)
+{
+    const size_t num_grids = p->field_maps.size();
+    if ((!p->field_dc.empty() && p->field_dc.size() != num_grids)
+        || (!p->field_rf.empty() && p->field_rf.size() != num_grids))
+    {
+        throw std::invalid_argument("field_dc and field_rf need one voltage per field map");
+    }
+    for (const auto &filename: p->field_maps)
+    {
+        grids.push_back(load_field_grid(filename));
+        if (!grids.back()->same_points(*grids.front())) {
+            throw std::invalid_argument("Field maps must have the same grid points");
+        }
+    }
+
+    bool rf = false;
+    for (const auto V: p->field_rf) {
+        rf = rf || V != 0;
+    }
+    if (rf || grids.empty()) {
+        return;
+    }
+
+    // Static voltages: sum the grids once
+    const auto &size = grids.front()->size;
+    const size_t count = size[0] * size[1] * size[2];
+    combined.resize(count);
+    #pragma omp parallel for schedule(static)
+    for (size_t point = 0; point < count; point++)
+    {
+        double sum = 0;
+        for (size_t k = 0; k < num_grids; k++) {
+            sum += (p->field_dc.empty() ? 0 : p->field_dc[k]) * grids[k]->values()[point];
+        }
+        combined[point] = sum;
+    }
+}
+
+
+void FieldMap::set_ions(const std::vector<Ion> &ions)
+{
+    const size_t n = ions.size();
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    q.resize(n);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = ions[i].x[0];
+        y[i] = ions[i].x[1];
+        z[i] = ions[i].x[2];
+        q[i] = ions[i].Z * constants::q_e;
+    }
+}
+
+
+/// Grids and voltages to sum at time `t`.
+static void sources(const std::vector<std::shared_ptr<const FieldGrid>> &grids,
+                    const std::vector<double> &combined, const SimParams &p,
+                    double omega_rf, double t,
+                    std::vector<const double *> &values, std::vector<double> &voltages)
+{
+    if (!combined.empty())
+    {
+        values.assign(1, combined.data());
+        voltages.assign(1, 1.0);
+        return;
+    }
+
+    const double rf = std::cos(omega_rf * t);
+    for (size_t k = 0; k < grids.size(); k++)
+    {
+        values.push_back(grids[k]->values());
+        voltages.push_back((p.field_dc.empty() ? 0 : p.field_dc[k])
+                           + (p.field_rf.empty() ? 0 : p.field_rf[k]) * rf);
+    }
+}
+
+
+void FieldMap::compute(double t, arma::mat &forces, bool add) const
+{
+    const size_t n = q.size();
+    if (!add) {
+        forces.set_size(3, n);
+    }
+    double *F = forces.memptr();
+    if (grids.empty())
+    {
+        if (!add) {
+            forces.zeros();
+        }
+        return;
+    }
+
+    std::vector<const double *> values;
+    std::vector<double> voltages;
+    sources(grids, combined, *p, trap->omega_rf, t, values, voltages);
+    const size_t num_sources = values.size();
+    const double *const *source = values.data();
+    const double *V = voltages.data();
+
+    const auto &grid = *grids.front();
+    const size_t nx = grid.size[0];
+    const size_t ny = grid.size[1];
+    const size_t nz = grid.size[2];
+    const size_t stride_z = nx * ny;
+    const double scale[3] = {1 / grid.spacing[0], 1 / grid.spacing[1], 1 / grid.spacing[2]};
+
+    // Ions are independent, so the loop vectorizes with gathers of the grid
+    #pragma omp parallel for simd schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t ix, iy, iz;
+        double wx[4], wy[4], wz[4], dx[4], dy[4], dz[4];
+        const bool inside = stencil((x[i] - grid.origin[0]) * scale[0], nx, ix, wx, dx)
+            & stencil((y[i] - grid.origin[1]) * scale[1], ny, iy, wy, dy)
+            & stencil((z[i] - grid.origin[2]) * scale[2], nz, iz, wz, dz);
+
+        double gx = 0, gy = 0, gz = 0;
+        for (unsigned int c = 0; c < 4; c++)
+        {
+            for (unsigned int b = 0; b < 4; b++)
+            {
+                const size_t row = (iz + c) * stride_z + (iy + b) * nx + ix;
+                const double w_yz = wy[b] * wz[c];
+                const double dy_z = dy[b] * wz[c];
+                const double y_dz = wy[b] * dz[c];
+                for (unsigned int a = 0; a < 4; a++)
+                {
+                    double phi = 0;
+                    for (size_t k = 0; k < num_sources; k++) {
+                        phi += V[k] * source[k][row + a];
+                    }
+                    gx += dx[a] * w_yz * phi;
+                    gy += wx[a] * dy_z * phi;
+                    gz += wx[a] * y_dz * phi;
+                }
+            }
+        }
+
+        // F = -q grad(phi)
+        const double factor = inside ? -q[i] : 0;
+        const double Fi[3] = {factor * gx * scale[0], factor * gy * scale[1], factor * gz * scale[2]};
+        for (unsigned int j = 0; j < 3; j++) {
+            F[3*i + j] = add ? F[3*i + j] + Fi[j] : Fi[j];
+        }
+    }
+}
+
+
+double FieldMap::interpolate(const double *r, const std::vector<const double *> &values,
+                             const std::vector<double> &voltages, double *gradient) const
+{
+    const auto &grid = *grids.front();
+    const size_t nx = grid.size[0];
+    size_t first[3];
+    double w[3][4], dw[3][4];
+    bool inside = true;
+    for (unsigned int j = 0; j < 3; j++) {
+        inside = stencil((r[j] - grid.origin[j]) / grid.spacing[j], grid.size[j],
+                         first[j], w[j], dw[j]) && inside;
+    }
+    if (gradient != nullptr) {
+        std::fill(gradient, gradient + 3, 0.0);
+    }
+    if (!inside) {
+        return 0;
+    }
+
+    double phi = 0;
+    for (unsigned int c = 0; c < 4; c++)
+    {
+        for (unsigned int b = 0; b < 4; b++)
+        {
+            const size_t row = ((first[2] + c) * grid.size[1] + first[1] + b) * nx + first[0];
+            for (unsigned int a = 0; a < 4; a++)
+            {
+                double value = 0;
+                for (size_t k = 0; k < values.size(); k++) {
+                    value += voltages[k] * values[k][row + a];
+                }
+                phi += w[0][a] * w[1][b] * w[2][c] * value;
+                if (gradient != nullptr)
+                {
+                    gradient[0] += dw[0][a] * w[1][b] * w[2][c] * value / grid.spacing[0];
+                    gradient[1] += w[0][a] * dw[1][b] * w[2][c] * value / grid.spacing[1];
+                    gradient[2] += w[0][a] * w[1][b] * dw[2][c] * value / grid.spacing[2];
+                }
+            }
+        }
+    }
+    return phi;
+}
+
+
+double FieldMap::potential(double t, const double *r) const
+{
+    if (grids.empty()) {
+        return 0;
+    }
+
+    std::vector<const double *> values;
+    std::vector<double> voltages;
+    sources(grids, combined, *p, trap->omega_rf, t, values, voltages);
+    return interpolate(r, values, voltages);
+}
+
+
+double FieldMap::effective_energy(const double *r, double q, double m) const
+{
+    if (grids.empty()) {
+        return 0;
+    }
+    if (!combined.empty()) {
+        return q * interpolate(r, {combined.data()}, {1.0});
+    }
+
+    std::vector<const double *> values;
+    std::vector<double> dc, rf;
+    for (size_t k = 0; k < grids.size(); k++)
+    {
+        values.push_back(grids[k]->values());
+        dc.push_back(p->field_dc.empty() ? 0 : p->field_dc[k]);
+        rf.push_back(p->field_rf.empty() ? 0 : p->field_rf[k]);
+    }
+
+    // Ponderomotive potential of the rf field amplitude
+    double E[3];
+    interpolate(r, values, rf, E);
+    const double E2 = E[0]*E[0] + E[1]*E[1] + E[2]*E[2];
+    return q * interpolate(r, values, dc)
+        + q*q * E2 / (4 * m * trap->omega_rf * trap->omega_rf);
+}
+
+
+void FieldMap::effective_force(const double *r, double q, double m, double *F) const
+{
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        const double h = difference_step * grids.front()->spacing[j];
+        double shifted[3] = {r[0], r[1], r[2]};
+        shifted[j] = r[j] + h;
+        const double up = effective_energy(shifted, q, m);
+        shifted[j] = r[j] - h;
+        const double down = effective_energy(shifted, q, m);
+        F[j] = -(up - down) / (2 * h);
+    }
+}
+
+
+void FieldMap::effective_hessian(const double *r, double q, double m, double H[3][3]) const
+{
+    double h[3];
+    for (unsigned int j = 0; j < 3; j++) {
+        h[j] = difference_step * grids.front()->spacing[j];
+    }
+
+    // Energy at r + (sa * h[a], sb * h[b]) for steps sa, sb of -1, 0 or 1
+    auto energy = [&](unsigned int a, int sa, unsigned int b, int sb) {
+        double shifted[3] = {r[0], r[1], r[2]};
+        shifted[a] += sa * h[a];
+        shifted[b] += sb * h[b];
+        return effective_energy(shifted, q, m);
+    };
+
+    const double center = effective_energy(r, q, m);
+    for (unsigned int a = 0; a < 3; a++)
+    {
+        H[a][a] = (energy(a, 1, a, 0) - 2*center + energy(a, -1, a, 0)) / (h[a] * h[a]);
+        for (unsigned int b = a + 1; b < 3; b++)
+        {
+            H[a][b] = (energy(a, 1, b, 1) - energy(a, 1, b, -1)
+                       - energy(a, -1, b, 1) + energy(a, -1, b, -1)) / (4 * h[a] * h[b]);
+            H[b][a] = H[a][b];
+        }
+    }
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <cmath>
 #include <atomic>
+#include <array>
+#include <utility>
 
 #include <armadillo>
 
@@ -42,115 +44,69 @@ Ion::Ion(params_ptr params, trap_ptr trap, lasers_ptr lasers,
 }
 
 
-const vec Ion::update(const double &t, const mat &forces,
-                      const unsigned int &index)
+/// Table of `Ion::step` specializations indexed by force flags.
+template <size_t... forces>
+static auto step_table(std::index_sequence<forces...>)
+    -> std::array<void (Ion::*)(const double &, const mat &, const unsigned int &),
+                  sizeof...(forces)>
 {
-    vec dx = v*p->dt + 0.5*a*pow(p->dt, 2);
-    x += dx;
-
-    vec F = secular_force()
-        + micromotion_force(t)
-        + coulomb_force(forces, index)
-        + stochastic_force()
-        + doppler_force();
-
-    auto accel = F / m;
-    v += 0.5*(a + accel)*p->dt;
-    a = accel;
-
-    return x;
+    return {{&Ion::step<forces>...}};
 }
 
 
-vec Ion::doppler_force() {
-    vec F = arma::zeros<vec>(3);
+unsigned int ionmd::enabled_forces(const SimParams &p)
+{
+    return (p.secular_enabled ? SECULAR_FORCE : 0)
+        | (p.micromotion_enabled ? MICROMOTION_FORCE : 0)
+        | (p.coulomb_enabled ? COULOMB_FORCE : 0)
+        | (p.stochastic_enabled ? STOCHASTIC_FORCE : 0)
+        | (p.doppler_enabled ? DOPPLER_FORCE : 0)
+        | (!p.field_maps.empty() ? FIELD_FORCE : 0);
+}
 
-    if (p->doppler_enabled)
-    {
-        for (const auto &laser: lasers) {
-            F = laser->F0 * laser->wave_vector - laser->beta * v;
-        }
-    }
 
-    return F;
+const vec Ion::update(const double &t, const mat &forces,
+                      const unsigned int &index)
+{
+    static const auto steps = step_table(std::make_index_sequence<num_force_sets>());
+    (this->*steps[enabled_forces(*p)])(t, forces, index);
+    return x;
 }
 
 
-const vec Ion::coulomb(const std::vector<Ion> &ions)
+const vec Ion::coulomb(const std::vector<Ion> &ions, double *energy)
 {
     vec F = arma::zeros<vec>(3);
+    double phi = 0;
 
     for (const auto &other: ions)
     {
         if (this == &other) {
             continue;
         }
-        vec r = other.x - this->x;
-        F += (other.charge * r / pow(arma::norm(r), 3));
-    }
-
-    return constants::OOFPEN * this->charge * F;
-}
-
-
-vec Ion::coulomb_force(const mat &forces, const unsigned int &index)
-{
-    if (p->coulomb_enabled) {
-        return forces.col(index);
-    }
-    else {
-        return arma::zeros<vec>(3);
+        vec r = this->x - other.x;
+        const double r_norm = arma::norm(r);
+        F += (other.charge * r / pow(r_norm, 3));
+        if (energy != nullptr) {
+            phi += other.charge / r_norm;
+        }
     }
-}
-
 
-vec Ion::secular_force()
-{
-    vec F = arma::zeros<vec>(3);
-
-    if (p->secular_enabled)
-    {
-        const double A = charge*pow(trap->V_rf, 2)/(m*pow(trap->omega_rf, 2)*pow(trap->r0, 4));
-        const double B = trap->kappa*trap->U_ec/(2*pow(trap->z0, 2));
-        F[0] = -2 * charge * (A - B) * x[0];
-        F[1] = -2 * charge * (A - B) * x[1];
-        F[2] = -4 * charge * B * x[2];
-    }
-    return F;
-}
-
-
-vec Ion::micromotion_force(double t)
-{
-    vec F = arma::zeros<vec>(3);
-
-    if (p->micromotion_enabled) {
-        // FIXME
-        return F;
-    }
-    else {
-        return F;
+    if (energy != nullptr) {
+        *energy = constants::OOFPEN * this->charge * phi;
     }
+    return constants::OOFPEN * this->charge * F;
 }
 
 
-vec Ion::stochastic_force()
+double Ion::secular_energy() const
 {
-    vec F = arma::zeros<vec>(3);
-
-    if (p->stochastic_enabled) {
-        // FIXME
-        return F;
-    }
-    else {
-        return F;
+    if (!p->secular_enabled) {
+        return 0;
     }
 
-    // FIXME
-    // double v;
-    // vec direction = {uniform(rng), uniform(rng), uniform(rng)};
-    // vec hat = normalise(direction);
-    // v = 0; // sqrt(2*kB*p->gamma_col*p->dt/this->m);
-    // F = this->m*v*hat/p->dt;
-    // return F;
+    // Potential of the force in add_secular_force
+    const double A = charge*pow(trap->V_rf, 2)/(m*pow(trap->omega_rf, 2)*pow(trap->r0, 4));
+    const double B = trap->kappa*trap->U_ec/(2*pow(trap->z0, 2));
+    return charge * ((A - B)*(x[0]*x[0] + x[1]*x[1]) + 2*B*x[2]*x[2]);
 }
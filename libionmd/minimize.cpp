@@ -0,0 +1,398 @@
+#include <cmath>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+#include <ionmd/minimize.hpp>
+#include <ionmd/coulomb.hpp>
+#include <ionmd/field.hpp>
+#include <ionmd/constants.hpp>
+#include <ionmd/vector_ops.hpp>
+
+using namespace ionmd;
+using arma::vec;
+using arma::mat;
+
+
+auto ionmd::parse_minimizer(const std::string &name) -> Minimizer
+{
+    if (name == "fire") {
+        return Minimizer::FIRE;
+    }
+    else if (name == "lbfgs") {
+        return Minimizer::LBFGS;
+    }
+    throw std::invalid_argument("Unknown minimizer: " + name);
+}
+
+
+namespace {
+
+/**
+ * Potential energy of ions in the secular trap potential, in the effective
+ * potential of field maps and of their Coulomb interaction. Coordinates are
+ * stored with 3 values per ion.
+ */
+class Potential
+{
+private:
+    /// Secular spring constants (3 per ion)
+    vec stiffness;
+
+    /// Charges in C
+    std::vector<double> charges;
+
+    /// Masses (for the pseudopotential of field maps)
+    std::vector<double> masses;
+
+    /// Field maps (null without)
+    std::unique_ptr<FieldMap> field;
+
+    /// Largest curvature of the field map potential at the start
+    double field_stiffness = 0;
+
+    bool coulomb_enabled;
+    CoulombSolver coulomb;
+    mat coulomb_forces;
+    vec coulomb_energies;
+
+public:
+    /// Mean magnitude of the trap and Coulomb forces on an ion at the last
+    /// evaluation, used as the scale of the convergence criterion.
+    double force_scale = 0;
+
+    /// Largest net force on an ion at the last evaluation.
+    double max_force = 0;
+
+    /// Number of evaluations.
+    unsigned int evaluations = 0;
+
+    Potential(const std::vector<Ion> &ions, const SimParams &params)
+        : stiffness(3 * ions.size()), coulomb_enabled(params.coulomb_enabled),
+          coulomb(params.coulomb_tile_i, params.coulomb_tile_j, false)
+    {
+        for (size_t i = 0; i < ions.size(); i++)
+        {
+            double k[3] = {0, 0, 0};
+            if (params.secular_enabled) {
+                ions[i].secular_stiffness(k);
+            }
+            for (unsigned int j = 0; j < 3; j++) {
+                stiffness[3*i + j] = k[j];
+            }
+            charges.push_back(ions[i].Z * constants::q_e);
+            masses.push_back(ions[i].m);
+        }
+
+        if (!params.field_maps.empty() && !ions.empty())
+        {
+            field = std::make_unique<FieldMap>(std::make_shared<SimParams>(params),
+                                               ions.front().get_trap());
+            for (size_t i = 0; i < ions.size(); i++)
+            {
+                double H[3][3];
+                field->effective_hessian(ions[i].x.memptr(), charges[i], masses[i], H);
+                for (unsigned int j = 0; j < 3; j++) {
+                    field_stiffness = std::max(field_stiffness, H[j][j]);
+                }
+            }
+        }
+    }
+
+    /// Largest secular or field map spring constant.
+    double max_stiffness() const
+    {
+        double k = field_stiffness;
+        for (arma::uword i = 0; i < stiffness.n_elem; i++) {
+            k = std::max(k, stiffness[i]);
+        }
+        return k;
+    }
+
+    /**
+     * Evaluate the energy and forces.
+     * @param x Positions
+     * @param forces Set to the force on each coordinate
+     * @returns the potential energy in J
+     */
+    double evaluate(const vec &x, vec &forces)
+    {
+        const size_t n = charges.size();
+        forces.set_size(x.n_elem);
+        evaluations++;
+
+        double energy = 0;
+        if (coulomb_enabled)
+        {
+            coulomb.set_ions(x, charges);
+            coulomb.compute(coulomb_forces, &coulomb_energies);
+        }
+
+        double scale = 0;
+        double largest = 0;
+        #pragma omp parallel for reduction(+:energy,scale) reduction(max:largest)
+        for (size_t i = 0; i < n; i++)
+        {
+            double field_forces[3] = {0, 0, 0};
+            if (field)
+            {
+                field->effective_force(&x[3*i], charges[i], masses[i], field_forces);
+                energy += field->effective_energy(&x[3*i], charges[i], masses[i]);
+            }
+
+            double trap_norm = 0, coulomb_norm = 0, net_norm = 0;
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                const size_t k = 3*i + j;
+                const double trap_force = -stiffness[k] * x[k] + field_forces[j];
+                const double coulomb_force = coulomb_enabled ? coulomb_forces(j, i) : 0;
+                forces[k] = trap_force + coulomb_force;
+                energy += 0.5 * stiffness[k] * x[k] * x[k];
+
+                trap_norm += trap_force * trap_force;
+                coulomb_norm += coulomb_force * coulomb_force;
+                net_norm += forces[k] * forces[k];
+            }
+
+            // Pair energies are counted for both ions of a pair
+            if (coulomb_enabled) {
+                energy += 0.5 * coulomb_energies[i];
+            }
+            scale += 0.5 * (std::sqrt(trap_norm) + std::sqrt(coulomb_norm));
+            largest = std::max(largest, std::sqrt(net_norm));
+        }
+
+        force_scale = n > 0 ? scale / n : 0;
+        max_force = largest;
+        return energy;
+    }
+
+    /// True if the forces of the last evaluation are within the tolerance.
+    bool converged(double tolerance) const
+    {
+        return max_force <= tolerance * force_scale;
+    }
+};
+
+
+/**
+ * FIRE minimization (Bitzek et al., PRL 97, 170201 (2006)) with semi-implicit
+ * Euler steps.
+ */
+void fire(Potential &potential, vec &x, const vec &masses,
+          const MinimizeOptions &options, MinimizeResult &result)
+{
+    const unsigned int min_steps = 5;
+    const double dt_grow = 1.1, dt_shrink = 0.5;
+    const double alpha_start = 0.1, alpha_shrink = 0.99;
+
+    // Start with a small fraction of the fastest trap oscillation period
+    double omega_max = 0;
+    for (arma::uword k = 0; k < x.n_elem; k++) {
+        omega_max = std::max(omega_max, std::sqrt(potential.max_stiffness() / masses[k]));
+    }
+    double dt = omega_max > 0 ? 0.05 / omega_max : 1e-9;
+    const double dt_max = 10 * dt;
+    double alpha = alpha_start;
+    unsigned int steps_downhill = 0;
+
+    vec v = arma::zeros<vec>(x.n_elem);
+    vec forces;
+    result.energy = potential.evaluate(x, forces);
+
+    for (result.iterations = 0; result.iterations < options.max_iterations; result.iterations++)
+    {
+        if (potential.converged(options.tolerance)) {
+            break;
+        }
+
+        const double power = dot(forces, v);
+        if (power > 0)
+        {
+            // Turn the velocity towards the force
+            const double v_norm = std::sqrt(dot(v, v));
+            const double f_norm = std::sqrt(dot(forces, forces));
+            for (arma::uword k = 0; k < x.n_elem; k++) {
+                v[k] = (1 - alpha) * v[k] + alpha * v_norm * forces[k] / f_norm;
+            }
+            if (++steps_downhill > min_steps)
+            {
+                dt = std::min(dt * dt_grow, dt_max);
+                alpha *= alpha_shrink;
+            }
+        }
+        else
+        {
+            // Moving uphill: stop and restart more carefully
+            v.zeros();
+            dt *= dt_shrink;
+            alpha = alpha_start;
+            steps_downhill = 0;
+        }
+
+        #pragma omp parallel for
+        for (arma::uword k = 0; k < x.n_elem; k++)
+        {
+            v[k] += dt * forces[k] / masses[k];
+            x[k] += dt * v[k];
+        }
+        result.energy = potential.evaluate(x, forces);
+    }
+}
+
+
+/**
+ * L-BFGS minimization with a backtracking line search. The gradient is the
+ * negative force.
+ */
+void lbfgs(Potential &potential, vec &x, const MinimizeOptions &options,
+           MinimizeResult &result)
+{
+    const double armijo = 1e-4;
+    const double curvature = 0.9;
+    const unsigned int max_backtracks = 40;
+
+    // Steepest descent steps are scaled by the softest restoring force, which
+    // is what the first quasi-Newton steps do as well
+    const double k_max = potential.max_stiffness();
+    const double initial_scale = k_max > 0 ? 1 / k_max : 1;
+
+    std::deque<vec> s_history, y_history;
+    std::deque<double> rho_history;
+
+    vec forces, new_forces, direction, new_x;
+    double energy = potential.evaluate(x, forces);
+
+    for (result.iterations = 0; result.iterations < options.max_iterations; result.iterations++)
+    {
+        if (potential.converged(options.tolerance)) {
+            break;
+        }
+
+        // Two-loop recursion for the direction -H g = H F
+        direction = forces;
+        std::vector<double> a(s_history.size());
+        for (size_t m = s_history.size(); m-- > 0;)
+        {
+            a[m] = rho_history[m] * dot(s_history[m], direction);
+            axpy(-a[m], y_history[m], direction);
+        }
+        const double gamma = s_history.empty() ? initial_scale
+            : dot(s_history.back(), y_history.back()) / dot(y_history.back(), y_history.back());
+        direction *= gamma;
+        for (size_t m = 0; m < s_history.size(); m++)
+        {
+            const double b = rho_history[m] * dot(y_history[m], direction);
+            axpy(a[m] - b, s_history[m], direction);
+        }
+
+        // Not a descent direction (curvature information went bad): restart
+        double slope = -dot(forces, direction);
+        if (slope >= 0)
+        {
+            s_history.clear();
+            y_history.clear();
+            rho_history.clear();
+            direction = forces;
+            direction *= initial_scale;
+            slope = -dot(forces, direction);
+        }
+
+        // Close to the minimum the expected energy decrease drops below the
+        // rounding error of the energy, which then can't tell good steps from
+        // bad ones. The forces are still accurate, so require the slope along
+        // the direction to shrink instead (curvature condition).
+        const double roundoff = 1e-12 * std::abs(energy);
+        double step = 1;
+        double new_energy = 0;
+        bool accepted = false;
+        for (unsigned int b = 0; b < max_backtracks; b++, step *= 0.5)
+        {
+            new_x = x;
+            axpy(step, direction, new_x);
+            new_energy = potential.evaluate(new_x, new_forces);
+            if (-step * slope > roundoff) {
+                accepted = new_energy <= energy + armijo * step * slope;
+            }
+            else {
+                accepted = std::abs(dot(new_forces, direction)) <= curvature * std::abs(slope);
+            }
+            if (accepted) {
+                break;
+            }
+        }
+        if (!accepted)
+        {
+            // No acceptable step along the direction; keep the current point
+            potential.evaluate(x, forces);
+            break;
+        }
+
+        vec s = new_x;
+        axpy(-1, x, s);
+        vec y = forces;
+        axpy(-1, new_forces, y);  // y = g_new - g_old = F_old - F_new
+        const double sy = dot(s, y);
+        if (sy > 0)
+        {
+            s_history.push_back(s);
+            y_history.push_back(y);
+            rho_history.push_back(1 / sy);
+            if (s_history.size() > options.history)
+            {
+                s_history.pop_front();
+                y_history.pop_front();
+                rho_history.pop_front();
+            }
+        }
+
+        x = new_x;
+        forces = new_forces;
+        energy = new_energy;
+    }
+
+    result.energy = energy;
+}
+
+}  // namespace
+
+
+auto ionmd::minimize_energy(std::vector<Ion> &ions, const SimParams &params,
+                            const MinimizeOptions &options) -> MinimizeResult
+{
+    const auto method = parse_minimizer(options.method);
+
+    vec x(3 * ions.size());
+    vec masses(3 * ions.size());
+    for (size_t i = 0; i < ions.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            x[3*i + j] = ions[i].x[j];
+            masses[3*i + j] = ions[i].m;
+        }
+    }
+
+    Potential potential(ions, params);
+    MinimizeResult result = {};
+    if (method == Minimizer::FIRE) {
+        fire(potential, x, masses, options, result);
+    }
+    else {
+        lbfgs(potential, x, options, result);
+    }
+    result.max_force = potential.max_force;
+    result.converged = potential.converged(options.tolerance);
+
+    for (size_t i = 0; i < ions.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            ions[i].x[j] = x[3*i + j];
+            ions[i].v[j] = 0;
+            ions[i].a[j] = 0;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,365 @@
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include <ionmd/modes.hpp>
+#include <ionmd/field.hpp>
+#include <ionmd/constants.hpp>
+#include <ionmd/vector_ops.hpp>
+
+using namespace ionmd;
+using arma::vec;
+using arma::mat;
+
+
+namespace {
+
+/// Ions per tile when assembling the Hessian (a 96 x 96 block of doubles).
+constexpr size_t hessian_tile = 32;
+
+/// Lanczos iterations between convergence checks.
+constexpr unsigned int lanczos_check_interval = 10;
+
+
+/**
+ * Ion data needed for second derivatives of the potential energy, with 3
+ * values per ion.
+ */
+struct Crystal
+{
+    std::vector<double> x;
+    std::vector<double> stiffness;
+    std::vector<double> charges;
+    std::vector<double> inv_sqrt_masses;
+    bool coulomb_enabled;
+
+    /// Hessian blocks of the field map potential (9 values per ion, empty
+    /// without field maps)
+    std::vector<double> field_blocks;
+
+    Crystal(const std::vector<Ion> &ions, const SimParams &params)
+        : x(3 * ions.size()), stiffness(3 * ions.size(), 0.0),
+          coulomb_enabled(params.coulomb_enabled)
+    {
+        for (size_t i = 0; i < ions.size(); i++)
+        {
+            if (params.secular_enabled) {
+                ions[i].secular_stiffness(&stiffness[3*i]);
+            }
+            for (unsigned int j = 0; j < 3; j++) {
+                x[3*i + j] = ions[i].x[j];
+            }
+            charges.push_back(ions[i].Z * constants::q_e);
+            inv_sqrt_masses.push_back(1 / std::sqrt(ions[i].m));
+        }
+
+        if (!params.field_maps.empty() && !ions.empty())
+        {
+            const FieldMap field(std::make_shared<SimParams>(params), ions.front().get_trap());
+            field_blocks.resize(9 * ions.size());
+            #pragma omp parallel for schedule(static)
+            for (size_t i = 0; i < ions.size(); i++)
+            {
+                double H[3][3];
+                field.effective_hessian(&x[3*i], charges[i], ions[i].m, H);
+                std::copy(&H[0][0], &H[0][0] + 9, &field_blocks[9*i]);
+            }
+        }
+    }
+
+    /// Element (a, b) of the field map Hessian block of ion i.
+    double field_block(size_t i, unsigned int a, unsigned int b) const
+    {
+        return field_blocks.empty() ? 0 : field_blocks[9*i + 3*a + b];
+    }
+
+    size_t size() const { return charges.size(); }
+
+    /**
+     * Second derivative of the Coulomb energy of ions i and j with respect
+     * to the position of ion i. The mixed derivative is `-C`.
+     */
+    void coulomb_block(size_t i, size_t j, double C[3][3]) const
+    {
+        const double r[3] = {x[3*i] - x[3*j], x[3*i + 1] - x[3*j + 1], x[3*i + 2] - x[3*j + 2]};
+        const double r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+        const double inv_r = 1 / std::sqrt(r2);
+        const double scale = constants::OOFPEN * charges[i] * charges[j]
+            * inv_r * inv_r * inv_r * inv_r * inv_r;
+        for (unsigned int a = 0; a < 3; a++)
+        {
+            for (unsigned int b = 0; b < 3; b++) {
+                C[a][b] = scale * (3*r[a]*r[b] - (a == b ? r2 : 0));
+            }
+        }
+    }
+
+    /**
+     * Product of the mass-weighted Hessian with `v` without storing the
+     * Hessian.
+     */
+    void multiply(const vec &v, vec &result) const
+    {
+        const size_t n = size();
+        result.set_size(3 * n);
+
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < n; i++)
+        {
+            double y[3];
+            for (unsigned int a = 0; a < 3; a++)
+            {
+                y[a] = stiffness[3*i + a] * v[3*i + a] * inv_sqrt_masses[i];
+                for (unsigned int b = 0; b < 3; b++) {
+                    y[a] += field_block(i, a, b) * v[3*i + b] * inv_sqrt_masses[i];
+                }
+            }
+
+            for (size_t j = 0; coulomb_enabled && j < n; j++)
+            {
+                if (j == i) {
+                    continue;
+                }
+                double C[3][3];
+                coulomb_block(i, j, C);
+                for (unsigned int a = 0; a < 3; a++)
+                {
+                    for (unsigned int b = 0; b < 3; b++)
+                    {
+                        y[a] += C[a][b] * (v[3*i + b] * inv_sqrt_masses[i]
+                                           - v[3*j + b] * inv_sqrt_masses[j]);
+                    }
+                }
+            }
+
+            for (unsigned int a = 0; a < 3; a++) {
+                result[3*i + a] = y[a] * inv_sqrt_masses[i];
+            }
+        }
+    }
+};
+
+
+/// Convert squared angular frequencies to signed angular frequencies.
+double frequency(double omega2)
+{
+    return omega2 < 0 ? -std::sqrt(-omega2) : std::sqrt(omega2);
+}
+
+
+/// Random unit vector orthogonal to `basis`.
+vec random_vector(size_t size, const std::vector<vec> &basis, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> uniform(-1, 1);
+    vec w(size);
+    for (auto &value: w) {
+        value = uniform(rng);
+    }
+    orthogonalize(w, basis);
+    orthogonalize(w, basis);
+    w /= std::sqrt(dot(w, w));
+    return w;
+}
+
+
+/// All modes from the dense mass-weighted Hessian.
+auto dense_modes(const std::vector<Ion> &ions, const SimParams &params,
+                 const Crystal &crystal) -> NormalModes
+{
+    mat D = hessian(ions, params);
+    const size_t n = D.n_rows;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t col = 0; col < n; col++)
+    {
+        for (size_t row = 0; row < n; row++) {
+            D(row, col) *= crystal.inv_sqrt_masses[row / 3] * crystal.inv_sqrt_masses[col / 3];
+        }
+    }
+
+    NormalModes modes;
+    vec omega2;
+    if (!arma::eig_sym(omega2, modes.vectors, D)) {
+        throw std::runtime_error("Eigenvalue decomposition of the Hessian failed");
+    }
+    modes.frequencies.set_size(n);
+    for (size_t i = 0; i < n; i++) {
+        modes.frequencies[i] = frequency(omega2[i]);
+    }
+    return modes;
+}
+
+
+/**
+ * Lowest modes with the Lanczos method. The Krylov space grows until the
+ * residuals of the lowest Ritz pairs are below the tolerance (relative to the
+ * largest Ritz value) or it spans the whole space.
+ */
+auto lanczos_modes(const Crystal &crystal, unsigned int num_modes,
+                   double tolerance) -> NormalModes
+{
+    const size_t n = 3 * crystal.size();
+    std::mt19937 rng(0);
+
+    std::vector<vec> basis;
+    std::vector<double> alpha, beta;
+    basis.push_back(random_vector(n, basis, rng));
+
+    vec w, theta;
+    mat ritz;
+    while (true)
+    {
+        const size_t m = basis.size();
+        crystal.multiply(basis.back(), w);
+        alpha.push_back(dot(basis.back(), w));
+
+        // Reorthogonalizing against the whole basis (twice) keeps the Ritz
+        // values free of spurious copies
+        orthogonalize(w, basis);
+        orthogonalize(w, basis);
+        const double norm = std::sqrt(dot(w, w));
+        beta.push_back(norm);
+
+        const bool complete = m == n;
+        const bool invariant = norm <= 1e-12 * std::abs(alpha.back());
+        if (complete || (m >= num_modes && m % lanczos_check_interval == 0 && !invariant))
+        {
+            mat T(m, m, arma::fill::zeros);
+            for (size_t i = 0; i < m; i++)
+            {
+                T(i, i) = alpha[i];
+                if (i + 1 < m) {
+                    T(i, i + 1) = T(i + 1, i) = beta[i];
+                }
+            }
+            if (!arma::eig_sym(theta, ritz, T)) {
+                throw std::runtime_error("Eigenvalue decomposition of the Lanczos matrix failed");
+            }
+
+            const double scale = std::max(std::abs(theta[0]), std::abs(theta[m - 1]));
+            bool converged = true;
+            for (unsigned int i = 0; i < num_modes; i++) {
+                converged = converged && std::abs(norm * ritz(m - 1, i)) <= tolerance * scale;
+            }
+            if (complete || converged) {
+                break;
+            }
+        }
+
+        if (invariant)
+        {
+            // The Krylov space is closed; continue in a new direction
+            beta.back() = 0;
+            basis.push_back(random_vector(n, basis, rng));
+        }
+        else
+        {
+            w /= norm;
+            basis.push_back(w);
+        }
+    }
+
+    NormalModes modes;
+    modes.frequencies.set_size(num_modes);
+    modes.vectors.zeros(n, num_modes);
+    #pragma omp parallel for schedule(static)
+    for (unsigned int k = 0; k < num_modes; k++)
+    {
+        modes.frequencies[k] = frequency(theta[k]);
+        double *mode = modes.vectors.colptr(k);
+        for (size_t i = 0; i < basis.size(); i++)
+        {
+            for (size_t row = 0; row < n; row++) {
+                mode[row] += ritz(i, k) * basis[i][row];
+            }
+        }
+    }
+    return modes;
+}
+
+}  // namespace
+
+
+auto ionmd::hessian(const std::vector<Ion> &ions, const SimParams &params) -> mat
+{
+    const Crystal crystal(ions, params);
+    const size_t n = crystal.size();
+    mat H(3 * n, 3 * n, arma::fill::zeros);
+
+    if (crystal.coulomb_enabled)
+    {
+        // Each pair of tiles is handled once and writes both off-diagonal
+        // blocks, so no two threads write the same element
+        const size_t num_tiles = (n + hessian_tile - 1) / hessian_tile;
+        std::vector<std::pair<size_t, size_t>> tiles;
+        for (size_t ti = 0; ti < num_tiles; ti++)
+        {
+            for (size_t tj = ti; tj < num_tiles; tj++) {
+                tiles.push_back({ti, tj});
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t t = 0; t < tiles.size(); t++)
+        {
+            const size_t i_end = std::min(n, (tiles[t].first + 1) * hessian_tile);
+            const size_t j_end = std::min(n, (tiles[t].second + 1) * hessian_tile);
+            for (size_t i = tiles[t].first * hessian_tile; i < i_end; i++)
+            {
+                const size_t j_begin = tiles[t].first == tiles[t].second
+                    ? i + 1 : tiles[t].second * hessian_tile;
+                for (size_t j = j_begin; j < j_end; j++)
+                {
+                    double C[3][3];
+                    crystal.coulomb_block(i, j, C);
+                    for (unsigned int a = 0; a < 3; a++)
+                    {
+                        for (unsigned int b = 0; b < 3; b++)
+                        {
+                            H(3*i + a, 3*j + b) = -C[a][b];
+                            H(3*j + b, 3*i + a) = -C[a][b];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Diagonal blocks: the Coulomb part is minus the sum of the off-diagonal
+    // blocks in the same (contiguous) columns, where the diagonal block
+    // itself is still zero
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        for (unsigned int b = 0; b < 3; b++)
+        {
+            const double *column = H.colptr(3*i + b);
+            double sum[3] = {0, 0, 0};
+            for (size_t row = 0; row < 3 * n; row++) {
+                sum[row % 3] += column[row];
+            }
+            for (unsigned int a = 0; a < 3; a++) {
+                H(3*i + a, 3*i + b) = -sum[a] + crystal.field_block(i, a, b);
+            }
+            H(3*i + b, 3*i + b) += crystal.stiffness[3*i + b];
+        }
+    }
+
+    return H;
+}
+
+
+auto ionmd::normal_modes(const std::vector<Ion> &ions, const SimParams &params,
+                         unsigned int num_modes, double tolerance) -> NormalModes
+{
+    if (num_modes > 3 * ions.size()) {
+        throw std::invalid_argument("More modes requested than degrees of freedom");
+    }
+
+    const Crystal crystal(ions, params);
+    if (num_modes == 0) {
+        return dense_modes(ions, params, crystal);
+    }
+    return lanczos_modes(crystal, num_modes, tolerance);
+}
@@ -0,0 +1,250 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+#include <ionmd/mpi_simulation.hpp>
+#include <ionmd/data.hpp>
+#include <ionmd/constants.hpp>
+
+namespace ionmd {
+
+namespace fs = boost::filesystem;
+
+using arma::vec;
+using arma::mat;
+
+
+MPISimulation::MPISimulation(MPI_Comm comm, const SimParams &params,
+                             const Trap &trap, const std::vector<IonSpec> &ions)
+    : comm(comm), num_ions(ions.size())
+{
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    if (num_ions < size_t(num_ranks)) {
+        throw std::invalid_argument("Need at least one ion per rank");
+    }
+    if (!params.field_maps.empty()) {
+        throw std::invalid_argument("MPI simulations don't support field maps");
+    }
+
+    p = std::make_shared<SimParams>(params);
+    this->trap = std::make_shared<Trap>(trap);
+    coulomb.set_tile_sizes(p->coulomb_tile_i, p->coulomb_tile_j);
+    coulomb.set_mixed_precision(p->coulomb_mixed_precision);
+
+    // Contiguous blocks of ions, the first ranks taking one extra ion each
+    const size_t base = num_ions / num_ranks;
+    const size_t extra = num_ions % num_ranks;
+    counts.resize(num_ranks);
+    offsets.resize(num_ranks);
+    for (int r = 0; r < num_ranks; r++)
+    {
+        const size_t start = r*base + std::min<size_t>(r, extra);
+        counts[r] = int(3 * (base + (size_t(r) < extra ? 1 : 0)));
+        offsets[r] = int(3 * start);
+    }
+    first = offsets[rank] / 3;
+
+    positions.set_size(3 * num_ions);
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        const auto &spec = ions[i];
+        if (spec.x0.size() != 3) {
+            throw std::invalid_argument("Ion positions must have 3 components");
+        }
+
+        masses.push_back(spec.m);
+        charges.push_back(spec.Z * constants::q_e);
+        for (unsigned int j = 0; j < 3; j++) {
+            positions[3*i + j] = spec.x0[j];
+        }
+
+        if (i >= first && i < first + counts[rank]/3) {
+            this->ions.push_back(Ion(p, this->trap, spec.lasers, spec.m, spec.Z, spec.x0));
+        }
+    }
+}
+
+
+void MPISimulation::gather_positions()
+{
+    const int local = counts[rank];
+    std::vector<double> buffer(local);
+    for (size_t i = 0; i < ions.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            buffer[3*i + j] = ions[i].x[j];
+        }
+    }
+
+    MPI_Allgatherv(buffer.data(), local, MPI_DOUBLE,
+                   positions.memptr(), counts.data(), offsets.data(), MPI_DOUBLE,
+                   comm);
+}
+
+
+MPI_Offset MPISimulation::write_header()
+{
+    // Only the species and initial positions are needed for the metadata
+    std::vector<Ion> all;
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        all.push_back(Ion(p, trap, masses[i], charges[i] / constants::q_e,
+                          positions.subvec(3*i, 3*i + 2)));
+    }
+    write_metadata(p, trap, all, true);
+
+    const auto header = raw_header(num_ions, p->num_steps);
+    const auto filename = (fs::path(p->path) / "trajectories.bin").string();
+    std::ofstream traj_file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    traj_file << header;
+    traj_file.close();
+    if (!traj_file) {
+        throw std::runtime_error("Unable to write " + filename);
+    }
+    return MPI_Offset(header.size());
+}
+
+
+/// Return true on all ranks if `failed` is true on any rank.
+static bool any_failed(MPI_Comm comm, bool failed)
+{
+    int local = failed ? 1 : 0;
+    int global = 0;
+    MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_LOR, comm);
+    return global != 0;
+}
+
+
+void MPISimulation::run()
+{
+    const int count = counts[rank];
+    const size_t frame_size = 3 * num_ions;
+    const unsigned int buffer_size = p->buffer_size > 0 ? p->buffer_size : 1;
+
+    // Metadata and the trajectory header come from rank 0. All ranks check
+    // the outcome so that none is left waiting in a collective call.
+    MPI_File file = MPI_FILE_NULL;
+    MPI_Datatype slice = MPI_DATATYPE_NULL;
+    MPI_Datatype filetype = MPI_DATATYPE_NULL;
+    if (p->write_output)
+    {
+        MPI_Offset header_size = 0;
+        bool failed = false;
+        if (rank == 0)
+        {
+            try {
+                header_size = write_header();
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Unable to create output: " << e.what() << std::endl;
+                failed = true;
+            }
+        }
+        if (any_failed(comm, failed))
+        {
+            status = SimStatus::ERRORED;
+            return;
+        }
+        MPI_Bcast(&header_size, 1, MPI_OFFSET, 0, comm);
+
+        // Each rank sees only its own slice of every frame
+        const auto filename = (fs::path(p->path) / "trajectories.bin").string();
+        failed = MPI_File_open(comm, filename.c_str(), MPI_MODE_WRONLY,
+                               MPI_INFO_NULL, &file) != MPI_SUCCESS;
+        if (any_failed(comm, failed))
+        {
+            std::cerr << "Unable to open " << filename << std::endl;
+            if (file != MPI_FILE_NULL) {
+                MPI_File_close(&file);
+            }
+            status = SimStatus::ERRORED;
+            return;
+        }
+
+        // Frames are written in units of whole slices so that the element
+        // count stays small however many ions and frames are buffered
+        MPI_Type_contiguous(count, MPI_DOUBLE, &slice);
+        MPI_Type_commit(&slice);
+        MPI_Type_create_resized(slice, 0, MPI_Aint(frame_size * sizeof(double)), &filetype);
+        MPI_Type_commit(&filetype);
+        MPI_File_set_view(file, header_size + offsets[rank]*MPI_Offset(sizeof(double)),
+                          MPI_DOUBLE, filetype, "native", MPI_INFO_NULL);
+    }
+
+    // Local slices of the frames not yet written
+    std::vector<double> frames;
+    if (file != MPI_FILE_NULL) {
+        frames.resize(size_t(buffer_size) * count);
+    }
+    unsigned int buffered = 0;
+
+    auto flush = [&]() {
+        const bool failed = MPI_File_write_all(file, frames.data(), int(buffered),
+                                               slice, MPI_STATUS_IGNORE) != MPI_SUCCESS;
+        buffered = 0;
+        return !any_failed(comm, failed);
+    };
+
+    mat forces = arma::zeros<mat>(3, ions.size());
+    double t = 0;
+    bool ok = true;
+    status = SimStatus::RUNNING;
+
+    for (unsigned int step = 0; step < p->num_steps && ok; step++)
+    {
+        if (p->coulomb_enabled)
+        {
+            coulomb.set_ions(positions, charges);
+            coulomb.compute(forces, nullptr, first, ions.size());
+        }
+
+        #pragma omp parallel for
+        for (unsigned int i = 0; i < ions.size(); i++) {
+            ions[i].update(t, forces, i);
+        }
+
+        gather_positions();
+
+        if (file != MPI_FILE_NULL)
+        {
+            std::copy_n(positions.memptr() + offsets[rank], count,
+                        frames.begin() + size_t(buffered)*count);
+            if (++buffered == buffer_size) {
+                ok = flush();
+            }
+        }
+        t += p->dt;
+    }
+
+    if (file != MPI_FILE_NULL)
+    {
+        if (ok && buffered > 0) {
+            ok = flush();
+        }
+        MPI_File_close(&file);
+        MPI_Type_free(&filetype);
+        MPI_Type_free(&slice);
+    }
+
+    if (!ok)
+    {
+        if (rank == 0) {
+            std::cerr << "Error writing output" << std::endl;
+        }
+        status = SimStatus::ERRORED;
+        return;
+    }
+
+    status = SimStatus::FINISHED;
+}
+
+}  // namespace ionmd
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <ionmd/numa.hpp>
+
+using namespace ionmd;
+
+
+auto ionmd::parse_affinity(const std::string &name) -> Affinity
+{
+    if (name == "none") {
+        return Affinity::NONE;
+    }
+    else if (name == "close") {
+        return Affinity::CLOSE;
+    }
+    else if (name == "spread") {
+        return Affinity::SPREAD;
+    }
+    throw std::invalid_argument("Unknown thread affinity: " + name);
+}
+
+
+/// Parse a sysfs CPU list such as "0-7,16-23".
+static std::vector<int> parse_cpulist(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+        const auto dash = range.find('-');
+        try {
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos
+                ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        catch (const std::logic_error &) {
+            // Empty line or trailing newline
+        }
+    }
+    return cpus;
+}
+
+
+#ifdef __linux__
+/// CPUs of a CPU set in ascending order.
+static std::vector<int> set_cpus(const cpu_set_t &set)
+{
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+
+/// Set the CPUs the calling thread may run on.
+static void set_thread_cpus(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu: cpus) {
+        CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+}
+#endif
+
+
+auto ionmd::numa_nodes() -> std::vector<std::vector<int>>
+{
+    std::vector<std::vector<int>> nodes;
+
+#ifdef __linux__
+    // The mask of the main thread, read once: the calling thread may be
+    // bound to a single CPU by a run in progress
+    static const auto process_cpus = []() -> std::pair<bool, cpu_set_t> {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        const bool ok = sched_getaffinity(getpid(), sizeof(set), &set) == 0;
+        return {ok, set};
+    }();
+    if (!process_cpus.first) {
+        return {{0}};
+    }
+    const cpu_set_t &allowed = process_cpus.second;
+
+    // Node numbers may have gaps (e.g., with memory-only nodes)
+    for (int node = 0, missing = 0; missing < 64; node++)
+    {
+        std::ifstream file("/sys/devices/system/node/node"
+                           + std::to_string(node) + "/cpulist");
+        if (!file)
+        {
+            missing++;
+            continue;
+        }
+        missing = 0;
+
+        std::string list;
+        std::getline(file, list);
+        std::vector<int> cpus;
+        for (const auto cpu: parse_cpulist(list))
+        {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty()) {
+            nodes.push_back(cpus);
+        }
+    }
+
+    if (nodes.empty()) {
+        nodes.push_back(set_cpus(allowed));
+    }
+#else
+    nodes.push_back({0});
+#endif
+
+    return nodes;
+}
+
+
+auto ionmd::thread_cpus() -> std::vector<int>
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return set_cpus(set);
+    }
+#endif
+    return {0};
+}
+
+
+auto ionmd::bind_threads(Affinity affinity) -> std::vector<std::vector<int>>
+{
+    std::vector<std::vector<int>> previous;
+#ifdef _OPENMP
+    if (omp_in_parallel()) {
+        return previous;
+    }
+#endif
+    if (affinity == Affinity::NONE) {
+        return previous;
+    }
+
+#ifdef __linux__
+    const auto nodes = numa_nodes();
+
+    // CPUs in the order in which threads are assigned to them
+    std::vector<int> cpus;
+    if (affinity == Affinity::CLOSE)
+    {
+        for (const auto &node: nodes) {
+            cpus.insert(cpus.end(), node.begin(), node.end());
+        }
+    }
+    else
+    {
+        size_t largest = 0;
+        for (const auto &node: nodes) {
+            largest = std::max(largest, node.size());
+        }
+        for (size_t i = 0; i < largest; i++)
+        {
+            for (const auto &node: nodes)
+            {
+                if (i < node.size()) {
+                    cpus.push_back(node[i]);
+                }
+            }
+        }
+    }
+
+#ifdef _OPENMP
+    previous.resize(omp_get_max_threads());
+#else
+    previous.resize(1);
+#endif
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        const size_t thread = omp_get_thread_num();
+#else
+        const size_t thread = 0;
+#endif
+        if (thread < previous.size())
+        {
+            previous[thread] = thread_cpus();
+            set_thread_cpus({cpus[thread % cpus.size()]});
+        }
+    }
+#endif
+    return previous;
+}
+
+
+void ionmd::restore_threads(const std::vector<std::vector<int>> &cpus)
+{
+    if (cpus.empty()) {
+        return;
+    }
+
+#ifdef __linux__
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        const size_t thread = omp_get_thread_num();
+#else
+        const size_t thread = 0;
+#endif
+        if (thread < cpus.size() && !cpus[thread].empty()) {
+            set_thread_cpus(cpus[thread]);
+        }
+    }
+#endif
+}
+
+
+void ionmd::first_touch(void *data, size_t count, size_t size)
+{
+    auto bytes = static_cast<char *>(data);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < count; i++) {
+        std::memset(bytes + i*size, 0, size);
+    }
+}
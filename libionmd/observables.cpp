@@ -0,0 +1,308 @@
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include <ionmd/observables.hpp>
+#include <ionmd/constants.hpp>
+#include <ionmd/serialize.hpp>
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+
+
+Observables::Observables(params_ptr params, const std::vector<Ion> &ions,
+                         const std::vector<std::pair<double, double>> &products,
+                         std::istream *state)
+    : p(params), num_slots(ions.size())
+{
+    for (const auto &name: p->observables)
+    {
+        if (name == "kinetic_energy") {
+            kinetic = true;
+        }
+        else if (name == "trap_energy") {
+            trap_energy = true;
+        }
+        else if (name == "coulomb_energy") {
+            coulomb = true;
+        }
+        else if (name == "total_energy") {
+            total = true;
+        }
+        else if (name == "temperature") {
+            temperature = true;
+        }
+        else if (name == "species_temperature") {
+            species_temperature = true;
+        }
+        else if (name == "msd") {
+            msd = true;
+        }
+        else if (name == "structure_factor") {
+            structure_factor = true;
+            if (p->structure_factor_k.size() != 3) {
+                throw std::invalid_argument("structure_factor_k must have 3 components");
+            }
+        }
+        else {
+            throw std::invalid_argument("Unknown observable: " + name);
+        }
+    }
+
+    // Species keep their columns when continuing a run
+    uint64_t offset = 0;
+    if (state != nullptr)
+    {
+        serialize::get(*state, offset);
+        serialize::get(*state, reference);
+        serialize::get(*state, species_params);
+        if (!reference.is_empty() && (reference.n_rows != 3 || reference.n_cols != num_slots)) {
+            throw std::runtime_error("Observables in checkpoint don't match the ions");
+        }
+    }
+    const size_t saved_species = species_params.size();
+
+    // Group ions into species by mass and charge
+    for (const auto &ion: ions) {
+        add_species(ion.m, ion.Z);
+    }
+    for (const auto &product: products) {
+        add_species(product.first, product.second);
+    }
+
+    fs::path filename = p->path;
+    filename /= "observables.csv";
+    if (state != nullptr)
+    {
+        if (species_temperature && species_params.size() != saved_species) {
+            throw std::runtime_error("Species changed since the checkpoint");
+        }
+        if (!fs::exists(filename) || fs::file_size(filename) < offset) {
+            throw std::runtime_error(filename.string() + " is shorter than at the checkpoint");
+        }
+        fs::resize_file(filename, offset);
+        out.open(filename.c_str(), std::ios::out | std::ios::app);
+        if (!out) {
+            throw std::runtime_error("Unable to open " + filename.string());
+        }
+        out.precision(12);
+        return;
+    }
+
+    out.open(filename.c_str());
+    if (!out) {
+        throw std::runtime_error("Unable to open " + filename.string());
+    }
+
+    for (size_t i = 0; i < species_params.size(); i++) {
+        out << "# species " << i << ": m = " << species_params[i].first
+            << ", Z = " << species_params[i].second << "\n";
+    }
+    out << "step,t";
+    for (const auto &column: columns()) {
+        out << "," << column;
+    }
+    out << "\n";
+    out.precision(12);
+}
+
+
+void Observables::save(std::ostream &state)
+{
+    out.flush();
+    out.seekp(0, std::ios::end);
+    if (!out) {
+        throw std::runtime_error("Error writing observables");
+    }
+    serialize::put<uint64_t>(state, out.tellp());
+    serialize::put(state, reference);
+    serialize::put(state, species_params);
+}
+
+
+void Observables::add_species(double m, double Z)
+{
+    if (species_index(m, Z) == species_params.size()) {
+        species_params.push_back({m, Z});
+    }
+}
+
+
+auto Observables::species_index(double m, double Z) const -> unsigned int
+{
+    unsigned int index = 0;
+    while (index < species_params.size()
+           && (species_params[index].first != m || species_params[index].second != Z))
+    {
+        index++;
+    }
+    return index;
+}
+
+
+auto Observables::columns() const -> std::vector<std::string>
+{
+    std::vector<std::string> names;
+
+    if (kinetic) {
+        names.push_back("kinetic_energy");
+    }
+    if (trap_energy) {
+        names.push_back("trap_energy");
+    }
+    if (coulomb) {
+        names.push_back("coulomb_energy");
+    }
+    if (total) {
+        names.push_back("total_energy");
+    }
+    if (temperature) {
+        names.push_back("temperature");
+    }
+    if (species_temperature)
+    {
+        for (size_t i = 0; i < species_params.size(); i++) {
+            names.push_back("temperature_" + std::to_string(i));
+        }
+    }
+    if (msd) {
+        names.push_back("msd");
+    }
+    if (structure_factor) {
+        names.push_back("structure_factor");
+    }
+
+    return names;
+}
+
+
+void Observables::write_average(double sum, unsigned int count)
+{
+    out << ",";
+    if (count > 0) {
+        out << sum / count;
+    }
+}
+
+
+void Observables::record(unsigned int step, double t,
+                         const std::vector<Ion> &ions,
+                         const std::vector<size_t> &ids,
+                         const arma::vec &coulomb_energies,
+                         const FieldMap *field)
+{
+    const unsigned int num_ions = ions.size();
+
+    // Ions get their reference position when they are first recorded
+    if (msd && reference.is_empty())
+    {
+        reference.set_size(3, num_slots);
+        reference.fill(std::numeric_limits<double>::quiet_NaN());
+    }
+
+    const bool energies = kinetic || trap_energy || coulomb || total;
+    const double kx = structure_factor ? p->structure_factor_k[0] : 0;
+    const double ky = structure_factor ? p->structure_factor_k[1] : 0;
+    const double kz = structure_factor ? p->structure_factor_k[2] : 0;
+
+    double kinetic_sum = 0;
+    double trap_sum = 0;
+    double coulomb_sum = 0;
+    double square_displacement = 0;
+    double sk_re = 0;
+    double sk_im = 0;
+
+    const unsigned int num_species = species_params.size();
+    std::vector<double> species_kinetic(num_species, 0);
+    std::vector<unsigned int> species_count(num_species, 0);
+    double *species_kinetic_ptr = species_kinetic.data();
+    unsigned int *species_count_ptr = species_count.data();
+
+    // Species are counted every time since ions may have left the trap,
+    // been loaded or reacted
+    #pragma omp parallel for \
+        reduction(+: kinetic_sum, trap_sum, coulomb_sum, square_displacement, sk_re, sk_im) \
+        reduction(+: species_kinetic_ptr[:num_species], species_count_ptr[:num_species])
+    for (unsigned int i = 0; i < num_ions; i++)
+    {
+        const auto &ion = ions[i];
+        const double ke = 0.5 * ion.m * arma::dot(ion.v, ion.v);
+
+        kinetic_sum += ke;
+        const unsigned int s = species_index(ion.m, ion.Z);
+        if (s < num_species)
+        {
+            species_kinetic_ptr[s] += ke;
+            species_count_ptr[s]++;
+        }
+
+        if (energies)
+        {
+            trap_sum += ion.secular_energy();
+            if (field) {
+                trap_sum += ion.Z * constants::q_e * field->potential(t, ion.x.memptr());
+            }
+            coulomb_sum += coulomb_energies[i];
+        }
+
+        if (msd)
+        {
+            double *r = reference.colptr(ids[i]);
+            if (std::isnan(r[0]))
+            {
+                for (unsigned int j = 0; j < 3; j++) {
+                    r[j] = ion.x[j];
+                }
+            }
+            for (unsigned int j = 0; j < 3; j++) {
+                const double dx = ion.x[j] - r[j];
+                square_displacement += dx * dx;
+            }
+        }
+
+        if (structure_factor)
+        {
+            const double phase = kx*ion.x[0] + ky*ion.x[1] + kz*ion.x[2];
+            sk_re += std::cos(phase);
+            sk_im += std::sin(phase);
+        }
+    }
+
+    // Every pair was counted once from each side
+    coulomb_sum /= 2;
+
+    out << step << "," << t;
+    if (kinetic) {
+        out << "," << kinetic_sum;
+    }
+    if (trap_energy) {
+        out << "," << trap_sum;
+    }
+    if (coulomb) {
+        out << "," << coulomb_sum;
+    }
+    if (total) {
+        out << "," << kinetic_sum + trap_sum + coulomb_sum;
+    }
+    // Averages over no ions are left empty
+    if (temperature) {
+        write_average(2*kinetic_sum / (3*constants::kB), num_ions);
+    }
+    if (species_temperature)
+    {
+        for (unsigned int i = 0; i < num_species; i++) {
+            write_average(2*species_kinetic[i] / (3*constants::kB), species_count[i]);
+        }
+    }
+    if (msd) {
+        write_average(square_displacement, num_ions);
+    }
+    if (structure_factor) {
+        write_average(sk_re*sk_re + sk_im*sk_im, num_ions);
+    }
+    out << "\n";
+
+    if (!out) {
+        throw std::runtime_error("Error writing observables");
+    }
+}
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <json.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <ionmd/perf.hpp>
+
+using namespace ionmd;
+
+
+namespace {
+
+#ifdef __linux__
+
+/// Look up the perf type and config of an event name.
+void parse_event(const std::string &name, __u32 &type, __u64 &config)
+{
+    static const std::map<std::string, uint64_t> hardware = {
+        {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+        {"cache-references", PERF_COUNT_HW_CACHE_REFERENCES},
+        {"cache-misses", PERF_COUNT_HW_CACHE_MISSES},
+        {"branch-misses", PERF_COUNT_HW_BRANCH_MISSES}
+    };
+    static const std::map<std::string, uint64_t> cache = {
+        {"l1d-read-misses", PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {"llc-read-misses", PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+    };
+    static const std::map<std::string, uint64_t> software = {
+        {"task-clock", PERF_COUNT_SW_TASK_CLOCK},
+        {"page-faults", PERF_COUNT_SW_PAGE_FAULTS}
+    };
+
+    if (hardware.count(name)) {
+        type = PERF_TYPE_HARDWARE;
+        config = hardware.at(name);
+    }
+    else if (cache.count(name)) {
+        type = PERF_TYPE_HW_CACHE;
+        config = cache.at(name);
+    }
+    else if (software.count(name)) {
+        type = PERF_TYPE_SOFTWARE;
+        config = software.at(name);
+    }
+    else if (name.size() > 1 && name[0] == 'r'
+             && name.find_first_not_of("0123456789abcdefABCDEF", 1) == std::string::npos)
+    {
+        type = PERF_TYPE_RAW;
+        config = std::stoull(name.substr(1), nullptr, 16);
+    }
+    else {
+        throw std::runtime_error("Unknown performance counter event: " + name);
+    }
+}
+
+
+/// Open a counter for the calling thread.
+int open_counter(const std::string &name, int group)
+{
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    parse_event(name, attr.type, attr.config);
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP
+        | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open performance counter " + name
+                                 + ": " + std::strerror(errno));
+    }
+    return int(fd);
+}
+
+#endif
+
+}  // namespace
+
+
+auto PerfCounters::default_events() -> std::vector<std::string>
+{
+    return {"cycles", "instructions", "cache-misses", "l1d-read-misses"};
+}
+
+
+auto PerfCounters::environment_events() -> std::vector<std::string>
+{
+    const char *value = std::getenv("IONMD_PERF_EVENTS");
+    if (value == nullptr || std::string(value).empty()) {
+        return {};
+    }
+    if (std::string(value) == "1" || std::string(value) == "default") {
+        return default_events();
+    }
+
+    std::vector<std::string> events;
+    std::stringstream stream(value);
+    std::string event;
+    while (std::getline(stream, event, ','))
+    {
+        if (!event.empty()) {
+            events.push_back(event);
+        }
+    }
+    return events;
+}
+
+
+PerfCounters::PerfCounters(const std::vector<std::string> &events)
+    : events(events)
+{
+    if (events.empty()) {
+        throw std::runtime_error("No performance counter events given");
+    }
+
+#ifdef __linux__
+#ifdef _OPENMP
+    const int num_threads = omp_get_max_threads();
+#else
+    const int num_threads = 1;
+#endif
+    fds.resize(num_threads);
+    std::string error;
+
+    // Counters only count the thread that opened them, so every thread of
+    // the OpenMP pool opens its own group.
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef _OPENMP
+        auto &group = fds[omp_get_thread_num()];
+#else
+        auto &group = fds[0];
+#endif
+        try {
+            for (const auto &event: events) {
+                group.push_back(open_counter(event, group.empty() ? -1 : group[0]));
+            }
+        }
+        catch (const std::exception &e)
+        {
+            #pragma omp critical
+            error = e.what();
+        }
+    }
+
+    // The team can be smaller than requested (in a nested region or with
+    // OMP_DYNAMIC); slots of threads that didn't run have no group
+    fds.erase(std::remove_if(fds.begin(), fds.end(),
+                             [](const std::vector<int> &group) { return group.empty(); }),
+              fds.end());
+
+    if (!error.empty())
+    {
+        close();
+        throw std::runtime_error(error);
+    }
+
+    for (const auto &group: fds)
+    {
+        ioctl(group[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(group[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    throw std::runtime_error("Performance counters require Linux");
+#endif
+
+    start.assign(events.size(), 0);
+    reset();
+}
+
+
+PerfCounters::~PerfCounters()
+{
+    close();
+}
+
+
+void PerfCounters::close()
+{
+#ifdef __linux__
+    for (const auto &group: fds)
+    {
+        for (const auto fd: group) {
+            ::close(fd);
+        }
+    }
+#endif
+    fds.clear();
+}
+
+
+void PerfCounters::reset()
+{
+    for (auto &phase: counts) {
+        phase.assign(events.size(), 0);
+    }
+}
+
+
+void PerfCounters::read(std::vector<double> &values) const
+{
+    values.assign(events.size(), 0);
+
+#ifdef __linux__
+    // Layout of PERF_FORMAT_GROUP with enabled and running times
+    std::vector<uint64_t> buffer(3 + events.size());
+    for (const auto &group: fds)
+    {
+        if (group.empty()) {
+            continue;
+        }
+        const auto size = ::read(group[0], buffer.data(), buffer.size() * sizeof(uint64_t));
+        if (size < ssize_t(buffer.size() * sizeof(uint64_t))) {
+            continue;
+        }
+
+        const double enabled = double(buffer[1]);
+        const double running = double(buffer[2]);
+        const double scale = running > 0 ? enabled / running : 0;
+        for (size_t i = 0; i < events.size(); i++) {
+            values[i] += buffer[3 + i] * scale;
+        }
+    }
+#endif
+}
+
+
+void PerfCounters::begin()
+{
+    read(start);
+}
+
+
+void PerfCounters::end(Phase phase)
+{
+    std::vector<double> values;
+    read(values);
+    auto &phase_counts = counts[static_cast<size_t>(phase)];
+    for (size_t i = 0; i < events.size(); i++) {
+        phase_counts[i] += values[i] - start[i];
+    }
+}
+
+
+auto PerfCounters::totals() const -> std::map<std::string, std::map<std::string, double>>
+{
+    std::map<std::string, std::map<std::string, double>> result;
+    for (size_t p = 0; p < num_phases; p++)
+    {
+        auto &phase = result[Profiler::phase_name(static_cast<Phase>(p))];
+        for (size_t i = 0; i < events.size(); i++) {
+            phase[events[i]] = counts[p][i];
+        }
+    }
+    return result;
+}
+
+
+auto PerfCounters::report() const -> std::string
+{
+    const auto totals = this->totals();
+    const bool ipc = totals.begin()->second.count("cycles")
+        && totals.begin()->second.count("instructions");
+
+    std::stringstream stream;
+    stream << "Performance counters:\n  " << std::left << std::setw(12) << "phase";
+    for (const auto &event: events) {
+        stream << std::right << std::setw(18) << event;
+    }
+    if (ipc) {
+        stream << std::setw(8) << "IPC";
+    }
+    stream << "\n";
+
+    for (const auto &phase: totals)
+    {
+        stream << "  " << std::left << std::setw(12) << phase.first << std::right;
+        for (const auto &event: events) {
+            stream << std::setw(18) << std::fixed << std::setprecision(0)
+                   << phase.second.at(event);
+        }
+        if (ipc)
+        {
+            const double cycles = phase.second.at("cycles");
+            stream << std::setw(8) << std::setprecision(2)
+                   << (cycles > 0 ? phase.second.at("instructions") / cycles : 0);
+        }
+        stream << "\n";
+    }
+    return stream.str();
+}
+
+
+auto PerfCounters::to_json() const -> std::string
+{
+    nlohmann::json j = totals();
+    return j.dump(2);
+}
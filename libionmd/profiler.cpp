@@ -0,0 +1,157 @@
+#include <iomanip>
+#include <sstream>
+#include <json.hpp>
+
+#include <ionmd/profiler.hpp>
+#include <ionmd/perf.hpp>
+
+using namespace ionmd;
+
+
+Profiler::Profiler()
+{
+    reset();
+}
+
+
+Profiler::Profiler(const Profiler &other)
+{
+    *this = other;
+}
+
+
+Profiler &Profiler::operator=(const Profiler &other)
+{
+    for (size_t i = 0; i < num_phases; i++)
+    {
+        nanoseconds[i] = other.nanoseconds[i].load();
+        calls[i] = other.calls[i].load();
+    }
+    run_nanoseconds = other.run_nanoseconds.load();
+    steps = other.steps.load();
+    return *this;
+}
+
+
+auto Profiler::phase_name(Phase phase) -> std::string
+{
+    switch (phase)
+    {
+    case Phase::EVENTS:
+        return "events";
+    case Phase::REORDER:
+        return "reorder";
+    case Phase::COULOMB:
+        return "coulomb";
+    case Phase::FIELD:
+        return "field";
+    case Phase::OBSERVABLES:
+        return "observables";
+    case Phase::INTEGRATION:
+        return "integration";
+    case Phase::OUTPUT:
+        return "output";
+    case Phase::CHECKPOINT:
+        return "checkpoint";
+    default:
+        return "unknown";
+    }
+}
+
+
+void Profiler::reset()
+{
+    for (size_t i = 0; i < num_phases; i++)
+    {
+        nanoseconds[i] = 0;
+        calls[i] = 0;
+    }
+    run_nanoseconds = 0;
+    steps = 0;
+}
+
+
+void Profiler::perf_begin()
+{
+    perf->begin();
+}
+
+
+void Profiler::perf_end(Phase phase)
+{
+    perf->end(phase);
+}
+
+
+void Profiler::set_run(double seconds, uint64_t steps)
+{
+    run_nanoseconds = int64_t(seconds * 1e9);
+    this->steps = steps;
+}
+
+
+double Profiler::seconds(Phase phase) const
+{
+    return nanoseconds[static_cast<size_t>(phase)].load(std::memory_order_relaxed) * 1e-9;
+}
+
+
+auto Profiler::totals() const -> std::map<std::string, double>
+{
+    std::map<std::string, double> result;
+    for (size_t i = 0; i < num_phases; i++)
+    {
+        const auto phase = static_cast<Phase>(i);
+        result[phase_name(phase)] = seconds(phase);
+    }
+    result["run"] = run_nanoseconds.load() * 1e-9;
+    return result;
+}
+
+
+auto Profiler::report() const -> std::string
+{
+    const double run = run_nanoseconds.load() * 1e-9;
+
+    std::stringstream stream;
+    stream << "Phase timing (" << steps.load() << " steps, "
+           << run << " s):\n";
+    for (size_t i = 0; i < num_phases; i++)
+    {
+        const auto phase = static_cast<Phase>(i);
+        const double s = seconds(phase);
+        stream << "  " << std::left << std::setw(12) << phase_name(phase)
+               << std::right << std::setw(12) << s << " s"
+               << std::setw(8) << std::fixed << std::setprecision(1)
+               << (run > 0 ? 100 * s / run : 0) << " %\n"
+               << std::defaultfloat << std::setprecision(6);
+    }
+    return stream.str();
+}
+
+
+auto Profiler::to_json() const -> std::string
+{
+    using nlohmann::json;
+    const uint64_t num_steps = steps.load();
+
+    json phases;
+    for (size_t i = 0; i < num_phases; i++)
+    {
+        const auto phase = static_cast<Phase>(i);
+        const double s = seconds(phase);
+        phases[phase_name(phase)] = {
+            {"seconds", s},
+            {"calls", calls[i].load()},
+            {"seconds_per_step", num_steps > 0 ? s / num_steps : 0}
+        };
+    }
+
+    json j = {
+        {"enabled", enabled()},
+        {"steps", num_steps},
+        {"run_seconds", run_nanoseconds.load() * 1e-9},
+        {"phases", phases}
+    };
+    return j.dump(2);
+}
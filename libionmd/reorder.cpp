@@ -0,0 +1,131 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include <ionmd/reorder.hpp>
+
+using namespace ionmd;
+
+
+auto ionmd::parse_curve(const std::string &name) -> Curve
+{
+    if (name == "morton") {
+        return Curve::MORTON;
+    }
+    else if (name == "hilbert") {
+        return Curve::HILBERT;
+    }
+    throw std::invalid_argument("Unknown space-filling curve: " + name);
+}
+
+
+/// Interleave the bits of three coordinates, x being most significant.
+static uint64_t interleave(uint32_t x, uint32_t y, uint32_t z)
+{
+    uint64_t key = 0;
+    for (int bit = curve_bits - 1; bit >= 0; bit--)
+    {
+        key = (key << 3)
+            | (uint64_t((x >> bit) & 1) << 2)
+            | (uint64_t((y >> bit) & 1) << 1)
+            | uint64_t((z >> bit) & 1);
+    }
+    return key;
+}
+
+
+uint64_t ionmd::morton_key(uint32_t x, uint32_t y, uint32_t z)
+{
+    return interleave(x, y, z);
+}
+
+
+uint64_t ionmd::hilbert_key(uint32_t x, uint32_t y, uint32_t z)
+{
+    // Transform the coordinates into the transposed Hilbert index (J.
+    // Skilling, AIP Conf. Proc. 707, 381 (2004)), whose interleaved bits are
+    // the position along the curve.
+    uint32_t X[3] = {x, y, z};
+    const uint32_t M = 1u << (curve_bits - 1);
+
+    for (uint32_t Q = M; Q > 1; Q >>= 1)
+    {
+        const uint32_t P = Q - 1;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            if (X[i] & Q) {
+                X[0] ^= P;
+            }
+            else {
+                const uint32_t t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for (unsigned int i = 1; i < 3; i++) {
+        X[i] ^= X[i - 1];
+    }
+    uint32_t t = 0;
+    for (uint32_t Q = M; Q > 1; Q >>= 1)
+    {
+        if (X[2] & Q) {
+            t ^= Q - 1;
+        }
+    }
+    for (unsigned int i = 0; i < 3; i++) {
+        X[i] ^= t;
+    }
+
+    return interleave(X[0], X[1], X[2]);
+}
+
+
+auto ionmd::spatial_order(const std::vector<Ion> &ions, Curve curve) -> std::vector<size_t>
+{
+    const size_t n = ions.size();
+
+    // Bounding box, mapped onto the grid with the same scale in all
+    // directions so that distances along the curve stay isotropic
+    double lo[3], hi[3];
+    std::fill_n(lo, 3, std::numeric_limits<double>::max());
+    std::fill_n(hi, 3, std::numeric_limits<double>::lowest());
+    for (const auto &ion: ions)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            lo[j] = std::min(lo[j], ion.x[j]);
+            hi[j] = std::max(hi[j], ion.x[j]);
+        }
+    }
+    const double extent = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]});
+    const double scale = extent > 0 ? ((1u << curve_bits) - 1) / extent : 0;
+
+    std::vector<std::pair<uint64_t, size_t>> keys(n);
+
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t c[3];
+        for (unsigned int j = 0; j < 3; j++) {
+            c[j] = uint32_t((ions[i].x[j] - lo[j]) * scale);
+        }
+        const uint64_t key = curve == Curve::HILBERT
+            ? hilbert_key(c[0], c[1], c[2])
+            : morton_key(c[0], c[1], c[2]);
+        keys[i] = {key, i};
+    }
+
+    // Ties are broken by index so the order is deterministic
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = keys[i].second;
+    }
+    return order;
+}
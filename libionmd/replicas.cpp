@@ -0,0 +1,274 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <ionmd/replicas.hpp>
+#include <ionmd/constants.hpp>
+
+using namespace ionmd;
+
+
+ReplicaBatch::ReplicaBatch(const SimParams &params, const Trap &trap,
+                           const std::vector<IonSpec> &ions, size_t num_replicas)
+    : params(params), num_ions(ions.size()), num_replicas(num_replicas),
+      num_blocks((num_replicas + lanes - 1) / lanes)
+{
+    if (num_ions == 0 || num_replicas == 0) {
+        throw std::invalid_argument("Replica batches need ions and replicas");
+    }
+    if (!params.field_maps.empty()) {
+        throw std::invalid_argument("Replica batches don't support field maps");
+    }
+
+    const size_t size = num_blocks * num_ions * 3 * lanes;
+    x.assign(size, 0);
+    v.assign(size, 0);
+    a.assign(size, 0);
+    k_radial.assign(num_blocks * num_ions * lanes, 0);
+    k_axial.assign(num_blocks * num_ions * lanes, 0);
+    doppler_force.assign(3 * num_ions, 0);
+    doppler_beta.assign(num_ions, 0);
+
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        const auto &ion = ions[i];
+        if (ion.x0.size() != 3) {
+            throw std::invalid_argument("Ion positions must have 3 components");
+        }
+
+        mass.push_back(ion.m);
+        charge.push_back(ion.Z * constants::q_e);
+
+        for (const auto &laser: ion.lasers)
+        {
+            for (unsigned int j = 0; j < 3; j++) {
+                doppler_force[3*i + j] += laser->F0 * laser->wave_vector[j];
+            }
+            doppler_beta[i] += laser->beta;
+        }
+
+        // Padding lanes of the last block get the same state as real replicas
+        // so that they never produce NaNs.
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            for (unsigned int j = 0; j < 3; j++) {
+                std::fill_n(&x[index(b, i, j)], lanes, ion.x0[j]);
+            }
+        }
+    }
+
+    for (size_t b = 0; b < num_blocks; b++)
+    {
+        for (unsigned int l = 0; l < lanes; l++) {
+            set_trap(b*lanes + l, trap);
+        }
+    }
+}
+
+
+void ReplicaBatch::set_trap(size_t replica, const Trap &trap)
+{
+    if (replica >= num_blocks * lanes) {
+        throw std::out_of_range("Replica index out of range");
+    }
+    const size_t block = replica / lanes;
+    const size_t lane = replica % lanes;
+
+    // Same potential as Ion::secular_force
+    const double B = trap.kappa*trap.U_ec/(2*pow(trap.z0, 2));
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        const double q = charge[i];
+        const double A = q*pow(trap.V_rf, 2)/(mass[i]*pow(trap.omega_rf, 2)*pow(trap.r0, 4));
+        k_radial[(block*num_ions + i)*lanes + lane] = 2*q*(A - B);
+        k_axial[(block*num_ions + i)*lanes + lane] = 4*q*B;
+    }
+}
+
+
+void ReplicaBatch::set_state(size_t replica, size_t ion, const arma::vec &x,
+                             const arma::vec &v)
+{
+    if (replica >= num_replicas || ion >= num_ions) {
+        throw std::out_of_range("Replica or ion index out of range");
+    }
+    const size_t block = replica / lanes;
+    const size_t lane = replica % lanes;
+
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        this->x[index(block, ion, j) + lane] = x[j];
+        this->v[index(block, ion, j) + lane] = v[j];
+    }
+}
+
+
+auto ReplicaBatch::get_positions(size_t replica) const -> arma::mat
+{
+    if (replica >= num_replicas) {
+        throw std::out_of_range("Replica index out of range");
+    }
+    arma::mat result(3, num_ions);
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            result(j, i) = x[index(replica / lanes, i, j) + replica % lanes];
+        }
+    }
+    return result;
+}
+
+
+auto ReplicaBatch::get_velocities(size_t replica) const -> arma::mat
+{
+    if (replica >= num_replicas) {
+        throw std::out_of_range("Replica index out of range");
+    }
+    arma::mat result(3, num_ions);
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            result(j, i) = v[index(replica / lanes, i, j) + replica % lanes];
+        }
+    }
+    return result;
+}
+
+
+double ReplicaBatch::kinetic_energy(size_t replica) const
+{
+    const auto velocities = get_velocities(replica);
+    double energy = 0;
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            energy += 0.5 * mass[i] * velocities(j, i) * velocities(j, i);
+        }
+    }
+    return energy;
+}
+
+
+void ReplicaBatch::compute_forces(size_t block, double *F) const
+{
+    const size_t stride = 3 * lanes;
+    const double *xb = &x[index(block, 0)];
+    const double *vb = &v[index(block, 0)];
+    std::fill_n(F, num_ions * stride, 0.0);
+
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        const double *xi = xb + i*stride;
+        double *Fi = F + i*stride;
+
+        if (params.secular_enabled)
+        {
+            const double *kr = &k_radial[(block*num_ions + i)*lanes];
+            const double *kz = &k_axial[(block*num_ions + i)*lanes];
+
+            #pragma omp simd
+            for (unsigned int l = 0; l < lanes; l++)
+            {
+                Fi[l] -= kr[l] * xi[l];
+                Fi[lanes + l] -= kr[l] * xi[lanes + l];
+                Fi[2*lanes + l] -= kz[l] * xi[2*lanes + l];
+            }
+        }
+
+        if (params.doppler_enabled)
+        {
+            const double *vi = vb + i*stride;
+            const double beta = doppler_beta[i];
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                const double F0 = doppler_force[3*i + j];
+
+                #pragma omp simd
+                for (unsigned int l = 0; l < lanes; l++) {
+                    Fi[j*lanes + l] += F0 - beta * vi[j*lanes + l];
+                }
+            }
+        }
+
+        if (!params.coulomb_enabled) {
+            continue;
+        }
+
+        // Each pair once, applying Newton's third law
+        for (size_t k = i + 1; k < num_ions; k++)
+        {
+            const double *xk = xb + k*stride;
+            double *Fk = F + k*stride;
+            const double kq = constants::OOFPEN * charge[i] * charge[k];
+
+            #pragma omp simd
+            for (unsigned int l = 0; l < lanes; l++)
+            {
+                const double dx = xi[l] - xk[l];
+                const double dy = xi[lanes + l] - xk[lanes + l];
+                const double dz = xi[2*lanes + l] - xk[2*lanes + l];
+                const double r2 = dx*dx + dy*dy + dz*dz;
+                const double f = kq / (r2 * std::sqrt(r2));
+
+                Fi[l] += f * dx;
+                Fi[lanes + l] += f * dy;
+                Fi[2*lanes + l] += f * dz;
+                Fk[l] -= f * dx;
+                Fk[lanes + l] -= f * dy;
+                Fk[2*lanes + l] -= f * dz;
+            }
+        }
+    }
+}
+
+
+void ReplicaBatch::step(size_t block, double *F)
+{
+    const size_t stride = 3 * lanes;
+    const size_t size = num_ions * stride;
+    const double dt = params.dt;
+    double *xb = &x[index(block, 0)];
+    double *vb = &v[index(block, 0)];
+    double *ab = &a[index(block, 0)];
+
+    #pragma omp simd
+    for (size_t n = 0; n < size; n++) {
+        xb[n] += vb[n]*dt + 0.5*ab[n]*dt*dt;
+    }
+
+    compute_forces(block, F);
+
+    for (size_t i = 0; i < num_ions; i++)
+    {
+        const double inv_m = 1 / mass[i];
+        double *vi = vb + i*stride;
+        double *ai = ab + i*stride;
+        const double *Fi = F + i*stride;
+
+        #pragma omp simd
+        for (size_t n = 0; n < stride; n++)
+        {
+            const double accel = Fi[n] * inv_m;
+            vi[n] += 0.5*(ai[n] + accel)*dt;
+            ai[n] = accel;
+        }
+    }
+}
+
+
+void ReplicaBatch::run(unsigned int num_steps)
+{
+    #pragma omp parallel
+    {
+        std::vector<double> F(num_ions * 3 * lanes);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            for (unsigned int n = 0; n < num_steps; n++) {
+                step(b, F.data());
+            }
+        }
+    }
+
+    t += num_steps * params.dt;
+}
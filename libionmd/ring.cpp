@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <cstring>
+#include <ionmd/ring.hpp>
+
+using namespace ionmd;
+
+
+FrameRing::FrameRing(size_t frame_size, size_t capacity)
+    : frame_size(frame_size), capacity(capacity > 0 ? capacity : 1),
+      frames(frame_size, this->capacity), steps(this->capacity), count(0)
+{
+}
+
+
+size_t FrameRing::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::min<uint64_t>(count, capacity);
+}
+
+
+void FrameRing::push(unsigned int step, const arma::vec &frame)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const size_t slot = count % capacity;
+    std::memcpy(frames.colptr(slot), frame.memptr(), frame_size * sizeof(double));
+    steps[slot] = step;
+    count++;
+}
+
+
+size_t FrameRing::copy_latest(double *positions, unsigned int *step_indices,
+                              size_t max_frames) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const size_t available = std::min<uint64_t>(count, capacity);
+    const size_t num_frames = std::min(available, max_frames);
+    const uint64_t first = count - num_frames;
+
+    for (size_t n = 0; n < num_frames; n++)
+    {
+        const size_t slot = (first + n) % capacity;
+        std::memcpy(positions + n*frame_size, frames.colptr(slot),
+                    frame_size * sizeof(double));
+        step_indices[n] = steps[slot];
+    }
+
+    return num_frames;
+}
@@ -4,17 +4,68 @@
 #include <array>
 #include <thread>
 #include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <sstream>
+#include <utility>
+#include <limits>
+#include <boost/filesystem.hpp>
 
 #include <ionmd/simulation.hpp>
 #include <ionmd/data.hpp>
+#include <ionmd/observables.hpp>
+#include <ionmd/spectra.hpp>
+#include <ionmd/camera.hpp>
+#include <ionmd/field.hpp>
+#include <ionmd/serialize.hpp>
+#include <ionmd/reorder.hpp>
+#include <ionmd/numa.hpp>
 #include <ionmd/util.hpp>
 
 namespace ionmd {
 
+namespace fs = boost::filesystem;
 using arma::vec;
 using arma::mat;
 
 
+/**
+ * Advance all ions by one time step with a fixed set of forces and collect
+ * their positions in the original ion order.
+ */
+template <unsigned int forces>
+static void step_ions(std::vector<Ion> &ions, const std::vector<size_t> &ids,
+                      const double &t, const mat &coulomb_forces, vec &positions)
+{
+    // Static schedule to match the first touch partition
+    #pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < ions.size(); i++)
+    {
+        ions[i].step<forces>(t, coulomb_forces, i);
+        const size_t id = ids[i];
+        for (unsigned int j = 0; j < 3; j++) {
+            positions[3*id + j] = ions[i].x[j];
+        }
+    }
+}
+
+
+typedef void (*StepIons)(std::vector<Ion> &, const std::vector<size_t> &,
+                         const double &, const mat &, vec &);
+
+
+/// Table of `step_ions` specializations indexed by force flags.
+template <size_t... forces>
+static auto step_table(std::index_sequence<forces...>)
+    -> std::array<StepIons, sizeof...(forces)>
+{
+    return {{&step_ions<forces>...}};
+}
+
+
 Simulation::Simulation()
 {
     auto default_params = SimParams();
@@ -37,23 +88,45 @@ Simulation::Simulation(SimParams p, Trap trap, std::vector<Ion> ions)
     : Simulation(p, trap)
 {
     for (auto &ion: ions) {
+        ion_ids.push_back(ion_slots++);
         this->ions.push_back(ion);
     }
     // BOOST_LOG_TRIVIAL(debug) << "Number of ions: " << this->ions.size();
 }
 
 
-const mat Simulation::precompute_coulomb()
+void Simulation::precompute_coulomb(mat &forces, vec *energies)
 {
-    mat Flist(3, ions.size());
+    coulomb.set_tile_sizes(p->coulomb_tile_i, p->coulomb_tile_j);
+    coulomb.set_mixed_precision(p->coulomb_mixed_precision);
+    coulomb.set_ions(ions);
+    coulomb.compute(forces, energies);
+}
 
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < ions.size(); i++)
-    {
-        auto F = ions[i].coulomb(ions);
-        Flist.col(i) = F;
+
+double Simulation::mixed_precision_error()
+{
+    coulomb.set_tile_sizes(p->coulomb_tile_i, p->coulomb_tile_j);
+    coulomb.set_ions(ions);
+    return coulomb.mixed_precision_error();
+}
+
+
+auto Simulation::minimize(const MinimizeOptions &options) -> MinimizeResult
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't minimize while running");
+    }
+    return minimize_energy(ions, *p, options);
+}
+
+
+auto Simulation::normal_modes(unsigned int num_modes) -> NormalModes
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't compute normal modes while running");
     }
-    return Flist;
+    return ionmd::normal_modes(ions, *p, num_modes);
 }
 
 
@@ -65,8 +138,15 @@ auto Simulation::get_params() -> SimParams
 
 void Simulation::set_params(SimParams new_params)
 {
-    if (status != SimStatus::RUNNING) {
-        p = std::make_shared<SimParams>(new_params);
+    if (status != SimStatus::RUNNING)
+    {
+        // Update in place so ions created by this simulation see the change
+        if (p) {
+            *p = new_params;
+        }
+        else {
+            p = std::make_shared<SimParams>(new_params);
+        }
     }
     else {
         // BOOST_LOG_TRIVIAL(error) << "Can't change parameters while simulation is running!";
@@ -82,16 +162,23 @@ auto Simulation::get_trap() -> Trap
 
 void Simulation::set_trap(Trap new_trap)
 {
-    if (status != SimStatus::RUNNING) {
-        trap = std::make_shared<Trap>(new_trap);
+    if (status != SimStatus::RUNNING)
+    {
+        if (trap) {
+            *trap = new_trap;
+        }
+        else {
+            trap = std::make_shared<Trap>(new_trap);
+        }
     }
 }
 
 
 Ion Simulation::make_ion(const double &m, const double &Z,
-                         const std::vector<double> &x0)
+                         const std::vector<double> &x0,
+                         const lasers_ptr &lasers)
 {
-    return Ion(p, trap, m, Z, x0);
+    return Ion(p, trap, lasers, m, Z, x0);
 }
 
 
@@ -99,8 +186,164 @@ void Simulation::add_ion(const double &m, const double &z,
                          const std::vector<double> &x0)
 {
     if (status != SimStatus::RUNNING) {
+        ion_ids.push_back(ion_slots++);
         ions.push_back(make_ion(m, z, x0));
+        ions_placed = false;
+    }
+}
+
+
+void Simulation::add_ions(const std::vector<double> &m, const std::vector<double> &Z,
+                          const mat &x0)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't add ions while the simulation is running");
+    }
+
+    const size_t n = x0.n_cols;
+    if (x0.n_rows != 3) {
+        throw std::invalid_argument("Need 3 coordinates per ion");
+    }
+    if ((m.size() != 1 && m.size() != n) || (Z.size() != 1 && Z.size() != n)) {
+        throw std::invalid_argument("Need one mass and charge per ion or one for all ions");
+    }
+
+    // Build the new array at once so it is only allocated (and placed) once
+    std::vector<Ion> new_ions;
+    new_ions.reserve(ions.size() + n);
+    if (p->numa_first_touch) {
+        first_touch(new_ions.data(), ions.size() + n, sizeof(Ion));
+    }
+    for (const auto &ion: ions) {
+        new_ions.push_back(ion);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        ion_ids.push_back(ion_slots++);
+        new_ions.push_back(Ion(p, trap, lasers_ptr(),
+                               m[m.size() == 1 ? 0 : i], Z[Z.size() == 1 ? 0 : i],
+                               vec(x0.col(i))));
     }
+    ions.swap(new_ions);
+    ions_placed = p->numa_first_touch;
+}
+
+
+auto Simulation::get_ions() -> std::vector<Ion> &
+{
+    return ions;
+}
+
+
+auto Simulation::get_lost_ions() const -> const std::vector<LostIon> &
+{
+    return lost_ions;
+}
+
+
+/// Convert a 3 component parameter to a vector.
+static auto three_vector(const std::vector<double> &x, const std::string &name) -> vec
+{
+    if (x.size() != 3) {
+        throw std::invalid_argument(name + " must have 3 components");
+    }
+    return vec(x);
+}
+
+
+auto Simulation::schedule_loading(double t, double m, double Z,
+                                  const std::vector<double> &x0,
+                                  const std::vector<double> &v0,
+                                  const lasers_ptr &lasers) -> size_t
+{
+    // Trajectory frames have a slot for every ion loaded during the run
+    if (run_state) {
+        throw std::runtime_error("Can't schedule loading ions during a run");
+    }
+
+    Event event;
+    event.type = EventType::LOAD;
+    event.t = t;
+    event.id = ion_slots;
+    event.m = m;
+    event.Z = Z;
+    event.x = three_vector(x0, "Initial position");
+    event.v = three_vector(v0, "Initial velocity");
+    event.lasers = lasers;
+    events.emplace(t, event);
+    return ion_slots++;
+}
+
+
+void Simulation::schedule_removal(double t, size_t id)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't schedule events while the simulation is running");
+    }
+    if (id >= ion_slots) {
+        throw std::invalid_argument("Unknown ion " + std::to_string(id));
+    }
+
+    Event event;
+    event.type = EventType::REMOVE;
+    event.t = t;
+    event.id = id;
+    event.m = 0;
+    event.Z = 0;
+    events.emplace(t, event);
+}
+
+
+void Simulation::schedule_reaction(double t, size_t id, double m, double Z,
+                                   const lasers_ptr &lasers)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't schedule events while the simulation is running");
+    }
+    if (id >= ion_slots) {
+        throw std::invalid_argument("Unknown ion " + std::to_string(id));
+    }
+
+    Event event;
+    event.type = EventType::REACT;
+    event.t = t;
+    event.id = id;
+    event.m = m;
+    event.Z = Z;
+    event.lasers = lasers;
+    events.emplace(t, event);
+}
+
+
+void Simulation::add_reaction(const Reaction &reaction)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't add reactions while the simulation is running");
+    }
+    if (!(reaction.rate >= 0)) {
+        throw std::invalid_argument("Reaction rates must not be negative");
+    }
+    reactions.push_back(reaction);
+}
+
+
+void Simulation::clear_events()
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Can't clear events while the simulation is running");
+    }
+    events.clear();
+    reactions.clear();
+}
+
+
+auto Simulation::pending_loads() const -> size_t
+{
+    size_t count = 0;
+    for (const auto &entry: events) {
+        count += entry.second.type == EventType::LOAD;
+    }
+    return count;
 }
 
 
@@ -108,85 +351,836 @@ void Simulation::set_ions(std::vector<Ion> ions)
 {
     if (status != SimStatus::RUNNING) {
         this->ions.clear();
+        ion_ids.clear();
+        lost_ions.clear();
+        events.clear();
 
         for (auto &ion: ions) {
+            ion_ids.push_back(this->ions.size());
             this->ions.push_back(ion);
         }
+        ion_slots = this->ions.size();
+        ions_placed = false;
     }
 }
 
 
-void Simulation::run()
+void Simulation::permute_ions(const std::vector<size_t> &order)
 {
-    if (p == nullptr)
+    // Build the new order in a copy and assign it back, so ions keep their
+    // memory (and its NUMA placement)
+    std::vector<Ion> new_ions;
+    std::vector<size_t> new_ids;
+    new_ions.reserve(ions.size());
+    new_ids.reserve(ions.size());
+    for (const auto i: order)
     {
-        std::cerr << "No parameters set!" << std::endl;
-        status = SimStatus::ERRORED;
+        new_ions.push_back(ions[i]);
+        new_ids.push_back(ion_ids[i]);
+    }
+    for (size_t i = 0; i < ions.size(); i++) {
+        ions[i] = new_ions[i];
+    }
+    ion_ids.swap(new_ids);
+}
+
+
+void Simulation::place_ions()
+{
+    // Leave room for the ions still to be loaded
+    const size_t capacity = ions.size() + pending_loads();
+    std::vector<Ion> placed;
+    placed.reserve(capacity);
+    first_touch(placed.data(), capacity, sizeof(Ion));
+    for (const auto &ion: ions) {
+        placed.push_back(ion);
+    }
+    ions.swap(placed);
+    ions_placed = true;
+}
+
+
+auto Simulation::original_order() const -> std::vector<size_t>
+{
+    // Original indices of lost ions are missing, so sort rather than invert
+    std::vector<size_t> order(ions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [this](size_t a, size_t b) { return ion_ids[a] < ion_ids[b]; });
+    return order;
+}
+
+
+auto Simulation::get_profile() const -> const Profiler &
+{
+    return profiler;
+}
+
+
+void Simulation::start_perf_counters()
+{
+    profiler.attach(nullptr);
+    perf.reset();
+
+    auto events = PerfCounters::environment_events();
+    if (events.empty() && p->perf_counters) {
+        events = p->perf_events;
+    }
+    if (events.empty()) {
         return;
     }
-    else if (trap == nullptr)
+
+    if (!Profiler::enabled())
     {
-        std::cerr << "No trap set!" << std::endl;
-        status = SimStatus::ERRORED;
+        std::cerr << "Performance counters require building with ENABLE_PROFILER"
+                  << std::endl;
         return;
     }
-    else if (ions.size() == 0)
+
+    try {
+        perf = std::make_shared<PerfCounters>(events);
+        profiler.attach(perf.get());
+    }
+    catch (const std::runtime_error &e) {
+        std::cerr << "Performance counters disabled: " << e.what() << std::endl;
+    }
+}
+
+
+auto Simulation::get_perf_counters() const
+    -> std::map<std::string, std::map<std::string, double>>
+{
+    if (perf) {
+        return perf->totals();
+    }
+    return {};
+}
+
+
+auto Simulation::get_ring() const -> std::shared_ptr<const FrameRing>
+{
+    return std::atomic_load(&ring);
+}
+
+
+/// Buffers and output of a run, kept between calls of `Simulation::step`.
+struct Simulation::RunState
+{
+    /// Curve for spatial reordering
+    Curve curve;
+
+    /// Storage of pre-computed Coulomb and field map forces, reused every
+    /// step
+    mat coulomb_forces;
+
+    /// Forces from electrode potential grids
+    std::unique_ptr<FieldMap> field;
+
+    /// Stores every ion's position in one iteration
+    vec current_positions;
+
+    /// Coulomb energy of each ion (only computed for observables)
+    vec coulomb_energies;
+
+    /// In-memory copy of the latest frames
+    ring_ptr ring;
+    unsigned int ring_decimation;
+
+    std::unique_ptr<DataWriter> writer;
+    std::unique_ptr<Observables> observables;
+    std::unique_ptr<Spectra> spectra;
+    std::unique_ptr<Camera> camera;
+
+    /// Ions removed from the simulation and applied events
+    std::ofstream lost_out;
+    std::ofstream events_out;
+
+    /// First time step of the run
+    unsigned int first_step;
+
+    /// Time spent computing time steps
+    double seconds = 0;
+
+    /// CPUs of the pool threads before they were bound, given back when the
+    /// run ends or fails
+    std::vector<std::vector<int>> thread_cpus;
+
+    ~RunState() { restore_threads(thread_cpus); }
+};
+
+
+Simulation::~Simulation()
+{
+    try {
+        finish();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error writing output: " << e.what() << std::endl;
+    }
+}
+
+
+/**
+ * Open a CSV file in the output directory for appending during a run.
+ * @param out
+ * @param path Output directory
+ * @param name File name
+ * @param header Column names, written if the file is started anew
+ * @param fresh Start the file anew rather than appending to it
+ */
+static void open_log(std::ofstream &out, const std::string &path,
+                     const std::string &name, const std::string &header, bool fresh)
+{
+    fs::path filename = path;
+    filename /= name;
+    out.open(filename.c_str(), fresh ? std::ios::out : std::ios::app);
+    if (!out) {
+        throw std::runtime_error("Unable to open " + filename.string());
+    }
+    out.precision(12);
+    if (fresh) {
+        out << header << std::endl;
+    }
+}
+
+
+void Simulation::begin_run(bool fresh)
+{
+    if (p == nullptr) {
+        throw std::runtime_error("No parameters set!");
+    }
+    else if (trap == nullptr) {
+        throw std::runtime_error("No trap set!");
+    }
+    else if (ions.size() == 0 && pending_loads() == 0) {
+        throw std::runtime_error("No ions set!");
+    }
+
+    if (fresh)
     {
-        std::cerr << "No ions set!" << std::endl;
-        status = SimStatus::ERRORED;
-        return;
+        next_step = 0;
+        t = 0;
+        traj_offset = 0;
+        accumulators.clear();
+        rng.seed(p->seed);
+    }
+    resuming = false;
+
+    if (ion_ids.size() != ions.size())
+    {
+        // Ions were added or removed through `get_ions`
+        ion_ids.resize(ions.size());
+        std::iota(ion_ids.begin(), ion_ids.end(), 0);
+        ion_slots = ions.size();
+        for (auto &entry: events)
+        {
+            if (entry.second.type == EventType::LOAD) {
+                entry.second.id = ion_slots++;
+            }
+        }
+        lost_ions.clear();
     }
+    if (fresh)
+    {
+        // Ions lost in earlier runs are forgotten: the remaining ions and
+        // those still to be loaded are numbered from 0 and events for lost
+        // ions are dropped
+        permute_ions(original_order());
+        const size_t no_id = std::numeric_limits<size_t>::max();
+        std::vector<size_t> new_ids(ion_slots, no_id);
+        size_t num_ids = 0;
+        for (const auto id: ion_ids) {
+            new_ids[id] = num_ids++;
+        }
+        std::vector<size_t> loads;
+        for (const auto &entry: events)
+        {
+            if (entry.second.type == EventType::LOAD) {
+                loads.push_back(entry.second.id);
+            }
+        }
+        std::sort(loads.begin(), loads.end());
+        for (const auto id: loads) {
+            new_ids[id] = num_ids++;
+        }
+        for (auto entry = events.begin(); entry != events.end();)
+        {
+            entry->second.id = new_ids[entry->second.id];
+            entry = entry->second.id == no_id ? events.erase(entry) : std::next(entry);
+        }
 
-    // Initialize RNG
-    // std::mersenne_twister_engine<double> rng;
+        std::iota(ion_ids.begin(), ion_ids.end(), 0);
+        ion_slots = num_ids;
+        lost_ions.clear();
+    }
 
-    // Storage of pre-computed Coulomb force data
-    mat coulomb_forces = arma::zeros<mat>(3, ions.size());
+    auto state = std::make_unique<RunState>();
+    Affinity affinity;
+    try {
+        state->curve = parse_curve(p->reorder_curve);
+        affinity = parse_affinity(p->thread_affinity);
+        if (!p->field_maps.empty()) {
+            state->field = std::make_unique<FieldMap>(p, trap);
+        }
+    }
+    catch (const std::invalid_argument &e) {
+        throw std::runtime_error(e.what());
+    }
+
+    // Bind threads before first touching per-ion data so that every block
+    // of ions stays on the NUMA node of the thread updating it
+    // Loaded ions go into reserved capacity, so loading doesn't move ions
+    // (or reallocate Coulomb forces) during the run
+    state->thread_cpus = bind_threads(affinity);
+    const size_t capacity = ions.size() + pending_loads();
+    if (ions.capacity() < capacity) {
+        ions_placed = false;
+    }
+    if (p->numa_first_touch && !ions_placed) {
+        place_ions();
+    }
+    ions.reserve(capacity);
+
+    state->coulomb_forces.set_size(3, capacity);
+    if (p->numa_first_touch) {
+        first_touch(state->coulomb_forces.memptr(), capacity, 3*sizeof(double));
+    }
+    else {
+        state->coulomb_forces.zeros();
+    }
+    // Positions of lost ions stay NaN
+    state->current_positions.set_size(ion_slots * 3);
+    state->current_positions.fill(std::numeric_limits<double>::quiet_NaN());
+    state->coulomb_energies = arma::zeros<vec>(capacity);
 
-    // Stores every ion's position in one iteration
-    vec current_positions(ions.size() * 3);
+    if (p->ring_size > 0) {
+        state->ring = std::make_shared<FrameRing>(state->current_positions.n_elem, p->ring_size);
+    }
+    std::atomic_store(&ring, state->ring);
+    state->ring_decimation = std::max(p->ring_decimation, 1u);
 
     // Create output directory and files
     // FIXME: don't always overwrite
-    // DataWriter writer(p, trap, ions, true);
+    try {
+        // Ions are listed in their original order when continuing from a
+        // checkpoint taken after reordering, with lost ions at their last
+        // position and ions to be loaded at their initial position
+        std::vector<Ion> present;
+        std::vector<size_t> slots;
+        for (const auto i: original_order())
+        {
+            present.push_back(ions[i]);
+            slots.push_back(ion_ids[i]);
+        }
+        std::vector<const Ion *> by_slot(ion_slots, nullptr);
+        for (size_t i = 0; i < ions.size(); i++) {
+            by_slot[ion_ids[i]] = &ions[i];
+        }
+        std::vector<Ion> lost;
+        lost.reserve(lost_ions.size());
+        for (const auto &ion: lost_ions)
+        {
+            lost.push_back(Ion(p, trap, ion.m, ion.Z, ion.x));
+            by_slot[ion.id] = &lost.back();
+        }
+        std::vector<Ion> loaded;
+        loaded.reserve(events.size());
+        std::vector<std::pair<double, double>> products;
+        for (const auto &entry: events)
+        {
+            const auto &event = entry.second;
+            if (event.type == EventType::LOAD)
+            {
+                loaded.push_back(Ion(p, trap, event.m, event.Z, event.x));
+                by_slot[event.id] = &loaded.back();
+            }
+            else if (event.type == EventType::REACT) {
+                products.push_back({event.m, event.Z});
+            }
+        }
+        for (const auto &reaction: reactions) {
+            products.push_back({reaction.product_m, reaction.product_Z});
+        }
+        std::vector<Ion> original;
+        for (const auto ion: by_slot)
+        {
+            if (ion == nullptr) {
+                throw std::runtime_error("Ion ids are inconsistent");
+            }
+            original.push_back(*ion);
+        }
+
+        if (p->write_output) {
+            state->writer = std::make_unique<DataWriter>(p, trap, original, true, traj_offset);
+        }
+        // Observables, spectra and images continue where the checkpoint or
+        // the last run left off
+        std::string saved_observables, saved_spectra, saved_camera;
+        if (!fresh && !accumulators.empty())
+        {
+            std::istringstream saved(accumulators);
+            serialize::get(saved, saved_observables);
+            serialize::get(saved, saved_spectra);
+            serialize::get(saved, saved_camera);
+        }
+        if (p->write_output && p->observables_interval > 0)
+        {
+            std::istringstream saved(saved_observables);
+            state->observables = std::make_unique<Observables>(
+                p, original, products, saved_observables.empty() ? nullptr : &saved);
+        }
+        if (p->write_output && p->spectrum_interval > 0)
+        {
+            std::istringstream saved(saved_spectra);
+            state->spectra = saved_spectra.empty()
+                ? std::make_unique<Spectra>(p, present, slots)
+                : std::make_unique<Spectra>(p, saved);
+        }
+        if (p->write_output && p->image_interval > 0)
+        {
+            std::istringstream saved(saved_camera);
+            state->camera = std::make_unique<Camera>(p, saved_camera.empty() ? nullptr : &saved);
+        }
+        if (p->write_output && (p->check_bounds || !events.empty()))
+        {
+            open_log(state->lost_out, p->path, "lost_ions.csv",
+                     "id,step,t,x,y,z,vx,vy,vz,m,Z", fresh);
+        }
+        if (p->write_output && (!events.empty() || !reactions.empty()))
+        {
+            open_log(state->events_out, p->path, "events.csv",
+                     "step,t,event,id,x,y,z,vx,vy,vz,m,Z", fresh);
+        }
+    }
+    catch (const std::exception &e) {
+        throw std::runtime_error(std::string("Unable to create output: ") + e.what());
+    }
 
-    std::ofstream traj_stream("data.out", std::ios::out | std::ios::binary);
-    traj_stream << ions.size() << "\n" << p->num_steps << "\n";
+    if (p->coulomb_enabled && p->coulomb_mixed_precision && p->verbosity > 0)
+    {
+        std::cout << "Mixed precision Coulomb forces, max. relative error: "
+                  << mixed_precision_error() << std::endl;
+    }
 
-    // Run simulation
-    // BOOST_LOG_TRIVIAL(info) << "Start simulation: " << timestamp_str() << "\n";
-    auto t = double(0);
-    status = SimStatus::RUNNING;
+    profiler.reset();
+    start_perf_counters();
+    state->first_step = next_step;
+    run_state = std::move(state);
+}
+
+
+void Simulation::record_lost(size_t i, double t, vec &positions)
+{
+    const auto &ion = ions[i];
+    const LostIon lost = {ion_ids[i], next_step, t, ion.m, ion.Z, ion.x, ion.v};
+    lost_ions.push_back(lost);
+    for (unsigned int j = 0; j < 3; j++) {
+        positions[3*lost.id + j] = std::numeric_limits<double>::quiet_NaN();
+    }
+
+    if (run_state && run_state->lost_out.is_open())
+    {
+        auto &out = run_state->lost_out;
+        out << lost.id << "," << lost.step << "," << lost.t << ","
+            << lost.x[0] << "," << lost.x[1] << "," << lost.x[2] << ","
+            << lost.v[0] << "," << lost.v[1] << "," << lost.v[2] << ","
+            << lost.m << "," << lost.Z << std::endl;
+        if (!out) {
+            throw std::runtime_error("Error writing lost ions");
+        }
+    }
+}
+
+
+void Simulation::remove_escaped_ions(vec &positions)
+{
+    // Vectorized test of the positions gathered by the step; escapes are
+    // rare, so ions are only searched when there are any. The test is
+    // negated so that NaN coordinates count as outside: an ion whose state
+    // became NaN is removed rather than kept forever. Slots of ions lost
+    // earlier or not loaded yet are NaN too and are subtracted.
+    const size_t num_slots = positions.n_elem / 3;
+    const double *x = positions.memptr();
+    const double r0_squared = trap->r0 * trap->r0;
+    const double z0 = trap->z0;
+    size_t outside = 0;
+
+    #pragma omp parallel for simd schedule(static) reduction(+:outside)
+    for (size_t k = 0; k < num_slots; k++)
+    {
+        outside += !((x[3*k]*x[3*k] + x[3*k + 1]*x[3*k + 1] <= r0_squared)
+                     & (std::abs(x[3*k + 2]) <= z0));
+    }
+    const size_t escaped = outside - (num_slots - ions.size());
+    if (escaped == 0) {
+        return;
+    }
+
+    // Stable compaction: remaining ions keep their order (and memory)
+    size_t kept = 0;
+    for (size_t i = 0; i < ions.size(); i++)
+    {
+        const auto &ion = ions[i];
+        const bool inside = ion.x[0]*ion.x[0] + ion.x[1]*ion.x[1] <= r0_squared
+            && std::abs(ion.x[2]) <= z0;
+        if (!inside)
+        {
+            record_lost(i, t + p->dt, positions);
+            continue;
+        }
+
+        if (kept != i)
+        {
+            ions[kept] = ions[i];
+            ion_ids[kept] = ion_ids[i];
+        }
+        kept++;
+    }
+    ions.erase(ions.begin() + kept, ions.end());
+    ion_ids.resize(kept);
+
+    if (p->verbosity > 0) {
+        std::cout << escaped << " ion(s) left the trap at step " << next_step
+                  << ", " << ions.size() << " left" << std::endl;
+    }
+}
+
+
+void Simulation::apply_events(vec &positions)
+{
+    // Scheduled events (allowing for roundoff in the accumulated time)
+    const double due = t + 1e-6 * p->dt;
+    while (!events.empty() && events.begin()->first <= due)
+    {
+        const Event event = events.begin()->second;
+        events.erase(events.begin());
+
+        if (event.type == EventType::LOAD)
+        {
+            // Within the capacity reserved at the start of the run
+            Ion ion(p, trap, event.lasers, event.m, event.Z, event.x);
+            ion.v = event.v;
+            ions.push_back(ion);
+            ion_ids.push_back(event.id);
+            log_event(event.type, event.id, ion);
+            continue;
+        }
+
+        const auto found = std::find(ion_ids.begin(), ion_ids.end(), event.id);
+        if (found == ion_ids.end()) {
+            continue;
+        }
+        const size_t i = found - ion_ids.begin();
+        if (event.type == EventType::REMOVE)
+        {
+            log_event(event.type, event.id, ions[i]);
+            record_lost(i, t, positions);
+            ions.erase(ions.begin() + i);
+            ion_ids.erase(found);
+        }
+        else
+        {
+            ions[i].set_species(event.m, event.Z, event.lasers);
+            log_event(event.type, event.id, ions[i]);
+        }
+    }
+
+    // Stochastic reactions: draw the number of reacting ions of a species,
+    // then which ones
+    for (const auto &reaction: reactions)
+    {
+        size_t count = 0;
+        for (const auto &ion: ions) {
+            count += ion.m == reaction.m && ion.Z == reaction.Z;
+        }
+        const double probability = -std::expm1(-reaction.rate * p->dt);
+        if (count == 0 || probability == 0) {
+            continue;
+        }
+        std::binomial_distribution<size_t> reacting(count, probability);
+        const size_t num_reacting = reacting(rng);
+        if (num_reacting == 0) {
+            continue;
+        }
+
+        std::vector<size_t> reactants;
+        reactants.reserve(count);
+        for (size_t i = 0; i < ions.size(); i++)
+        {
+            if (ions[i].m == reaction.m && ions[i].Z == reaction.Z) {
+                reactants.push_back(i);
+            }
+        }
+        for (size_t k = 0; k < num_reacting; k++)
+        {
+            std::uniform_int_distribution<size_t> pick(k, count - 1);
+            std::swap(reactants[k], reactants[pick(rng)]);
+            auto &ion = ions[reactants[k]];
+            ion.set_species(reaction.product_m, reaction.product_Z, reaction.product_lasers);
+            log_event(EventType::REACT, ion_ids[reactants[k]], ion);
+        }
+    }
+}
+
+
+void Simulation::log_event(EventType type, size_t id, const Ion &ion)
+{
+    if (!run_state || !run_state->events_out.is_open()) {
+        return;
+    }
+
+    auto &out = run_state->events_out;
+    out << next_step << "," << t << "," << event_name(type) << "," << id << ","
+        << ion.x[0] << "," << ion.x[1] << "," << ion.x[2] << ","
+        << ion.v[0] << "," << ion.v[1] << "," << ion.v[2] << ","
+        << ion.m << "," << ion.Z << std::endl;
+    if (!out) {
+        throw std::runtime_error("Error writing events");
+    }
+}
+
+
+void Simulation::advance(unsigned int n)
+{
+    auto &s = *run_state;
+    const auto start = Profiler::clock::now();
+
+    // Select the step loop for the enabled forces once, not per ion
+    static const auto step_kernels = step_table(std::make_index_sequence<num_force_sets>());
+    const StepIons step_kernel = step_kernels[enabled_forces(*p)];
 
-    for (unsigned int step = 0; step < p->num_steps; step++)
+    for (unsigned int k = 0; k < n; k++)
     {
+        const bool observe = s.observables
+            && next_step % p->observables_interval == 0;
+
+        if (!events.empty() || !reactions.empty())
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::EVENTS);
+            apply_events(s.current_positions);
+        }
+
+        if (p->reorder_interval > 0 && next_step % p->reorder_interval == 0)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::REORDER);
+            permute_ions(spatial_order(ions, s.curve));
+        }
+
         // Calculate Coulomb forces
-        if (p->coulomb_enabled) {
-            coulomb_forces = precompute_coulomb();
+        if (p->coulomb_enabled)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::COULOMB);
+            precompute_coulomb(s.coulomb_forces, observe ? &s.coulomb_energies : nullptr);
+        }
+        if (s.field)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::FIELD);
+            s.field->set_ions(ions);
+            s.field->compute(t, s.coulomb_forces, p->coulomb_enabled);
+        }
+
+        if (observe)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::OBSERVABLES);
+            s.observables->record(next_step, t, ions, ion_ids, s.coulomb_energies, s.field.get());
         }
 
         // Update each ion
-        // TODO: update to use Boost.compute
-        #pragma omp parallel for
-        for (unsigned int i = 0; i < ions.size(); i++)
-        {
-            const auto x = ions[i].update(t, coulomb_forces, i);
-            // writer.update_buffer(i, x);
-            for (unsigned int j = 0; j < 3; j++) {
-                current_positions[3*i + j] = x[j];
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::INTEGRATION);
+            step_kernel(ions, ion_ids, t, s.coulomb_forces, s.current_positions);
+            if (p->check_bounds) {
+                remove_escaped_ions(s.current_positions);
             }
+        }
 
-            // TODO: Check bounds
+        if (s.spectra && next_step % p->spectrum_interval == 0)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::OBSERVABLES);
+            s.spectra->record(s.current_positions);
+        }
+        if (s.camera && next_step % p->image_interval == 0)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::OBSERVABLES);
+            s.camera->record(ions);
         }
 
-        current_positions.save(traj_stream, arma::raw_binary);
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::OUTPUT);
+            if (s.writer) {
+                s.writer->write_frame(s.current_positions);
+            }
+            if (s.ring && next_step % s.ring_decimation == 0) {
+                s.ring->push(next_step, s.current_positions);
+            }
+        }
         t += p->dt;
+        next_step++;
+
+        if (s.camera && p->image_exposure > 0 && next_step % p->image_exposure == 0)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::OUTPUT);
+            s.camera->write();
+        }
+
+        if (s.writer && p->checkpoint_interval > 0
+            && next_step % p->checkpoint_interval == 0)
+        {
+            IONMD_PROFILE_PHASE(profiler, Phase::CHECKPOINT);
+            traj_offset = s.writer->tell();
+            checkpoint(checkpoint_filename());
+        }
     }
 
-    traj_stream.close();
+    const std::chrono::duration<double> elapsed = Profiler::clock::now() - start;
+    s.seconds += elapsed.count();
+}
+
+
+void Simulation::end_run()
+{
+    // The run is over even if flushing output fails
+    const auto state = std::move(run_state);
+    if (state->writer)
+    {
+        IONMD_PROFILE_PHASE(profiler, Phase::OUTPUT);
+        traj_offset = state->writer->tell();
+        accumulators = save_accumulators(*state);
+    }
+    if (state->spectra)
+    {
+        IONMD_PROFILE_PHASE(profiler, Phase::OUTPUT);
+        state->spectra->write();
+    }
+    if (state->camera && (p->image_exposure == 0 || state->camera->exposed()))
+    {
+        IONMD_PROFILE_PHASE(profiler, Phase::OUTPUT);
+        state->camera->write();
+    }
+    profiler.attach(nullptr);
+    permute_ions(original_order());
+
+    profiler.set_run(state->seconds, next_step - state->first_step);
+    if (Profiler::enabled() && state->writer) {
+        write_profile(p, profiler, perf.get());
+    }
+    if (Profiler::enabled() && p->verbosity > 0) {
+        std::cout << profiler.report();
+    }
+    if (perf && p->verbosity > 0) {
+        std::cout << perf->report();
+    }
+}
+
+
+auto Simulation::save_accumulators(RunState &s) -> std::string
+{
+    // The camera state excludes the last image written at the end of a run,
+    // so a continued run keeps exposing it
+    std::ostringstream observables, spectra, camera, state;
+    if (s.observables) {
+        s.observables->save(observables);
+    }
+    if (s.spectra) {
+        s.spectra->save(spectra);
+    }
+    if (s.camera) {
+        s.camera->save(camera);
+    }
+    serialize::put(state, observables.str());
+    serialize::put(state, spectra.str());
+    serialize::put(state, camera.str());
+    return state.str();
+}
 
-    // trajectories.save(p->filename, arma::raw_binary);
-    // trajectories.save(p->filename, arma::csv_ascii);
+
+auto Simulation::trajectory_offset() -> uint64_t
+{
+    if (run_state && run_state->writer) {
+        return run_state->writer->tell();
+    }
+    return traj_offset;
+}
+
+
+void Simulation::run()
+{
+    try {
+        // Finish stepping started with `step` before starting over
+        finish();
+        begin_run(!resuming);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        status = SimStatus::ERRORED;
+        return;
+    }
+
+    // Run simulation
+    // BOOST_LOG_TRIVIAL(info) << "Start simulation: " << timestamp_str() << "\n";
+    status = SimStatus::RUNNING;
+    try {
+        advance(next_step < p->num_steps ? p->num_steps - next_step : 0);
+        end_run();
+    }
+    catch (const std::exception &e)
+    {
+        run_state.reset();
+        profiler.attach(nullptr);
+        std::cerr << "Error writing output: " << e.what() << std::endl;
+        status = SimStatus::ERRORED;
+        return;
+    }
+
+    status = SimStatus::FINISHED;
+}
+
+
+void Simulation::step(unsigned int n)
+{
+    if (status == SimStatus::RUNNING) {
+        throw std::runtime_error("Simulation is already running");
+    }
+
+    try {
+        if (!run_state) {
+            begin_run(next_step == 0 && !resuming);
+        }
+        status = SimStatus::RUNNING;
+        advance(n);
+
+        // Keep ions in their original order for access between calls
+        if (p->reorder_interval > 0) {
+            permute_ions(original_order());
+        }
+    }
+    catch (const std::exception &)
+    {
+        run_state.reset();
+        profiler.attach(nullptr);
+        status = SimStatus::ERRORED;
+        throw;
+    }
+    status = SimStatus::IDLE;
+}
+
+
+void Simulation::finish()
+{
+    if (!run_state) {
+        return;
+    }
+
+    try {
+        end_run();
+    }
+    catch (const std::exception &)
+    {
+        profiler.attach(nullptr);
+        status = SimStatus::ERRORED;
+        throw;
+    }
     status = SimStatus::FINISHED;
 }
 
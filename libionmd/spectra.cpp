@@ -0,0 +1,307 @@
+#include <cmath>
+#include <algorithm>
+#include <complex>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+#include <ionmd/spectra.hpp>
+#include <ionmd/minimize.hpp>
+#include <ionmd/modes.hpp>
+#include <ionmd/serialize.hpp>
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+using arma::vec;
+using arma::mat;
+
+
+Spectra::Spectra(params_ptr params, const std::vector<Ion> &ions,
+                 const std::vector<size_t> &slots)
+    : p(params), block_size(params->spectrum_block)
+{
+    setup_blocks();
+
+    held.set_size(3 * ions.size());
+    for (size_t i = 0; i < ions.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++) {
+            coordinates.push_back(3*slots[i] + j);
+            held[3*i + j] = ions[i].x[j];
+        }
+    }
+
+    for (const auto &axis: p->spectrum_axes)
+    {
+        size_t offset;
+        if (axis == "x") {
+            offset = 0;
+        }
+        else if (axis == "y") {
+            offset = 1;
+        }
+        else if (axis == "z") {
+            offset = 2;
+        }
+        else {
+            throw std::invalid_argument("Unknown spectrum axis: " + axis);
+        }
+
+        for (size_t i = 0; i < ions.size(); i++) {
+            signal_sources.push_back(3*i + offset);
+            signal_columns.push_back(names.size());
+        }
+        names.push_back(axis);
+        signals_per_column.push_back(ions.size());
+    }
+
+    if (p->spectrum_modes > 0)
+    {
+        // Mode vectors of the equilibrium the ions move around
+        auto equilibrium = ions;
+        minimize_energy(equilibrium, *p);
+        const auto modes = normal_modes(equilibrium, *p, p->spectrum_modes);
+
+        mode_weights = modes.vectors;
+        mode_frequencies = modes.frequencies;
+        for (size_t k = 0; k < mode_weights.n_cols; k++)
+        {
+            double *weights = mode_weights.colptr(k);
+            for (size_t row = 0; row < mode_weights.n_rows; row++) {
+                weights[row] *= std::sqrt(ions[row / 3].m);
+            }
+            signal_columns.push_back(names.size());
+            names.push_back("mode_" + std::to_string(k));
+            signals_per_column.push_back(1);
+        }
+    }
+
+    history.zeros(signal_columns.size(), block_size);
+    power.zeros(block_size / 2 + 1, names.size());
+}
+
+
+Spectra::Spectra(params_ptr params, std::istream &state)
+    : p(params), block_size(params->spectrum_block)
+{
+    using serialize::get;
+
+    setup_blocks();
+
+    uint64_t samples, blocks;
+    get(state, coordinates);
+    get(state, held);
+    get(state, signal_sources);
+    get(state, signal_columns);
+    get(state, names);
+    get(state, signals_per_column);
+    get(state, mode_weights);
+    get(state, mode_frequencies);
+    get(state, history);
+    get(state, power);
+    get(state, samples);
+    get(state, blocks);
+    num_samples = samples;
+    num_blocks = blocks;
+
+    bool valid = held.n_elem == coordinates.size()
+        && signal_sources.size() + mode_weights.n_cols == signal_columns.size()
+        && signals_per_column.size() == names.size()
+        && mode_frequencies.n_elem == mode_weights.n_cols
+        && (mode_weights.n_cols == 0 || mode_weights.n_rows == held.n_elem)
+        && history.n_rows == signal_columns.size() && history.n_cols == block_size
+        && power.n_rows == block_size / 2 + 1 && power.n_cols == names.size();
+    for (const auto source: signal_sources) {
+        valid = valid && source < held.n_elem;
+    }
+    for (const auto column: signal_columns) {
+        valid = valid && column < names.size();
+    }
+    if (!valid) {
+        throw std::runtime_error("Spectra in checkpoint don't match the parameters");
+    }
+}
+
+
+void Spectra::setup_blocks()
+{
+    if (block_size < 2) {
+        throw std::invalid_argument("spectrum_block must be at least 2");
+    }
+    if (!(p->spectrum_overlap >= 0 && p->spectrum_overlap < 1)) {
+        throw std::invalid_argument("spectrum_overlap must be in [0, 1)");
+    }
+    hop = std::max(1u, static_cast<unsigned int>(std::lround(block_size * (1 - p->spectrum_overlap))));
+
+    // Periodic Hann window
+    window.set_size(block_size);
+    window_norm = 0;
+    for (unsigned int n = 0; n < block_size; n++)
+    {
+        window[n] = 0.5 * (1 - std::cos(2 * M_PI * n / block_size));
+        window_norm += window[n] * window[n];
+    }
+}
+
+
+void Spectra::save(std::ostream &state) const
+{
+    using serialize::put;
+
+    put(state, coordinates);
+    put(state, held);
+    put(state, signal_sources);
+    put(state, signal_columns);
+    put(state, names);
+    put(state, signals_per_column);
+    put(state, mode_weights);
+    put(state, mode_frequencies);
+    put(state, history);
+    put(state, power);
+    put<uint64_t>(state, num_samples);
+    put<uint64_t>(state, num_blocks);
+}
+
+
+void Spectra::record(const vec &positions)
+{
+    double *sample = history.colptr(num_samples % block_size);
+    const size_t num_axis_signals = signal_sources.size();
+    const size_t num_coordinates = coordinates.size();
+
+    // Coordinates of lost ions are NaN
+    #pragma omp parallel for schedule(static)
+    for (size_t c = 0; c < num_coordinates; c++)
+    {
+        const double x = positions[coordinates[c]];
+        if (std::isfinite(x)) {
+            held[c] = x;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < num_axis_signals; s++) {
+        sample[s] = held[signal_sources[s]];
+    }
+
+    // Mode coordinates (up to a constant removed with the block mean)
+    #pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < mode_weights.n_cols; k++)
+    {
+        const double *weights = mode_weights.colptr(k);
+        double q = 0;
+        for (size_t row = 0; row < mode_weights.n_rows; row++) {
+            q += weights[row] * held[row];
+        }
+        sample[num_axis_signals + k] = q;
+    }
+
+    num_samples++;
+    if (num_samples >= block_size && (num_samples - block_size) % hop == 0) {
+        add_block();
+    }
+}
+
+
+void Spectra::add_block()
+{
+    const size_t num_signals = history.n_rows;
+    const size_t oldest = num_samples % block_size;
+
+    // Detrended and windowed block in time order, one column per signal
+    mat block(block_size, num_signals);
+    #pragma omp parallel for schedule(static)
+    for (size_t s = 0; s < num_signals; s++)
+    {
+        double mean = 0;
+        for (unsigned int n = 0; n < block_size; n++) {
+            mean += history(s, n);
+        }
+        mean /= block_size;
+
+        double *column = block.colptr(s);
+        for (unsigned int n = 0; n < block_size; n++) {
+            column[n] = window[n] * (history(s, (oldest + n) % block_size) - mean);
+        }
+    }
+
+    const arma::cx_mat transform = arma::fft(block);
+
+    #pragma omp parallel for schedule(static)
+    for (size_t bin = 0; bin < power.n_rows; bin++)
+    {
+        for (size_t s = 0; s < num_signals; s++) {
+            power(bin, signal_columns[s]) += std::norm(transform(bin, s));
+        }
+    }
+    num_blocks++;
+}
+
+
+auto Spectra::frequencies() const -> vec
+{
+    const double sample_rate = 1 / (p->dt * p->spectrum_interval);
+    vec f(power.n_rows);
+    for (size_t bin = 0; bin < power.n_rows; bin++) {
+        f[bin] = bin * sample_rate / block_size;
+    }
+    return f;
+}
+
+
+auto Spectra::spectra() const -> mat
+{
+    const double sample_rate = 1 / (p->dt * p->spectrum_interval);
+    mat psd(power.n_rows, power.n_cols);
+    for (size_t c = 0; c < power.n_cols; c++)
+    {
+        const double scale = num_blocks == 0 ? 0
+            : 1 / (num_blocks * signals_per_column[c] * sample_rate * window_norm);
+        for (size_t bin = 0; bin < power.n_rows; bin++)
+        {
+            // One-sided: negative frequencies are added to positive ones
+            const bool unpaired = bin == 0 || 2 * bin == block_size;
+            psd(bin, c) = (unpaired ? 1 : 2) * scale * power(bin, c);
+        }
+    }
+    return psd;
+}
+
+
+void Spectra::write() const
+{
+    fs::path filename = p->path;
+    filename /= "spectra.csv";
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        throw std::runtime_error("Unable to open " + filename.string());
+    }
+
+    out.precision(12);
+    out << "# blocks: " << num_blocks << ", block size: " << block_size
+        << ", sample interval: " << p->dt * p->spectrum_interval << " s\n";
+    for (size_t k = 0; k < mode_frequencies.n_elem; k++) {
+        out << "# mode_" << k << ": " << mode_frequencies[k] / (2 * M_PI) << " Hz\n";
+    }
+    out << "frequency";
+    for (const auto &name: names) {
+        out << "," << name;
+    }
+    out << "\n";
+
+    const vec f = frequencies();
+    const mat psd = spectra();
+    for (size_t bin = 0; bin < psd.n_rows; bin++)
+    {
+        out << f[bin];
+        for (size_t c = 0; c < psd.n_cols; c++) {
+            out << "," << psd(bin, c);
+        }
+        out << "\n";
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Error writing spectra");
+    }
+}
@@ -1,8 +1,12 @@
 #define CATCH_CONFIG_MAIN
 
 #include <memory>
+#include <cmath>
+#include <vector>
 #include <boost/filesystem.hpp>
 #include <ionmd/data.hpp>
+#include <ionmd/codec.hpp>
+#include <ionmd/ring.hpp>
 #include "catch.hpp"
 
 using namespace ionmd;
@@ -12,3 +16,152 @@ namespace fs = boost::filesystem;
 TEST_CASE("data can be written", "[data]")
 {
 }
+
+
+TEST_CASE("compressed trajectories round trip within precision", "[data]")
+{
+    const size_t num_values = 6;
+    const double precision = 1e-9;
+    const unsigned int num_frames = 50;
+
+    TrajectoryEncoder encoder(num_values, precision, 16);
+    TrajectoryDecoder decoder(num_values, precision);
+
+    std::vector<uint8_t> encoded;
+    std::vector<double> frame(num_values), decoded(num_values);
+
+    for (unsigned int n = 0; n < num_frames; n++)
+    {
+        for (size_t i = 0; i < num_values; i++) {
+            frame[i] = 100e-6 * std::sin(0.1*n + i) - 50e-6*i;
+        }
+
+        encoded.clear();
+        encoder.encode(frame.data(), encoded);
+        REQUIRE(encoded.size() < num_values * sizeof(double));
+
+        decoder.decode(encoded.data(), encoded.size(), decoded.data());
+        for (size_t i = 0; i < num_values; i++) {
+            REQUIRE(std::abs(decoded[i] - frame[i]) <= precision/2);
+        }
+    }
+
+    SECTION("missing values round trip")
+    {
+        for (unsigned int n = 0; n < 20; n++)
+        {
+            frame[0] = NAN;
+            frame[1] = -frame[1];
+            encoded.clear();
+            encoder.encode(frame.data(), encoded);
+            decoder.decode(encoded.data(), encoded.size(), decoded.data());
+            REQUIRE(std::isnan(decoded[0]));
+            REQUIRE(std::abs(decoded[1] - frame[1]) <= precision/2);
+        }
+    }
+
+    SECTION("infinite values are rejected")
+    {
+        frame[0] = INFINITY;
+        REQUIRE_THROWS(encoder.encode(frame.data(), encoded));
+    }
+}
+
+
+TEST_CASE("trajectory files round trip through the writer", "[data]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+
+    for (const bool compress: {false, true})
+    {
+        auto params = std::make_shared<SimParams>();
+        params->path = path.string();
+        params->buffer_size = 2;
+        params->num_steps = 12;
+        params->compress_trajectories = compress;
+        params->trajectory_precision = 1e-9;
+        auto trap = std::make_shared<Trap>();
+        const std::vector<Ion> ions = {Ion(params, trap, 1, 1), Ion(params, trap, 1, 1)};
+
+        // The second ion is lost after 4 frames
+        auto frame = [](unsigned int n, double offset) {
+            arma::vec x = {10e-6*std::sin(0.3*n) + offset, 1e-6*n, -5e-6,
+                           -20e-6 + 1e-6*n, 0, 2e-6*std::cos(0.2*n)};
+            if (n >= 4) {
+                x.subvec(3, 5).fill(NAN);
+            }
+            return x;
+        };
+
+        uint64_t checkpoint;
+        {
+            DataWriter writer(params, trap, ions, true);
+            for (unsigned int n = 0; n < 10; n++)
+            {
+                writer.write_frame(frame(n, 0));
+                if (n == 5) {
+                    checkpoint = writer.tell();
+                }
+            }
+        }
+
+        // Resuming discards the frames written after the checkpoint
+        {
+            DataWriter writer(params, trap, ions, true, checkpoint);
+            for (unsigned int n = 6; n < 12; n++) {
+                writer.write_frame(frame(n, 1e-6));
+            }
+        }
+
+        // Resuming needs the file written up to the checkpoint
+        const auto traj_name = compress ? "trajectories.ionz" : "trajectories.bin";
+        fs::rename(path / traj_name, path / "moved");
+        REQUIRE_THROWS_AS(DataWriter(params, trap, ions, true, checkpoint), const std::runtime_error &);
+        fs::rename(path / "moved", path / traj_name);
+
+        TrajectoryReader reader((path / (compress ? "trajectories.ionz" : "trajectories.bin")).string());
+        REQUIRE(reader.is_compressed() == compress);
+        REQUIRE(reader.get_num_ions() == 2);
+        const auto frames = reader.read_all();
+        REQUIRE(frames.n_cols == 12);
+        for (unsigned int n = 0; n < 12; n++)
+        {
+            const arma::vec expected = frame(n, n < 6 ? 0 : 1e-6);
+            for (unsigned int i = 0; i < 6; i++)
+            {
+                if (std::isnan(expected[i])) {
+                    REQUIRE(std::isnan(frames(i, n)));
+                }
+                else {
+                    REQUIRE(std::abs(frames(i, n) - expected[i]) <= 0.5e-9 + 1e-18);
+                }
+            }
+        }
+        fs::remove_all(path);
+    }
+}
+
+
+TEST_CASE("frame ring keeps the latest frames", "[data]")
+{
+    FrameRing ring(3, 4);
+    REQUIRE(ring.size() == 0);
+
+    for (unsigned int step = 0; step < 10; step++) {
+        ring.push(step, arma::vec({1.0*step, 0, -1.0*step}));
+    }
+    REQUIRE(ring.size() == 4);
+
+    std::vector<double> positions(3 * 4);
+    std::vector<unsigned int> steps(4);
+    REQUIRE(ring.copy_latest(positions.data(), steps.data(), 4) == 4);
+    for (unsigned int n = 0; n < 4; n++) {
+        REQUIRE(steps[n] == 6 + n);
+        REQUIRE(positions[3*n] == 6.0 + n);
+        REQUIRE(positions[3*n + 2] == -6.0 - n);
+    }
+
+    REQUIRE(ring.copy_latest(positions.data(), steps.data(), 2) == 2);
+    REQUIRE(steps[0] == 8);
+    REQUIRE(steps[1] == 9);
+}
@@ -0,0 +1,96 @@
+#define CATCH_CONFIG_RUNNER
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <mpi.h>
+#include <boost/filesystem.hpp>
+#include <ionmd/mpi_simulation.hpp>
+#include <ionmd/simulation.hpp>
+#include <ionmd/data.hpp>
+#include <ionmd/constants.hpp>
+#include "catch.hpp"
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+
+
+/// Run with mpirun: every rank runs the same test cases.
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+    const int result = Catch::Session().run(argc, argv);
+    MPI_Finalize();
+    return result;
+}
+
+
+TEST_CASE("MPI trajectories match a serial simulation", "[mpi]")
+{
+    int rank, num_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    // All ranks write to the directory chosen by rank 0
+    std::string base;
+    if (rank == 0) {
+        base = fs::unique_path(fs::temp_directory_path() / "ionmd-mpi-%%%%%%%%").string();
+        fs::create_directories(base);
+    }
+    unsigned long length = base.size();
+    MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG, 0, MPI_COMM_WORLD);
+    base.resize(length);
+    MPI_Bcast(&base[0], int(length), MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 50;
+    params.buffer_size = 7;  // ends with a partially filled buffer
+    params.path = (fs::path(base) / "mpi").string();
+
+    // An odd number of ions so that the blocks differ in size
+    const Trap trap;
+    std::vector<IonSpec> ions;
+    const unsigned int num_ions = 2*num_ranks + 1;
+    for (unsigned int i = 0; i < num_ions; i++)
+    {
+        const double phi = 0.5 * i;
+        ions.push_back({40*constants::amu, 1,
+                        {10e-6*std::cos(phi), 10e-6*std::sin(phi), 5e-6*(i - 0.5*num_ions)}, {}});
+    }
+
+    MPISimulation sim(MPI_COMM_WORLD, params, trap, ions);
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        auto serial_params = params;
+        serial_params.path = (fs::path(base) / "serial").string();
+        Simulation serial(serial_params, trap);
+        for (const auto &ion: ions) {
+            serial.add_ion(ion.m, ion.Z, ion.x0);
+        }
+        serial.run();
+        REQUIRE(serial.status == SimStatus::FINISHED);
+
+        TrajectoryReader distributed((fs::path(params.path) / "trajectories.bin").string());
+        TrajectoryReader expected((fs::path(serial_params.path) / "trajectories.bin").string());
+        REQUIRE(distributed.get_num_ions() == num_ions);
+        const arma::mat actual_frames = distributed.read_all();
+        const arma::mat expected_frames = expected.read_all();
+        REQUIRE(actual_frames.n_rows == expected_frames.n_rows);
+        REQUIRE(actual_frames.n_cols == params.num_steps);
+        REQUIRE(expected_frames.n_cols == params.num_steps);
+
+        // Forces are summed in a different order, so allow for rounding
+        for (size_t n = 0; n < actual_frames.n_cols; n++)
+        {
+            for (size_t i = 0; i < actual_frames.n_rows; i++) {
+                REQUIRE(std::abs(actual_frames(i, n) - expected_frames(i, n)) <= 1e-15);
+            }
+        }
+        fs::remove_all(base);
+    }
+}
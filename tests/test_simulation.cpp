@@ -0,0 +1,1359 @@
+#include <memory>
+#include <string>
+#include <cmath>
+#include <array>
+#include <limits>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstring>
+#include <boost/filesystem.hpp>
+#include <ionmd/simulation.hpp>
+#include <ionmd/data.hpp>
+#include <ionmd/replicas.hpp>
+#include <ionmd/ensemble.hpp>
+#include <ionmd/coulomb.hpp>
+#include <ionmd/reorder.hpp>
+#include <ionmd/perf.hpp>
+#include <ionmd/numa.hpp>
+#include <ionmd/field.hpp>
+#include <ionmd/constants.hpp>
+#include "catch.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace ionmd;
+namespace fs = boost::filesystem;
+
+
+/// Create a small Doppler cooled crystal writing to `path`.
+static void setup(Simulation &sim, const std::string &path)
+{
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 300;
+    params.doppler_enabled = true;
+    params.path = path;
+    sim.set_params(params);
+
+    for (int i = 0; i < 4; i++) {
+        sim.add_ion(40*constants::amu, 1, {1e-6*i, 0, -30e-6 + 20e-6*i});
+    }
+}
+
+
+TEST_CASE("checkpoints resume bit-identically", "[simulation]")
+{
+    const auto base = fs::temp_directory_path() / fs::unique_path();
+    const auto full_path = (base / "full").string();
+    const auto resumed_path = (base / "resumed").string();
+    fs::create_directories(base);
+
+    Simulation full;
+    setup(full, full_path);
+    auto params = full.get_params();
+    params.checkpoint_interval = 200;
+    params.spectrum_interval = 5;
+    params.spectrum_block = 16;
+    params.image_interval = 10;
+    params.image_exposure = 120;
+    params.image_horizontal = {0, 1, 0};
+    params.image_vertical = {1, 0, 0};
+    full.set_params(params);
+    full.run();
+    REQUIRE(full.status == SimStatus::FINISHED);
+
+    // Resume from the checkpoint at step 200 in a copy of the output
+    fs::create_directories(resumed_path);
+    for (const auto name: {"trajectories.bin", "checkpoint.bin", "images.bin"}) {
+        fs::copy_file(fs::path(full_path) / name, fs::path(resumed_path) / name);
+    }
+
+    Simulation resumed;
+    resumed.restore((fs::path(resumed_path) / "checkpoint.bin").string());
+    params = resumed.get_params();
+    REQUIRE(params.num_steps == 300);
+    params.path = resumed_path;
+    resumed.set_params(params);
+    resumed.run();
+    REQUIRE(resumed.status == SimStatus::FINISHED);
+
+    TrajectoryReader full_reader((fs::path(full_path) / "trajectories.bin").string());
+    TrajectoryReader resumed_reader((fs::path(resumed_path) / "trajectories.bin").string());
+    const auto expected = full_reader.read_all();
+    const auto actual = resumed_reader.read_all();
+
+    REQUIRE(actual.n_cols == expected.n_cols);
+    for (arma::uword i = 0; i < expected.n_elem; i++) {
+        REQUIRE(actual[i] == expected[i]);
+    }
+
+    // Spectra and images continue from the checkpoint; images are summed
+    // over threads in a different order
+    const auto contents = [](const fs::path &filename) {
+        std::ifstream in(filename.string(), std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    REQUIRE(contents(fs::path(resumed_path) / "spectra.csv")
+            == contents(fs::path(full_path) / "spectra.csv"));
+    const auto full_images = contents(fs::path(full_path) / "images.bin");
+    const auto resumed_images = contents(fs::path(resumed_path) / "images.bin");
+    REQUIRE(resumed_images.size() == full_images.size());
+    size_t header = 0;
+    for (int line = 0; line < 3; line++) {
+        header = full_images.find('\n', header) + 1;
+    }
+    REQUIRE(resumed_images.compare(0, header, full_images, 0, header) == 0);
+    std::vector<double> full_pixels((full_images.size() - header) / sizeof(double));
+    std::vector<double> resumed_pixels(full_pixels.size());
+    REQUIRE(full_pixels.size() == 3 * 256 * 64);
+    std::memcpy(full_pixels.data(), full_images.data() + header, full_pixels.size() * sizeof(double));
+    std::memcpy(resumed_pixels.data(), resumed_images.data() + header, resumed_pixels.size() * sizeof(double));
+    double total = 0;
+    for (size_t i = 0; i < full_pixels.size(); i++)
+    {
+        REQUIRE(resumed_pixels[i] == Approx(full_pixels[i]).epsilon(1e-12).margin(1e-30));
+        total += full_pixels[i];
+    }
+    REQUIRE(total > 0);
+
+    if (Profiler::enabled())
+    {
+        REQUIRE(fs::exists(fs::path(resumed_path) / "profile.json"));
+        const auto totals = resumed.get_profile().totals();
+        REQUIRE(totals.at("coulomb") > 0);
+        REQUIRE(totals.at("run") >= totals.at("coulomb") + totals.at("integration"));
+    }
+
+    fs::remove_all(base);
+}
+
+
+TEST_CASE("stepping in chunks matches a full run", "[simulation]")
+{
+    const auto base = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(base);
+
+    Simulation full;
+    setup(full, (base / "full").string());
+    full.run();
+    REQUIRE(full.status == SimStatus::FINISHED);
+
+    Simulation stepped;
+    setup(stepped, (base / "stepped").string());
+    for (int i = 0; i < 3; i++)
+    {
+        stepped.step(100);
+        REQUIRE(stepped.status == SimStatus::IDLE);
+    }
+    stepped.finish();
+    REQUIRE(stepped.status == SimStatus::FINISHED);
+
+    TrajectoryReader full_reader((base / "full" / "trajectories.bin").string());
+    TrajectoryReader stepped_reader((base / "stepped" / "trajectories.bin").string());
+    const auto expected = full_reader.read_all();
+    const auto actual = stepped_reader.read_all();
+    REQUIRE(actual.n_cols == 300);
+    for (arma::uword i = 0; i < expected.n_elem; i++) {
+        REQUIRE(actual[i] == expected[i]);
+    }
+
+    fs::remove_all(base);
+}
+
+
+TEST_CASE("step kernels match Ion::update for combinations of forces", "[simulation]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+
+    // Field map of the secular potential, so that field forces are of the
+    // same size as the others
+    const double m = 40*constants::amu;
+    const auto trap = std::make_shared<Trap>();
+    const auto grid_file = (path / "trap.fld").string();
+    {
+        const auto params = std::make_shared<SimParams>();
+        double k[3];
+        Ion(params, trap, m, 1).secular_stiffness(k);
+        const std::array<size_t, 3> size = {21, 21, 21};
+        const std::array<double, 3> origin = {-50e-6, -50e-6, -50e-6};
+        const std::array<double, 3> spacing = {5e-6, 5e-6, 5e-6};
+        std::vector<double> values;
+        for (size_t iz = 0; iz < size[2]; iz++) {
+            for (size_t iy = 0; iy < size[1]; iy++) {
+                for (size_t ix = 0; ix < size[0]; ix++)
+                {
+                    const size_t index[3] = {ix, iy, iz};
+                    double phi = 0;
+                    for (unsigned int j = 0; j < 3; j++)
+                    {
+                        const double r = origin[j] + index[j]*spacing[j];
+                        phi += 0.5 * k[j] * r * r / constants::q_e;
+                    }
+                    values.push_back(phi);
+                }
+            }
+        }
+        write_field_grid(grid_file, size, origin, spacing, values);
+    }
+
+    const lasers_ptr lasers = {
+        std::make_shared<Laser>(2e-22, 1.3e-19, std::vector<double>{0, 0, 1})};
+
+    // A few of the 64 specializations, including every force on its own
+    // with the secular force and all forces together
+    const std::vector<unsigned int> force_sets = {
+        SECULAR_FORCE,
+        SECULAR_FORCE | COULOMB_FORCE,
+        SECULAR_FORCE | MICROMOTION_FORCE | COULOMB_FORCE,
+        SECULAR_FORCE | COULOMB_FORCE | STOCHASTIC_FORCE,
+        SECULAR_FORCE | DOPPLER_FORCE,
+        COULOMB_FORCE | FIELD_FORCE,
+        FIELD_FORCE | STOCHASTIC_FORCE | DOPPLER_FORCE,
+        num_force_sets - 1};
+
+    for (const auto forces: force_sets)
+    {
+        INFO("forces: " << forces);
+        auto params = SimParams();
+        params.dt = 1e-8;
+        params.write_output = false;
+        params.secular_enabled = forces & SECULAR_FORCE;
+        params.micromotion_enabled = forces & MICROMOTION_FORCE;
+        params.coulomb_enabled = forces & COULOMB_FORCE;
+        params.stochastic_enabled = forces & STOCHASTIC_FORCE;
+        params.doppler_enabled = forces & DOPPLER_FORCE;
+        if (forces & FIELD_FORCE)
+        {
+            params.field_maps = {grid_file};
+            params.field_dc = {0.5};
+            params.field_rf = {0};
+        }
+        REQUIRE(enabled_forces(params) == forces);
+
+        Simulation sim;
+        sim.set_params(params);
+        for (int i = 0; i < 5; i++) {
+            sim.add_ion(m, 1, {1e-6*i, 2e-6, -20e-6 + 10e-6*i});
+        }
+        for (auto &ion: sim.get_ions()) {
+            ion.set_species(m, 1, lasers);
+        }
+
+        // The first step sets up the run and gives the ions accelerations
+        sim.step(1);
+        auto expected = sim.get_ions();
+        sim.step(1);
+        const auto &actual = sim.get_ions();
+        REQUIRE(actual.size() == expected.size());
+
+        // Forces of the second step from the state after the first
+        arma::mat F = arma::zeros<arma::mat>(3, expected.size());
+        if (forces & COULOMB_FORCE)
+        {
+            for (size_t i = 0; i < expected.size(); i++) {
+                F.col(i) = expected[i].coulomb(expected);
+            }
+        }
+        if (forces & FIELD_FORCE)
+        {
+            FieldMap field(std::make_shared<SimParams>(params), trap);
+            field.set_ions(expected);
+            field.compute(params.dt, F, true);
+        }
+
+        // Coulomb forces are summed in a different order
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            expected[i].update(params.dt, F, i);
+            REQUIRE(arma::norm(actual[i].x - expected[i].x) <= 1e-12 * arma::norm(expected[i].x));
+            REQUIRE(arma::norm(actual[i].v - expected[i].v) <= 1e-12 * arma::norm(expected[i].v));
+            REQUIRE(arma::norm(actual[i].a - expected[i].a) <= 1e-12 * arma::norm(expected[i].a));
+        }
+    }
+
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("ensemble members match standalone runs", "[ensemble]")
+{
+    // Members of increasing estimated cost: 2 ions for 200 steps, 6 ions for
+    // 200 steps and 3 ions for 1000 steps
+    const std::vector<std::pair<int, unsigned int>> sizes = {{2, 200}, {6, 200}, {3, 1000}};
+    std::vector<SimParams> member_params;
+    std::vector<std::vector<IonSpec>> member_ions;
+    Ensemble ensemble;
+    const Trap trap;
+    for (const auto &size: sizes)
+    {
+        auto params = SimParams();
+        params.dt = 1e-8;
+        params.num_steps = size.second;
+        params.write_output = false;
+        std::vector<IonSpec> ions;
+        for (int i = 0; i < size.first; i++) {
+            ions.push_back({40*constants::amu, 1, {1e-6*i, 0, -10e-6*size.first + 20e-6*i}, {}});
+        }
+        ensemble.add_member(params, trap, ions);
+        member_params.push_back(params);
+        member_ions.push_back(ions);
+    }
+    REQUIRE(ensemble.run_order() == std::vector<size_t>({2, 1, 0}));
+
+#ifdef _OPENMP
+    const int levels = omp_get_max_active_levels();
+#endif
+    ensemble.run(2);
+#ifdef _OPENMP
+    REQUIRE(omp_get_max_active_levels() == levels);
+#endif
+
+    for (size_t k = 0; k < sizes.size(); k++)
+    {
+        REQUIRE(ensemble.get_status(k) == SimStatus::FINISHED);
+
+        Simulation standalone(member_params[k], trap);
+        for (const auto &ion: member_ions[k]) {
+            standalone.add_ion(ion.m, ion.Z, ion.x0);
+        }
+        standalone.run();
+        REQUIRE(standalone.status == SimStatus::FINISHED);
+
+        const auto &expected = standalone.get_ions();
+        const auto &actual = ensemble.get_simulation(k).get_ions();
+        REQUIRE(actual.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                REQUIRE(actual[i].x[j] == expected[i].x[j]);
+                REQUIRE(actual[i].v[j] == expected[i].v[j]);
+            }
+        }
+    }
+}
+
+
+TEST_CASE("replicas integrate independently", "[replicas]")
+{
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.coulomb_enabled = false;
+
+    const double m = 40*constants::amu;
+    const double z0 = 20e-6;
+    const std::vector<IonSpec> ions = {{m, 1, {0, 0, z0}, {}}};
+
+    // More replicas than lanes so that a partially filled block is used
+    const size_t num_replicas = ReplicaBatch::lanes + 2;
+    auto trap = Trap();
+    ReplicaBatch batch(params, trap, ions, num_replicas);
+
+    auto stiff_trap = trap;
+    stiff_trap.U_ec = 4*trap.U_ec;
+    batch.set_trap(num_replicas - 1, stiff_trap);
+
+    const unsigned int num_steps = 2000;
+    batch.run(num_steps);
+    REQUIRE(batch.get_time() == Approx(num_steps * params.dt));
+
+    // Axial harmonic motion with the spring constant of Ion::secular_force
+    const double B = trap.kappa*trap.U_ec/(2*pow(trap.z0, 2));
+    const double omega = std::sqrt(4*constants::q_e*B/m);
+    const double expected = z0*std::cos(omega*batch.get_time());
+
+    for (size_t r = 0; r < num_replicas - 1; r++) {
+        REQUIRE(batch.get_positions(r)(2, 0) == Approx(expected).epsilon(1e-6));
+    }
+
+    const double expected_stiff = z0*std::cos(2*omega*batch.get_time());
+    REQUIRE(batch.get_positions(num_replicas - 1)(2, 0) == Approx(expected_stiff).epsilon(1e-6));
+}
+
+
+TEST_CASE("like charges repel in the direct sum", "[coulomb]")
+{
+    auto params = std::make_shared<SimParams>();
+    auto trap = std::make_shared<Trap>();
+    const double d = 5e-6;
+    std::vector<Ion> ions;
+    ions.push_back(Ion(params, trap, 40*constants::amu, 1, {0, 0, -d/2}));
+    ions.push_back(Ion(params, trap, 40*constants::amu, 1, {0, 0, d/2}));
+
+    // Coulomb's law, pointing away from the other ion. Forces are compared
+    // relative to it, as Approx has an absolute scale of 1
+    const double magnitude = constants::OOFPEN * pow(constants::q_e, 2) / pow(d, 2);
+    const auto F0 = ions[0].coulomb(ions);
+    const auto F1 = ions[1].coulomb(ions);
+    REQUIRE(F0[2] / magnitude == Approx(-1).epsilon(1e-12));
+    REQUIRE(F1[2] / magnitude == Approx(1).epsilon(1e-12));
+    REQUIRE(std::abs(F0[0]) + std::abs(F0[1]) == 0);
+
+    // Opposite charges attract
+    ions[1] = Ion(params, trap, 40*constants::amu, -1, {0, 0, d/2});
+    REQUIRE(ions[0].coulomb(ions)[2] / magnitude == Approx(1).epsilon(1e-12));
+}
+
+
+TEST_CASE("tiled Coulomb forces match the direct sum", "[coulomb]")
+{
+    auto params = std::make_shared<SimParams>();
+    auto trap = std::make_shared<Trap>();
+    std::vector<Ion> ions;
+    for (int i = 0; i < 37; i++)
+    {
+        const double phi = 0.7*i;
+        ions.push_back(Ion(params, trap, 40*constants::amu, 1 + i % 2,
+                           {10e-6*cos(phi), 10e-6*sin(phi), 2e-6*i}));
+    }
+
+    // Tiles that don't divide the number of ions
+    CoulombSolver solver(5, 3);
+    solver.set_ions(ions);
+    arma::mat forces;
+    arma::vec energies;
+    solver.compute(forces, &energies, 4, 20);
+    REQUIRE(forces.n_cols == 20);
+
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        double energy;
+        const auto expected = ions[4 + i].coulomb(ions, &energy);
+        for (unsigned int j = 0; j < 3; j++) {
+            REQUIRE(forces(j, i) == Approx(expected[j]).epsilon(1e-12));
+        }
+        REQUIRE(energies[i] == Approx(energy).epsilon(1e-12));
+    }
+
+    // Far from the trap center, relative coordinates keep single precision
+    // errors small
+    for (auto &ion: ions) {
+        ion.x[2] += 1e-3;
+    }
+    solver.set_ions(ions);
+    REQUIRE(solver.mixed_precision_error() < 1e-4);
+}
+
+
+TEST_CASE("Hilbert keys visit neighbouring grid points", "[reorder]")
+{
+    // Every cell of a 4x4x4 grid (the top bits of the key) is visited once,
+    // each one adjacent to the one before
+    const unsigned int shift = curve_bits - 2;
+    std::vector<std::array<int, 3>> cells(64);
+    for (int x = 0; x < 4; x++)
+    {
+        for (int y = 0; y < 4; y++)
+        {
+            for (int z = 0; z < 4; z++)
+            {
+                const auto key = hilbert_key(x << shift, y << shift, z << shift);
+                cells[key >> 3*shift] = {x, y, z};
+            }
+        }
+    }
+
+    for (size_t i = 1; i < cells.size(); i++)
+    {
+        int distance = 0;
+        for (unsigned int j = 0; j < 3; j++) {
+            distance += std::abs(cells[i][j] - cells[i - 1][j]);
+        }
+        REQUIRE(distance == 1);
+    }
+}
+
+
+TEST_CASE("reordering ions keeps the output order", "[reorder]")
+{
+    const auto base = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(base);
+    std::vector<arma::mat> trajectories;
+
+    for (const std::string curve: {"", "hilbert", "morton"})
+    {
+        auto params = SimParams();
+        params.dt = 1e-8;
+        params.num_steps = 200;
+        params.path = (base / (curve.empty() ? "none" : curve)).string();
+        params.reorder_interval = curve.empty() ? 0 : 7;
+        params.reorder_curve = curve.empty() ? "hilbert" : curve;
+
+        Simulation sim;
+        sim.set_params(params);
+        for (int i = 0; i < 6; i++) {
+            sim.add_ion(40*constants::amu, 1, {1e-6*i, 2e-6*(i % 2), 30e-6 - 11e-6*((3*i) % 6)});
+        }
+        sim.run();
+        REQUIRE(sim.status == SimStatus::FINISHED);
+
+        TrajectoryReader reader(params.path + "/trajectories.bin");
+        trajectories.push_back(reader.read_all());
+    }
+
+    for (size_t k = 1; k < trajectories.size(); k++)
+    {
+        REQUIRE(trajectories[k].n_cols == trajectories[0].n_cols);
+        for (arma::uword i = 0; i < trajectories[0].n_elem; i++) {
+            REQUIRE(trajectories[k][i] == Approx(trajectories[0][i]).margin(1e-15));
+        }
+    }
+
+    fs::remove_all(base);
+}
+
+
+TEST_CASE("thread binding and first touch keep results", "[numa]")
+{
+    REQUIRE_THROWS_AS(parse_affinity("compact"), const std::invalid_argument &);
+    REQUIRE_FALSE(numa_nodes().empty());
+
+    // CPUs of every pool thread, which runs must give back
+    const auto pool_cpus = []() {
+        std::vector<std::vector<int>> cpus(1);
+#ifdef _OPENMP
+        cpus.resize(omp_get_max_threads());
+#endif
+        #pragma omp parallel
+        {
+#ifdef _OPENMP
+            const size_t thread = omp_get_thread_num();
+#else
+            const size_t thread = 0;
+#endif
+            if (thread < cpus.size()) {
+                cpus[thread] = thread_cpus();
+            }
+        }
+        return cpus;
+    };
+    const auto cpus_before = pool_cpus();
+
+    const auto base = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(base);
+    std::vector<arma::mat> trajectories;
+
+    for (const std::string affinity: {"none", "close", "spread"})
+    {
+        Simulation sim;
+        setup(sim, (base / affinity).string());
+        auto params = sim.get_params();
+        params.thread_affinity = affinity;
+        params.numa_first_touch = affinity != "none";
+        sim.set_params(params);
+        sim.run();
+        REQUIRE(sim.status == SimStatus::FINISHED);
+        REQUIRE(pool_cpus() == cpus_before);
+
+        TrajectoryReader reader(params.path + "/trajectories.bin");
+        trajectories.push_back(reader.read_all());
+    }
+
+    for (size_t k = 1; k < trajectories.size(); k++)
+    {
+        REQUIRE(trajectories[k].n_cols == trajectories[0].n_cols);
+        for (arma::uword i = 0; i < trajectories[0].n_elem; i++) {
+            REQUIRE(trajectories[k][i] == trajectories[0][i]);
+        }
+    }
+
+    fs::remove_all(base);
+}
+
+
+TEST_CASE("ions added in bulk keep their storage across runs", "[simulation]")
+{
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 50;
+    params.write_output = false;
+    params.reorder_interval = 5;
+
+    Simulation sim;
+    sim.set_params(params);
+
+    arma::mat x0(3, 8);
+    for (arma::uword i = 0; i < x0.n_cols; i++)
+    {
+        x0(0, i) = 1e-6*i;
+        x0(1, i) = 2e-6*(i % 2);
+        x0(2, i) = 30e-6 - 9e-6*((3*i) % 8);
+    }
+    REQUIRE_THROWS_AS(sim.add_ions({1, 2}, {1}, x0), const std::invalid_argument &);
+    sim.add_ions({40*constants::amu}, {1}, x0);
+
+    auto &ions = sim.get_ions();
+    REQUIRE(ions.size() == 8);
+    REQUIRE(ions[5].m == 40*constants::amu);
+    REQUIRE(ions[5].x[2] == x0(2, 5));
+
+    const Ion *storage = ions.data();
+    for (int run = 0; run < 2; run++)
+    {
+        sim.run();
+        REQUIRE(sim.status == SimStatus::FINISHED);
+        REQUIRE(sim.get_ions().data() == storage);
+    }
+}
+
+
+TEST_CASE("ions leaving the trap are removed", "[bounds]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+
+    for (const bool compress: {false, true})
+    {
+        // One ion at rest and one drifting out axially after about 50 steps
+        auto params = SimParams();
+        params.dt = 1e-8;
+        params.num_steps = 100;
+        params.secular_enabled = false;
+        params.coulomb_enabled = false;
+        params.compress_trajectories = compress;
+        params.path = path.string();
+        params.observables_interval = 10;
+        params.observables = {"temperature"};
+
+        Simulation sim;
+        sim.set_params(params);
+        const double z0 = sim.get_trap().z0;
+        sim.add_ion(40*constants::amu, 1, {0, 0, 0});
+        sim.add_ion(40*constants::amu, 1, {0, 0, z0 - 5e-6});
+        sim.add_ion(40*constants::amu, 1, {0, 0, 10e-6});
+        sim.get_ions()[1].v[2] = 10;
+        sim.run();
+        REQUIRE(sim.status == SimStatus::FINISHED);
+
+        REQUIRE(sim.get_ions().size() == 2);
+        REQUIRE(sim.get_ions()[1].x[2] == 10e-6);
+        const auto &lost = sim.get_lost_ions();
+        REQUIRE(lost.size() == 1);
+        REQUIRE(lost[0].id == 1);
+        REQUIRE(lost[0].x[2] > z0);
+        REQUIRE(lost[0].step >= 48);
+        REQUIRE(lost[0].step <= 51);
+
+        // Frames keep a slot for the lost ion
+        TrajectoryReader reader((path / "trajectories.bin").string());
+        const auto frames = reader.read_all();
+        REQUIRE(frames.n_rows == 9);
+        REQUIRE(frames.n_cols == 100);
+        REQUIRE(frames(5, lost[0].step - 1) == Approx(lost[0].x[2] - 10 * params.dt));
+        for (arma::uword n = lost[0].step; n < frames.n_cols; n++)
+        {
+            REQUIRE(std::isnan(frames(5, n)));
+            REQUIRE(frames(8, n) == Approx(10e-6).margin(1e-9));
+        }
+
+        std::ifstream in((path / "lost_ions.csv").string());
+        std::string header, line;
+        REQUIRE(std::getline(in, header));
+        REQUIRE(header == "id,step,t,x,y,z,vx,vy,vz,m,Z");
+        REQUIRE(std::getline(in, line));
+        REQUIRE(line.substr(0, 2) == "1,");
+        REQUIRE_FALSE(std::getline(in, line));
+    }
+
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("ions with NaN state are removed", "[bounds]")
+{
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 20;
+    params.write_output = false;
+
+    Simulation sim;
+    sim.set_params(params);
+    for (int i = 0; i < 3; i++) {
+        sim.add_ion(40*constants::amu, 1, {0, 0, -10e-6 + 10e-6*i});
+    }
+    sim.get_ions()[1].v[0] = std::numeric_limits<double>::quiet_NaN();
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+
+    // Removed in the first step, before it enters any Coulomb force
+    const auto &lost = sim.get_lost_ions();
+    REQUIRE(lost.size() == 1);
+    REQUIRE(lost[0].id == 1);
+    REQUIRE(lost[0].step == 0);
+    REQUIRE(std::isnan(lost[0].x[0]));
+
+    const auto &ions = sim.get_ions();
+    REQUIRE(ions.size() == 2);
+    for (const auto &ion: ions)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            REQUIRE(std::isfinite(ion.x[j]));
+            REQUIRE(std::isfinite(ion.v[j]));
+        }
+    }
+}
+
+
+TEST_CASE("events load, remove and change ions during a run", "[events]")
+{
+    const auto base = fs::temp_directory_path() / fs::unique_path();
+    const auto full_path = base / "full";
+    const auto resumed_path = base / "resumed";
+    fs::create_directories(resumed_path);
+
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 100;
+    params.path = full_path.string();
+    params.checkpoint_interval = 40;
+    params.observables_interval = 10;
+    params.observables = {"species_temperature", "msd"};
+    const double m = 40*constants::amu;
+
+    Simulation sim;
+    sim.set_params(params);
+    sim.add_ion(m, 1, {0, 0, 0});
+    REQUIRE(sim.schedule_loading(20*params.dt, m, 1, {0, 0, 20e-6}, {0, 0, 1}) == 1);
+    REQUIRE(sim.schedule_loading(0, m, 0, {0, 0, -20e-6}) == 2);
+    sim.schedule_reaction(50*params.dt, 0, 44*constants::amu, 1);
+    sim.schedule_removal(80*params.dt, 1);
+    REQUIRE_THROWS_AS(sim.schedule_removal(0, 3), const std::invalid_argument &);
+
+    // Neutral atoms are ionized in the first step (almost surely)
+    Reaction ionization;
+    ionization.m = m;
+    ionization.Z = 0;
+    ionization.product_m = m;
+    ionization.product_Z = 1;
+    ionization.rate = 1e10;
+    sim.add_reaction(ionization);
+
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+
+    const auto &ions = sim.get_ions();
+    REQUIRE(ions.size() == 2);
+    REQUIRE(ions[0].m == 44*constants::amu);
+    REQUIRE(ions[1].Z == 1);
+    REQUIRE(sim.get_lost_ions().size() == 1);
+    REQUIRE(sim.get_lost_ions()[0].id == 1);
+    REQUIRE(sim.get_lost_ions()[0].step == 80);
+
+    // The loaded ion has a slot from the start, which is NaN while it's gone
+    TrajectoryReader reader((full_path / "trajectories.bin").string());
+    const auto frames = reader.read_all();
+    REQUIRE(frames.n_rows == 9);
+    REQUIRE(std::isnan(frames(5, 19)));
+    REQUIRE(frames(5, 20) > 20e-6);
+    REQUIRE(std::isfinite(frames(5, 79)));
+    REQUIRE(std::isnan(frames(5, 80)));
+
+    std::ifstream in((full_path / "events.csv").string());
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+    REQUIRE(lines.size() == 6);
+    REQUIRE(lines[1].find("0,0,load,2,") == 0);
+    REQUIRE(lines[2].find("0,0,react,2,") == 0);
+    REQUIRE(lines[3].find(",load,1,") != std::string::npos);
+    REQUIRE(lines[4].find(",react,0,") != std::string::npos);
+    REQUIRE(lines[5].find(",remove,1,") != std::string::npos);
+
+    // Species without ions have no temperature
+    const auto contents = [](const fs::path &filename) {
+        std::ifstream in(filename.string());
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    const auto observables = contents(full_path / "observables.csv");
+    REQUIRE(observables.find("nan") == std::string::npos);
+    REQUIRE(observables.find("inf") == std::string::npos);
+    REQUIRE(observables.find(",,") != std::string::npos);
+
+    // Pending events and reactions are restored from checkpoints
+    for (const auto name: {"trajectories.bin", "checkpoint.bin", "observables.csv"}) {
+        fs::copy_file(full_path / name, resumed_path / name);
+    }
+    Simulation resumed;
+    resumed.restore((resumed_path / "checkpoint.bin").string());
+    params = resumed.get_params();
+    params.path = resumed_path.string();
+    resumed.set_params(params);
+    resumed.run();
+    REQUIRE(resumed.status == SimStatus::FINISHED);
+
+    TrajectoryReader resumed_reader((resumed_path / "trajectories.bin").string());
+    const auto resumed_frames = resumed_reader.read_all();
+    REQUIRE(resumed_frames.n_cols == frames.n_cols);
+    for (arma::uword i = 0; i < frames.n_elem; i++) {
+        REQUIRE((resumed_frames[i] == frames[i] || std::isnan(frames[i])));
+    }
+
+    // Observables continue with the reference positions of the first run
+    REQUIRE(contents(resumed_path / "observables.csv") == observables);
+
+    // Frames can't grow during a run
+    sim.step(1);
+    REQUIRE_THROWS_AS(sim.schedule_loading(1e-6, m, 1, {0, 0, 0}), const std::runtime_error &);
+    sim.finish();
+
+    fs::remove_all(base);
+}
+
+
+TEST_CASE("total energy is conserved without damping", "[observables]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+
+    // Ions released away from their equilibrium oscillate in the secular
+    // potential and repel each other
+    auto params = SimParams();
+    params.dt = 1e-9;
+    params.num_steps = 5000;
+    params.path = path.string();
+    params.observables_interval = 100;
+    params.observables = {"kinetic_energy", "trap_energy", "coulomb_energy", "total_energy"};
+
+    Simulation sim;
+    sim.set_params(params);
+    for (int i = 0; i < 4; i++) {
+        sim.add_ion(40*constants::amu, 1, {2e-6*i, -1e-6*i, -30e-6 + 20e-6*i});
+    }
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+
+    std::ifstream in((path / "observables.csv").string());
+    std::string line;
+    REQUIRE(std::getline(in, line));
+    REQUIRE(line.find("# species 0:") == 0);
+    REQUIRE(std::getline(in, line));
+    REQUIRE(line == "step,t,kinetic_energy,trap_energy,coulomb_energy,total_energy");
+
+    std::vector<std::array<double, 4>> energies;
+    while (std::getline(in, line))
+    {
+        std::array<double, 4> values;
+        std::stringstream fields(line);
+        std::string field;
+        std::getline(fields, field, ',');
+        std::getline(fields, field, ',');
+        for (auto &value: values)
+        {
+            std::getline(fields, field, ',');
+            value = std::stod(field);
+        }
+        REQUIRE(values[3] == Approx(values[0] + values[1] + values[2]));
+        energies.push_back(values);
+    }
+    REQUIRE(energies.size() == 50);
+
+    // Energy moves between kinetic and potential but the total stays (the
+    // Coulomb force of a step is evaluated before the position update, so
+    // the drift is first order in dt)
+    const double initial = energies.front()[3];
+    double max_kinetic = 0;
+    for (const auto &values: energies)
+    {
+        REQUIRE(std::abs(values[3] - initial) < 1e-3 * std::abs(initial));
+        max_kinetic = std::max(max_kinetic, values[0]);
+    }
+    REQUIRE(energies.front()[0] == 0);
+    REQUIRE(max_kinetic > 0.1 * std::abs(initial));
+
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("minimizers find the two ion equilibrium", "[minimize]")
+{
+    auto params = SimParams();
+    params.write_output = false;
+
+    for (const std::string method: {"fire", "lbfgs"})
+    {
+        Simulation sim;
+        sim.set_params(params);
+        sim.add_ion(40*constants::amu, 1, {0.5e-6, 0, -20e-6});
+        sim.add_ion(40*constants::amu, 1, {-0.5e-6, 0, 15e-6});
+
+        double k[3];
+        sim.get_ions()[0].secular_stiffness(k);
+        REQUIRE(k[0] > 0);
+        REQUIRE(k[2] > 0);
+
+        // Trap force k z balances the Coulomb force of the other ion at 2z
+        const double q = constants::q_e;
+        const double z = std::cbrt(constants::OOFPEN*q*q / (4*k[2]));
+
+        MinimizeOptions options;
+        options.method = method;
+        options.tolerance = 1e-8;
+        const auto result = sim.minimize(options);
+        REQUIRE(result.converged);
+        REQUIRE(result.max_force > 0);
+
+        const auto &ions = sim.get_ions();
+        REQUIRE(ions[0].x[2] == Approx(-z).epsilon(1e-6));
+        REQUIRE(ions[1].x[2] == Approx(z).epsilon(1e-6));
+        REQUIRE(std::abs(ions[0].x[0]) < 1e-6*z);
+        REQUIRE(ions[1].v[2] == 0);
+    }
+
+    MinimizeOptions options;
+    options.method = "steepest";
+    Simulation sim;
+    REQUIRE_THROWS_AS(sim.minimize(options), const std::invalid_argument &);
+}
+
+
+TEST_CASE("normal modes of a crystal", "[modes]")
+{
+    auto params = SimParams();
+    params.write_output = false;
+
+    Simulation sim;
+    sim.set_params(params);
+    sim.add_ion(40*constants::amu, 1, {0.5e-6, 0, -20e-6});
+    sim.add_ion(40*constants::amu, 1, {-0.5e-6, 0, 15e-6});
+    MinimizeOptions options;
+    options.tolerance = 1e-10;
+    REQUIRE(sim.minimize(options).converged);
+
+    // Two ion modes: center of mass and stretch along z, center of mass and
+    // rocking in each radial direction
+    double k[3];
+    sim.get_ions()[0].secular_stiffness(k);
+    const double omega_r = std::sqrt(k[0] / (40*constants::amu));
+    const double omega_z = std::sqrt(k[2] / (40*constants::amu));
+    REQUIRE(omega_r > omega_z);
+    std::vector<double> expected = {
+        omega_z, std::sqrt(3.0)*omega_z, omega_r, omega_r,
+        std::sqrt(omega_r*omega_r - omega_z*omega_z), std::sqrt(omega_r*omega_r - omega_z*omega_z)
+    };
+    std::sort(expected.begin(), expected.end());
+
+    const auto modes = sim.normal_modes();
+    REQUIRE(modes.frequencies.n_elem == 6);
+    REQUIRE(modes.vectors.n_cols == 6);
+    for (int i = 0; i < 6; i++) {
+        REQUIRE(modes.frequencies[i] == Approx(expected[i]).epsilon(1e-6));
+    }
+
+    // The Lanczos path finds the lowest modes of a larger crystal
+    arma::mat x0(3, 12);
+    for (arma::uword i = 0; i < x0.n_cols; i++)
+    {
+        x0(0, i) = 3e-6*std::cos(2.0*i);
+        x0(1, i) = 3e-6*std::sin(2.0*i);
+        x0(2, i) = -30e-6 + 5e-6*i;
+    }
+    Simulation crystal;
+    crystal.set_params(params);
+    crystal.add_ions({40*constants::amu}, {1}, x0);
+    REQUIRE(crystal.minimize(options).converged);
+
+    const auto all = crystal.normal_modes();
+    const auto lowest = crystal.normal_modes(4);
+    REQUIRE(lowest.frequencies.n_elem == 4);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(lowest.frequencies[i] == Approx(all.frequencies[i]).epsilon(1e-6));
+    }
+    REQUIRE_THROWS_AS(crystal.normal_modes(100), const std::invalid_argument &);
+}
+
+
+TEST_CASE("spectra peak at the normal mode frequencies", "[spectra]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+
+    auto params = SimParams();
+    params.dt = 1e-7;
+    params.num_steps = 64000;
+    params.path = path.string();
+    params.spectrum_interval = 100;
+    params.spectrum_block = 256;
+    params.spectrum_axes = {"z"};
+    params.spectrum_modes = 2;
+
+    // Only axial modes are excited, which are the two lowest ones
+    Simulation sim;
+    sim.set_params(params);
+    sim.add_ion(40*constants::amu, 1, {0, 0, -20e-6});
+    sim.add_ion(40*constants::amu, 1, {0, 0, 15e-6});
+    sim.minimize();
+    const auto modes = sim.normal_modes(2);
+    sim.get_ions()[0].v[2] = 0.1;
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+
+    std::ifstream in((path / "spectra.csv").string());
+    std::string line;
+    std::getline(in, line);
+    REQUIRE(line.find("# blocks: 4,") == 0);
+    while (std::getline(in, line) && line[0] == '#');
+    REQUIRE(line == "frequency,z,mode_0,mode_1");
+
+    std::vector<std::array<double, 4>> rows;
+    std::array<double, 4> row;
+    char comma;
+    while (in >> row[0] >> comma >> row[1] >> comma >> row[2] >> comma >> row[3]) {
+        rows.push_back(row);
+    }
+    REQUIRE(rows.size() == 129);
+
+    const double resolution = rows[1][0];
+    for (int k = 0; k < 2; k++)
+    {
+        const auto peak = std::max_element(rows.begin(), rows.end(),
+            [k](const std::array<double, 4> &a, const std::array<double, 4> &b) {
+                return a[2 + k] < b[2 + k];
+            });
+        REQUIRE(std::abs((*peak)[0] - modes.frequencies[k] / (2*M_PI)) < resolution);
+    }
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("camera images integrate the time ions spend in pixels", "[camera]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+
+    // Two ions at rest, imaged along x with z horizontal
+    auto params = SimParams();
+    params.dt = 1e-8;
+    params.num_steps = 100;
+    params.secular_enabled = false;
+    params.coulomb_enabled = false;
+    params.path = path.string();
+    params.image_interval = 10;
+    params.image_exposure = 40;
+    params.image_size = {40, 10};
+    params.image_vertical = {0, 1, 0};
+
+    Simulation sim;
+    sim.set_params(params);
+    sim.add_ion(40*constants::amu, 1, {0, 0.5e-6, -10.5e-6});
+    sim.add_ion(40*constants::amu, 1, {0, 0.5e-6, 10.5e-6});
+    sim.run();
+    REQUIRE(sim.status == SimStatus::FINISHED);
+
+    std::ifstream in((path / "images.bin").string(), std::ios::binary);
+    unsigned int width, height, exposure;
+    in >> width >> height >> exposure;
+    in.get();
+    REQUIRE(width == 40);
+    REQUIRE(height == 10);
+    REQUIRE(exposure == 40);
+
+    // Exposures of 4, 4 and 2 samples
+    for (const int samples: {4, 4, 2})
+    {
+        std::vector<double> image(width * height);
+        REQUIRE(in.read(reinterpret_cast<char *>(image.data()), image.size() * sizeof(double)));
+
+        double total = 0;
+        for (const auto value: image) {
+            total += value;
+        }
+        REQUIRE(total == Approx(2 * samples * 10 * params.dt).epsilon(1e-4));
+
+        // Each ion is centered on a pixel
+        const auto peak = std::max_element(image.begin(), image.begin() + width*6);
+        REQUIRE(peak - image.begin() == 5*width + 9);
+        REQUIRE(image[5*width + 30] == Approx(*peak));
+        REQUIRE(image[4*width + 9] < *peak);
+    }
+    REQUIRE(in.peek() == EOF);
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("field maps reproduce the analytic trap", "[field]")
+{
+    const auto path = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(path);
+    const auto grid_file = (path / "trap.fld").string();
+
+    auto params = std::make_shared<SimParams>();
+    params->dt = 1e-8;
+    params->num_steps = 200;
+    params->path = path.string();
+    auto trap = std::make_shared<Trap>();
+
+    // Potential per volt of the secular force on a 40Ca+ ion, which tricubic
+    // interpolation reproduces exactly
+    const double m = 40*constants::amu;
+    const std::array<size_t, 3> size = {21, 21, 21};
+    const std::array<double, 3> origin = {-50e-6, -50e-6, -50e-6};
+    const std::array<double, 3> spacing = {5e-6, 5e-6, 5e-6};
+    std::vector<double> values;
+    auto write_grid = [&](const std::string &filename, const double *k) {
+        values.clear();
+        for (size_t iz = 0; iz < size[2]; iz++) {
+            for (size_t iy = 0; iy < size[1]; iy++) {
+                for (size_t ix = 0; ix < size[0]; ix++)
+                {
+                    const double r[3] = {origin[0] + ix*spacing[0], origin[1] + iy*spacing[1],
+                                         origin[2] + iz*spacing[2]};
+                    double phi = 0;
+                    for (unsigned int j = 0; j < 3; j++) {
+                        phi += 0.5 * k[j] * r[j] * r[j] / constants::q_e;
+                    }
+                    values.push_back(phi);
+                }
+            }
+        }
+        write_field_grid(filename, size, origin, spacing, values);
+    };
+    double k[3];
+    Ion(params, trap, m, 1).secular_stiffness(k);
+    write_grid(grid_file, k);
+
+    SECTION("grids are mapped once")
+    {
+        const auto grid = load_field_grid(grid_file);
+        REQUIRE(load_field_grid(grid_file) == grid);
+        REQUIRE(grid->size == size);
+        REQUIRE(grid->values()[0] == values[0]);
+        REQUIRE_THROWS_AS(FieldGrid((path / "missing.fld").string()), const std::runtime_error &);
+    }
+
+    SECTION("interpolated forces are exact")
+    {
+        params->field_maps = {grid_file};
+        params->field_dc = {0.5};
+        params->field_rf = {0};
+        FieldMap field(params, trap);
+
+        // The last ion is too close to the edge of the grid
+        const std::vector<arma::vec> positions = {
+            {0, 0, 0}, {1.3e-6, -2.7e-6, 11.1e-6}, {-33e-6, 7.5e-6, -44e-6}, {0, 0, 46e-6}};
+        std::vector<Ion> ions;
+        for (const auto &x: positions) {
+            ions.push_back(Ion(params, trap, m, 1, x));
+        }
+        field.set_ions(ions);
+        arma::mat forces;
+        field.compute(0, forces);
+        REQUIRE(forces.n_cols == 4);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            double phi = 0;
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                REQUIRE(forces(j, i) == Approx(-0.5 * k[j] * positions[i][j]).margin(1e-30));
+                phi += 0.25 * k[j] * pow(positions[i][j], 2) / constants::q_e;
+            }
+            REQUIRE(field.potential(0, positions[i].memptr()) == Approx(phi).margin(1e-15));
+        }
+        for (unsigned int j = 0; j < 3; j++) {
+            REQUIRE(forces(j, 3) == 0);
+        }
+
+        params->field_dc = {1, 2};
+        REQUIRE_THROWS_AS(FieldMap(params, trap), const std::invalid_argument &);
+    }
+
+    SECTION("the effective potential includes the rf pseudopotential")
+    {
+        // E_rf = V k_j r_j / q, so the pseudopotential has the spring
+        // constants V^2 k_j^2 / (2 m omega_rf^2)
+        const double V = 50;
+        params->field_maps = {grid_file};
+        params->field_dc = {0};
+        params->field_rf = {V};
+        FieldMap field(params, trap);
+
+        const double r[3] = {1.3e-6, -2.7e-6, 11.1e-6};
+        double H[3][3], F[3];
+        field.effective_hessian(r, constants::q_e, m, H);
+        field.effective_force(r, constants::q_e, m, F);
+        for (unsigned int a = 0; a < 3; a++)
+        {
+            const double k_rf = V*V * k[a]*k[a] / (2 * m * pow(trap->omega_rf, 2));
+            REQUIRE(H[a][a] == Approx(k_rf).epsilon(1e-6));
+            REQUIRE(F[a] == Approx(-k_rf * r[a]).epsilon(1e-6));
+            for (unsigned int b = 0; b < 3; b++)
+            {
+                if (b != a) {
+                    REQUIRE(std::abs(H[a][b]) <= 1e-5 * k_rf);
+                }
+            }
+        }
+    }
+
+    SECTION("equilibria, modes and energies include the field map")
+    {
+        // A stiffer axial potential keeps the crystal on the grid
+        auto stiff_trap = *trap;
+        stiff_trap.U_ec *= 1000;
+        double stiff_k[3];
+        Ion(params, std::make_shared<Trap>(stiff_trap), m, 1).secular_stiffness(stiff_k);
+        const auto stiff_file = (path / "stiff.fld").string();
+        write_grid(stiff_file, stiff_k);
+
+        std::vector<arma::vec> positions;
+        arma::vec frequencies;
+        std::string energies;
+        for (const bool with_map: {false, true})
+        {
+            auto run_params = *params;
+            run_params.path = (path / (with_map ? "map" : "secular")).string();
+            run_params.num_steps = 1;
+            run_params.observables_interval = 1;
+            run_params.observables = {"trap_energy"};
+            if (with_map)
+            {
+                run_params.secular_enabled = false;
+                run_params.field_maps = {stiff_file};
+                run_params.field_dc = {1};
+            }
+
+            Simulation sim;
+            sim.set_params(run_params);
+            sim.set_trap(stiff_trap);
+            for (int i = 0; i < 3; i++) {
+                sim.add_ion(m, 1, {1e-6*i, 0.5e-6, -15e-6 + 15e-6*i});
+            }
+            REQUIRE(sim.minimize().converged);
+            const auto modes = sim.normal_modes();
+            sim.run();
+            REQUIRE(sim.status == SimStatus::FINISHED);
+
+            std::ifstream in((fs::path(run_params.path) / "observables.csv").string());
+            std::string line, record;
+            while (std::getline(in, line)) {
+                record = line;
+            }
+
+            const auto &ions = sim.get_ions();
+            if (!with_map)
+            {
+                for (const auto &ion: ions) {
+                    positions.push_back(ion.x);
+                }
+                frequencies = modes.frequencies;
+                energies = record;
+                continue;
+            }
+
+            for (size_t i = 0; i < ions.size(); i++)
+            {
+                for (unsigned int j = 0; j < 3; j++) {
+                    REQUIRE(ions[i].x[j] == Approx(positions[i][j]).margin(1e-11));
+                }
+            }
+            REQUIRE(modes.frequencies.n_elem == frequencies.n_elem);
+            for (arma::uword i = 0; i < frequencies.n_elem; i++) {
+                REQUIRE(modes.frequencies[i] == Approx(frequencies[i]).epsilon(1e-5));
+            }
+
+            // step, t, trap_energy
+            const auto energy = [](const std::string &line) {
+                return std::stod(line.substr(line.rfind(',') + 1));
+            };
+            REQUIRE(energy(energies) > 0);
+            REQUIRE(energy(record) == Approx(energy(energies)).epsilon(1e-9));
+        }
+    }
+
+    SECTION("a run with the field map matches the secular force")
+    {
+        arma::mat expected;
+        for (const bool with_map: {false, true})
+        {
+            auto run_params = *params;
+            run_params.path = (path / (with_map ? "map" : "secular")).string();
+            if (with_map)
+            {
+                run_params.secular_enabled = false;
+                run_params.field_maps = {grid_file};
+                run_params.field_dc = {1};
+            }
+
+            Simulation sim;
+            sim.set_params(run_params);
+            for (int i = 0; i < 4; i++) {
+                sim.add_ion(m, 1, {1e-6*i, 0, -30e-6 + 20e-6*i});
+            }
+            sim.run();
+            REQUIRE(sim.status == SimStatus::FINISHED);
+
+            TrajectoryReader reader((fs::path(run_params.path) / "trajectories.bin").string());
+            const auto frames = reader.read_all();
+            if (!with_map) {
+                expected = frames;
+                continue;
+            }
+            REQUIRE(frames.n_cols == expected.n_cols);
+            for (arma::uword i = 0; i < frames.n_elem; i++) {
+                REQUIRE(frames[i] == Approx(expected[i]).margin(1e-12));
+            }
+        }
+    }
+
+    fs::remove_all(path);
+}
+
+
+TEST_CASE("performance counters are accumulated per phase", "[perf]")
+{
+    std::unique_ptr<PerfCounters> perf;
+    try {
+        perf.reset(new PerfCounters({"task-clock"}));
+    }
+    catch (const std::runtime_error &) {
+        WARN("perf_event_open is not available");
+        return;
+    }
+
+    Profiler profiler;
+    profiler.attach(perf.get());
+    {
+        PhaseTimer timer(profiler, Phase::COULOMB);
+        volatile double sum = 0;
+        for (int i = 0; i < 1000000; i++) {
+            sum += std::sqrt(double(i));
+        }
+    }
+
+    const auto totals = perf->totals();
+    REQUIRE(totals.at("coulomb").at("task-clock") > 0);
+    REQUIRE(totals.at("output").at("task-clock") == 0);
+
+#ifdef _OPENMP
+    // Ensemble members run in inactive nested regions, where the team has
+    // one thread however many omp_get_max_threads() asks for
+    const int levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(1);
+    double nested_clock = -1;
+    #pragma omp parallel num_threads(2)
+    {
+        #pragma omp master
+        {
+            omp_set_num_threads(4);
+            PerfCounters nested({"task-clock"});
+            Profiler nested_profiler;
+            nested_profiler.attach(&nested);
+            {
+                PhaseTimer timer(nested_profiler, Phase::COULOMB);
+                volatile double sum = 0;
+                for (int i = 0; i < 1000000; i++) {
+                    sum += std::sqrt(double(i));
+                }
+            }
+            nested_clock = nested.totals().at("coulomb").at("task-clock");
+        }
+    }
+    omp_set_max_active_levels(levels);
+    REQUIRE(nested_clock > 0);
+#endif
+}